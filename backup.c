@@ -0,0 +1,190 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "backup.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define blocks_per_word 64
+
+void minidb_changes_init(MiniDbChangeMap *map)
+{
+    map->words = NULL;
+    map->word_count = 0;
+    map->overflow = false;
+}
+
+void minidb_changes_destroy(MiniDbChangeMap *map)
+{
+    free(map->words);
+    minidb_changes_init(map);
+}
+
+/**
+ * Grows the map so it can hold the given block. Returns false if memory could not be allocated.
+ */
+static bool changes_reserve(MiniDbChangeMap *map, int64_t block)
+{
+    int64_t needed = block / blocks_per_word + 1;
+    if (needed <= map->word_count) {
+        return true;
+    }
+
+    int64_t word_count = map->word_count > 0 ? map->word_count : 16;
+    while (word_count < needed) {
+        word_count *= 2;
+    }
+
+    uint64_t *words = realloc(map->words, word_count * sizeof(uint64_t));
+    if (is_null(words)) {
+        return false;
+    }
+
+    memset(words + map->word_count, 0, (word_count - map->word_count) * sizeof(uint64_t));
+    map->words = words;
+    map->word_count = word_count;
+    return true;
+}
+
+void minidb_changes_mark(MiniDbChangeMap *map, int64_t offset, int64_t length)
+{
+    if (length <= 0) {
+        return;
+    }
+
+    int64_t first = offset / MINIDB_BACKUP_BLOCK_SIZE;
+    int64_t last = (offset + length - 1) / MINIDB_BACKUP_BLOCK_SIZE;
+    if (!changes_reserve(map, last)) {
+        map->overflow = true;
+        return;
+    }
+
+    for (int64_t block = first; block <= last; block++) {
+        map->words[block / blocks_per_word] |= UINT64_C(1) << (block % blocks_per_word);
+    }
+}
+
+bool minidb_changes_test(const MiniDbChangeMap *map, int64_t block)
+{
+    int64_t word = block / blocks_per_word;
+    return map->overflow || (word < map->word_count && (map->words[word] & (UINT64_C(1) << (block % blocks_per_word))) != 0);
+}
+
+int64_t minidb_changes_count(const MiniDbChangeMap *map)
+{
+    int64_t count = 0;
+    for (int64_t i = 0; i < map->word_count; i++) {
+        count += __builtin_popcountll(map->words[i]);
+    }
+
+    return count;
+}
+
+void minidb_changes_clear(MiniDbChangeMap *map)
+{
+    if (map->word_count > 0) {
+        memset(map->words, 0, map->word_count * sizeof(uint64_t));
+    }
+
+    map->overflow = false;
+}
+
+void minidb_changes_swap(MiniDbChangeMap *a, MiniDbChangeMap *b)
+{
+    MiniDbChangeMap tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/**
+ * Fallback for systems (or file system pairs) without copy_file_range.
+ */
+static MiniDbState backup_copy_buffered(int source_fd, int target_fd, int64_t offset, int64_t length)
+{
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (is_null(buffer)) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    MiniDbState state = MINIDB_OK;
+    while (length > 0) {
+        size_t chunk = length > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t) length;
+        ssize_t read_bytes = pread(source_fd, buffer, chunk, offset);
+        if (read_bytes <= 0) {
+            // The source is shorter than expected, the caller truncates the target to the right size
+            break;
+        }
+
+        if (pwrite(target_fd, buffer, read_bytes, offset) != read_bytes) {
+            state = MINIDB_ERROR;
+            break;
+        }
+
+        offset += read_bytes;
+        length -= read_bytes;
+    }
+
+    free(buffer);
+    return state;
+}
+
+MiniDbState minidb_backup_copy_range(int source_fd, int target_fd, int64_t offset, int64_t length)
+{
+#ifdef __linux__
+    // copy_file_range lets the kernel (or the file system, with reflinks) do the copy without going through user space
+    while (length > 0) {
+        loff_t source_offset = offset;
+        loff_t target_offset = offset;
+        ssize_t copied = copy_file_range(source_fd, &source_offset, target_fd, &target_offset, length, 0);
+        if (copied < 0) {
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+                break;
+            }
+
+            return MINIDB_ERROR;
+        } else if (copied == 0) {
+            return MINIDB_OK;
+        }
+
+        offset += copied;
+        length -= copied;
+    }
+#endif
+
+    return backup_copy_buffered(source_fd, target_fd, offset, length);
+}
+
+MiniDbState minidb_backup_copy_blocks(int source_fd, int target_fd, const MiniDbChangeMap *map, int64_t file_size)
+{
+    int64_t block_count = (file_size + MINIDB_BACKUP_BLOCK_SIZE - 1) / MINIDB_BACKUP_BLOCK_SIZE;
+    int64_t block = 0;
+
+    while (block < block_count) {
+        if (!minidb_changes_test(map, block)) {
+            block++;
+            continue;
+        }
+
+        int64_t first = block;
+        while (block < block_count && minidb_changes_test(map, block)) {
+            block++;
+        }
+
+        int64_t offset = first * MINIDB_BACKUP_BLOCK_SIZE;
+        int64_t end = block * MINIDB_BACKUP_BLOCK_SIZE;
+        if (end > file_size) {
+            end = file_size;
+        }
+
+        MiniDbState state = minidb_backup_copy_range(source_fd, target_fd, offset, end - offset);
+        if (state != MINIDB_OK) {
+            return state;
+        }
+    }
+
+    return MINIDB_OK;
+}
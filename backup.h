@@ -0,0 +1,61 @@
+#pragma once
+
+#include "minidb.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * The data file is tracked in blocks of this size.
+ */
+#define MINIDB_BACKUP_BLOCK_SIZE 4096
+
+/**
+ * A bitmap with one bit per block of the data file, set when the block is written.
+ */
+typedef struct MiniDbChangeMap
+{
+    uint64_t *words;
+    int64_t word_count;
+    bool overflow; // A block could not be marked, so every block counts as changed until the map is cleared
+} MiniDbChangeMap;
+
+void minidb_changes_init(MiniDbChangeMap *map);
+
+void minidb_changes_destroy(MiniDbChangeMap *map);
+
+/**
+ * Marks every block touched by the byte range [offset, offset + length). If the map cannot grow to hold
+ * them, it overflows instead (see MiniDbChangeMap.overflow).
+ */
+void minidb_changes_mark(MiniDbChangeMap *map, int64_t offset, int64_t length);
+
+/**
+ * Returns true if the block is marked, or if the map overflowed.
+ */
+bool minidb_changes_test(const MiniDbChangeMap *map, int64_t block);
+
+/**
+ * Returns the number of marked blocks, not counting the ones lost to an overflow.
+ */
+int64_t minidb_changes_count(const MiniDbChangeMap *map);
+
+void minidb_changes_clear(MiniDbChangeMap *map);
+
+/**
+ * Exchanges the contents of two maps.
+ */
+void minidb_changes_swap(MiniDbChangeMap *a, MiniDbChangeMap *b);
+
+/**
+ * Copies a byte range between two files, using copy_file_range when available.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_backup_copy_range(int source_fd, int target_fd, int64_t offset, int64_t length);
+
+/**
+ * Copies the marked blocks below file_size between two files. Consecutive blocks are copied with a single request.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_backup_copy_blocks(int source_fd, int target_fd, const MiniDbChangeMap *map, int64_t file_size);
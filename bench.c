@@ -0,0 +1,528 @@
+#include "minidb.h"
+#include "crc32c.h"
+#include "filter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BENCH_ROWS 1000000
+#define BENCH_LOOKUPS 1000000
+#define BENCH_PATH "minidb-bench.db"
+#define BENCH_REPLICA_PATH "minidb-bench-replica.db"
+
+typedef struct BenchRow
+{
+    int64_t id;
+    char payload[56];
+} BenchRow;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the i-th stored key. Only even keys are stored, inserted in a scrambled order so the tree stays shallow.
+ */
+static int64_t bench_key(int64_t i)
+{
+    return ((i * 7919) % BENCH_ROWS) * 2;
+}
+
+static void bench_create(void)
+{
+    MiniDb *db;
+    MiniDbState state = minidb_create(&db, BENCH_PATH, sizeof(BenchRow));
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    BenchRow row = {0};
+    minidb_begin(db);
+    for (int64_t i = 0; i < BENCH_ROWS; i++) {
+        row.id = bench_key(i);
+        minidb_insert(db, row.id, &row);
+    }
+
+    minidb_commit(db);
+    minidb_close(&db);
+}
+
+/**
+ * Measures the false positive rate of the filter for several sizes, looking up keys that were not added.
+ */
+static void bench_filter_fpr(void)
+{
+    static const int bits_per_key[] = {4, 6, 8, 10, 12, 16};
+
+    puts("bits/key  blocks     false positives");
+    for (size_t b = 0; b < sizeof(bits_per_key) / sizeof(bits_per_key[0]); b++) {
+        MiniDbFilter filter;
+        filter.block_count = minidb_filter_block_count(BENCH_ROWS, bits_per_key[b]);
+        filter.blocks = calloc(filter.block_count, MINIDB_FILTER_BLOCK_WORDS * sizeof(uint32_t));
+        if (is_null(filter.blocks)) {
+            puts("Fatal error: out of memory");
+            exit(1);
+        }
+
+        for (int64_t i = 0; i < BENCH_ROWS; i++) {
+            minidb_filter_add(&filter, bench_key(i));
+        }
+
+        int64_t false_positives = 0;
+        for (int64_t i = 0; i < BENCH_LOOKUPS; i++) {
+            false_positives += minidb_filter_may_contain(&filter, bench_key(i) + 1);
+        }
+
+        printf("%8d  %-9lld  %.3f%%\n", bits_per_key[b], (long long) filter.block_count,
+               100.0 * (double) false_positives / BENCH_LOOKUPS);
+        free(filter.blocks);
+    }
+}
+
+/**
+ * Measures the latency of lookups of absent keys (select and duplicate checks) and present keys.
+ */
+static void bench_filter_lookups(const char *label, int filter_bits_per_key)
+{
+    MiniDbOptions options = {0};
+    options.filter_bits_per_key = filter_bits_per_key;
+
+    MiniDb *db;
+    MiniDbState state = minidb_open_ex(&db, BENCH_PATH, &options);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    BenchRow row;
+    double start = bench_now();
+    for (int64_t i = 0; i < BENCH_LOOKUPS; i++) {
+        minidb_select(db, bench_key(i) + 1, &row);
+    }
+
+    double miss = bench_now() - start;
+
+    // Updates of absent keys only run the existence check
+    start = bench_now();
+    for (int64_t i = 0; i < BENCH_LOOKUPS; i++) {
+        minidb_update(db, bench_key(i) + 1, &row);
+    }
+
+    double check = bench_now() - start;
+
+    start = bench_now();
+    for (int64_t i = 0; i < BENCH_LOOKUPS; i++) {
+        minidb_select(db, bench_key(i), &row);
+    }
+
+    double hit = bench_now() - start;
+    printf("%-10s  miss %6.1f ns  exists check %6.1f ns  hit %6.1f ns\n", label,
+           miss * 1e9 / BENCH_LOOKUPS, check * 1e9 / BENCH_LOOKUPS, hit * 1e9 / BENCH_LOOKUPS);
+    minidb_close(&db);
+}
+
+static void bench_filter(void)
+{
+    puts("== Bloom filter ==");
+    bench_filter_fpr();
+    puts("");
+    // Closing the database rewrites the index without the filter, so this one runs last
+    bench_filter_lookups("filter", 0);
+    bench_filter_lookups("no filter", -1);
+    puts("");
+}
+
+static int64_t bench_scan_sum;
+
+static void bench_scan_serial(int64_t key, void *row)
+{
+    bench_scan_sum += key + ((BenchRow *) row)->id;
+}
+
+static void *bench_scan_init(void *context)
+{
+    (void) context;
+    return calloc(1, sizeof(int64_t));
+}
+
+static void bench_scan_row(int64_t key, void *row, void *state)
+{
+    *(int64_t *) state += key + ((BenchRow *) row)->id;
+}
+
+static void bench_scan_reduce(void *state, void *context)
+{
+    *(int64_t *) context += *(int64_t *) state;
+    free(state);
+}
+
+/**
+ * Compares the serial full-table scan with the parallel one for several thread counts.
+ */
+static void bench_scan(void)
+{
+    static const int thread_counts[] = {1, 2, 4, 8, 16, 32};
+
+    puts("== Full-table scan ==");
+    MiniDb *db;
+    MiniDbState state = minidb_open(&db, BENCH_PATH);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    bench_scan_sum = 0;
+    double start = bench_now();
+    minidb_select_all(db, bench_scan_serial);
+    printf("select_all           %7.1f ms\n", (bench_now() - start) * 1e3);
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int64_t sum = 0;
+        MiniDbParallelScan scan = {thread_counts[t], bench_scan_init, bench_scan_row, bench_scan_reduce, &sum};
+        start = bench_now();
+        minidb_select_all_parallel(db, &scan);
+        printf("parallel, %2d threads %7.1f ms%s\n", thread_counts[t], (bench_now() - start) * 1e3,
+               sum == bench_scan_sum ? "" : " (wrong result)");
+    }
+
+    minidb_close(&db);
+    puts("");
+}
+
+/**
+ * Asks the kernel to drop the cached pages of the database, so the next scan reads from the device.
+ */
+static void bench_drop_cache(void)
+{
+    int fd = open(BENCH_PATH, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+}
+
+static void bench_range_row(int64_t key, void *row, void *context)
+{
+    *(int64_t *) context += key + ((BenchRow *) row)->id;
+}
+
+/**
+ * Measures the scan throughput with cold and warm caches. Rows were inserted in a scrambled key order,
+ * so key-ordered scans read the data file at random while the parallel scan reads it sequentially.
+ */
+static void bench_prefetch(void)
+{
+    puts("== Scan throughput ==");
+    MiniDb *db;
+    MiniDbState state = minidb_open(&db, BENCH_PATH);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    for (int cold = 1; cold >= 0; cold--) {
+        const char *label = cold ? "cold" : "warm";
+
+        if (cold) {
+            bench_drop_cache();
+        }
+
+        bench_scan_sum = 0;
+        double start = bench_now();
+        minidb_select_all(db, bench_scan_serial);
+        double elapsed = bench_now() - start;
+        printf("select_all, key order      %s %8.1f ms %7.2f Mrows/s\n", label, elapsed * 1e3, BENCH_ROWS / elapsed / 1e6);
+
+        if (cold) {
+            bench_drop_cache();
+        }
+
+        int64_t sum = 0;
+        start = bench_now();
+        minidb_select_range(db, 0, BENCH_ROWS / 5, bench_range_row, &sum);
+        elapsed = bench_now() - start;
+        printf("select_range, 10%% of keys  %s %8.1f ms %7.2f Mrows/s\n", label, elapsed * 1e3, BENCH_ROWS / 10 / elapsed / 1e6);
+
+        if (cold) {
+            bench_drop_cache();
+        }
+
+        sum = 0;
+        MiniDbParallelScan scan = {1, bench_scan_init, bench_scan_row, bench_scan_reduce, &sum};
+        start = bench_now();
+        minidb_select_all_parallel(db, &scan);
+        elapsed = bench_now() - start;
+        printf("parallel, file order       %s %8.1f ms %7.2f Mrows/s\n", label, elapsed * 1e3, BENCH_ROWS / elapsed / 1e6);
+    }
+
+    minidb_close(&db);
+    puts("");
+}
+
+/**
+ * Measures the size of the index file, the time to open the database with the index out of the page
+ * cache and the latency of lookups of present keys.
+ */
+static void bench_index(void)
+{
+    puts("== Index file ==");
+    struct stat st;
+    if (stat(BENCH_PATH "-index", &st) == 0) {
+        printf("size              %8.2f MiB  %5.2f bytes/entry (filter included)\n",
+               (double) st.st_size / (1024 * 1024), (double) st.st_size / BENCH_ROWS);
+    }
+
+    int fd = open(BENCH_PATH "-index", O_RDONLY);
+    if (fd >= 0) {
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(fd);
+    }
+
+    MiniDb *db;
+    double start = bench_now();
+    MiniDbState state = minidb_open(&db, BENCH_PATH);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    printf("open              %8.3f ms\n", (bench_now() - start) * 1e3);
+
+    BenchRow row;
+    for (int pass = 0; pass < 2; pass++) {
+        start = bench_now();
+        for (int64_t i = 0; i < BENCH_LOOKUPS; i++) {
+            minidb_select(db, bench_key(i), &row);
+        }
+
+        printf("hit lookup, %s  %8.1f ns\n", pass == 0 ? "cold" : "warm", (bench_now() - start) * 1e9 / BENCH_LOOKUPS);
+    }
+
+    minidb_close(&db);
+    puts("");
+}
+
+/**
+ * Compares deleting expired rows one by one, as an external sweeper would, with reclaiming them in a batch.
+ */
+static void bench_ttl(void)
+{
+    enum { SWEEP_ROWS = 200, EXPIRED_ROWS = 100000 };
+
+    puts("== Expired rows ==");
+    MiniDb *db;
+    MiniDbState state = minidb_open(&db, BENCH_PATH);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    // Every delete persists the index on its own
+    double start = bench_now();
+    for (int64_t i = 0; i < SWEEP_ROWS; i++) {
+        minidb_delete(db, bench_key(i));
+    }
+
+    double sweep = (bench_now() - start) / SWEEP_ROWS;
+    printf("delete per row        %8.2f ms  (%.1f s for %d rows)\n", sweep * 1e3, sweep * EXPIRED_ROWS, EXPIRED_ROWS);
+
+    minidb_begin(db);
+    for (int64_t i = SWEEP_ROWS; i < SWEEP_ROWS + EXPIRED_ROWS; i++) {
+        minidb_set_ttl(db, bench_key(i), 1);
+    }
+
+    minidb_commit(db);
+    usleep(10000);
+
+    int64_t reclaimed = 0;
+    start = bench_now();
+    minidb_reclaim_expired(db, &reclaimed);
+    double batch = bench_now() - start;
+    printf("reclaim in one batch  %8.2f ms  (%lld rows)\n", batch * 1e3, (long long) reclaimed);
+
+    minidb_close(&db);
+    puts("");
+}
+
+/**
+ * Compares a replica applying the change log in batches with applying every change on its own, and
+ * shows the lag of the replica before and after catching up.
+ */
+static void bench_replica(void)
+{
+    enum { SINGLE_CHANGES = 100, LOGGED_CHANGES = 100000 };
+
+    puts("== Replica ==");
+    MiniDbOptions options = {0};
+    options.sync_policy = MINIDB_SYNC_CHECKPOINT;
+    options.change_log = true;
+    MiniDb *db;
+    MiniDbState state = minidb_open_ex(&db, BENCH_PATH, &options);
+    if (state == MINIDB_OK) {
+        state = minidb_backup(db, BENCH_REPLICA_PATH);
+    }
+
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    // Every delete and insert is a batch of its own in the change log
+    BenchRow row = {0};
+    for (int64_t i = 0; i < LOGGED_CHANGES / 2; i++) {
+        row.id = bench_key(i);
+        minidb_delete(db, row.id);
+        minidb_insert(db, row.id, &row);
+    }
+
+    minidb_checkpoint(db);
+
+    MiniDbReplica *replica;
+    state = minidb_replica_open(&replica, BENCH_REPLICA_PATH, BENCH_PATH, NULL);
+    if (state != MINIDB_OK) {
+        printf("Fatal error: %s\n", minidb_error_get_str(state));
+        exit(1);
+    }
+
+    // What a replica that journals and persists every change on its own would pay
+    MiniDb *copy = minidb_replica_db(replica);
+    double start = bench_now();
+    for (int64_t i = 0; i < SINGLE_CHANGES; i++) {
+        row.id = bench_key(BENCH_ROWS - 1 - i);
+        minidb_begin(copy);
+        if (i % 2 == 0) {
+            minidb_delete(copy, row.id);
+        } else {
+            minidb_insert(copy, row.id, &row);
+        }
+
+        minidb_commit(copy);
+    }
+
+    double single = (bench_now() - start) / SINGLE_CHANGES;
+    printf("apply per change      %8.2f ms  (%.1f s for %d changes)\n", single * 1e3, single * LOGGED_CHANGES, LOGGED_CHANGES);
+
+    MiniDbReplicaStatus status;
+    minidb_replica_get_status(replica, &status);
+    printf("lag before            %8lld bytes, %lld ms\n", (long long) status.lag_bytes, (long long) status.lag_ms);
+
+    int64_t applied;
+    start = bench_now();
+    minidb_replica_poll(replica, &applied);
+    double batched = bench_now() - start;
+    minidb_replica_get_status(replica, &status);
+    printf("apply in batches      %8.2f ms  (%lld changes, %lld batches)\n", batched * 1e3, (long long) applied, (long long) status.applied_batches);
+    printf("lag after             %8lld bytes, %lld ms\n", (long long) status.lag_bytes, (long long) status.lag_ms);
+
+    minidb_replica_close(&replica);
+    minidb_close(&db);
+    remove(BENCH_PATH "-changes");
+    remove(BENCH_REPLICA_PATH);
+    remove(BENCH_REPLICA_PATH "-index");
+    remove(BENCH_REPLICA_PATH "-replica");
+    puts("");
+}
+
+/**
+ * Measures the throughput of CRC32C with the crc32 instruction and with slicing-by-8, and the time
+ * minidb_verify takes to check the whole database, with the data file in and out of the page cache.
+ */
+static void bench_checksum(void)
+{
+    puts("== Checksums ==");
+    size_t size = 64 * 1024 * 1024;
+    uint8_t *buffer = malloc(size);
+    if (is_null(buffer)) {
+        return;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = (uint8_t) (i * 2654435761u >> 24);
+    }
+
+    uint32_t (*crc[2])(uint32_t, const void *, size_t) = {minidb_crc32c, minidb_crc32c_portable};
+    const char *labels[2] = {minidb_crc32c_hardware() ? "crc32 instruction" : "default          ", "slicing-by-8     "};
+    for (int c = 0; c < 2; c++) {
+        crc[c](0, buffer, size); // Warms up the tables and the buffer
+        double start = bench_now();
+        uint32_t checksum = 0;
+        for (int pass = 0; pass < 4; pass++) {
+            checksum = crc[c](checksum, buffer, size);
+        }
+
+        double elapsed = bench_now() - start;
+        printf("crc32c, %s %8.0f MB/s (%08x)\n", labels[c], 4 * size / elapsed / 1e6, checksum);
+    }
+
+    free(buffer);
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 0) {
+            bench_drop_cache();
+        }
+
+        MiniDbVerifyReport report;
+        double start = bench_now();
+        MiniDbState state = minidb_verify(BENCH_PATH, 0, &report);
+        double elapsed = bench_now() - start;
+        printf("verify, %s          %8.1f ms %7.0f MB/s  %lld rows, %s\n", pass == 0 ? "cold" : "warm", elapsed * 1e3,
+               report.bytes_read / elapsed / 1e6, (long long) report.rows_checked, minidb_error_get_str(state));
+    }
+
+    puts("");
+}
+
+int main(int argc, char **argv)
+{
+    const char *name = argc > 1 ? argv[1] : "all";
+
+    printf("Creating %d rows... ", BENCH_ROWS);
+    fflush(stdout);
+    bench_create();
+    puts("Ok!\n");
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "filter") == 0) {
+        bench_filter();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "scan") == 0) {
+        bench_scan();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "prefetch") == 0) {
+        bench_prefetch();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "index") == 0) {
+        bench_index();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "ttl") == 0) {
+        bench_ttl();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "replica") == 0) {
+        bench_replica();
+    }
+
+    if (strcmp(name, "all") == 0 || strcmp(name, "checksum") == 0) {
+        bench_checksum();
+    }
+
+    remove(BENCH_PATH);
+    remove(BENCH_PATH "-index");
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "btree.h"
+#include "prefetch.h"
 #include <assert.h>
 #include <stdlib.h>
 
@@ -7,8 +8,7 @@
 #endif
 
 #define tree_is_empty(tree) ((tree)->size == 0)
-#define node_is_leaf(node) (is_null((node)->left) && is_null((node)->right))
-#define node_is_branch(node) (!is_null((node)->left) && !is_null((node)->right))
+#define node_height(node) (is_null(node) ? 0 : (node)->height)
 
 /**
  * Creates a new empty node.
@@ -21,17 +21,92 @@ static BTreeNode *node_create(int64_t key, int64_t value)
         node->value = value;
         node->left = NULL;
         node->right = NULL;
+        node->height = 1;
     }
 
     return node;
 }
 
+static void node_update_height(BTreeNode *node)
+{
+    int left = node_height(node->left);
+    int right = node_height(node->right);
+    node->height = 1 + (left > right ? left : right);
+}
+
+static BTreeNode *node_rotate_left(BTreeNode *node)
+{
+    BTreeNode *right = node->right;
+    node->right = right->left;
+    right->left = node;
+    node_update_height(node);
+    node_update_height(right);
+    return right;
+}
+
+static BTreeNode *node_rotate_right(BTreeNode *node)
+{
+    BTreeNode *left = node->left;
+    node->left = left->right;
+    left->right = node;
+    node_update_height(node);
+    node_update_height(left);
+    return left;
+}
+
+/**
+ * Restores the balance of a node whose subtrees changed height by at most one, and returns the node
+ * that takes its place.
+ */
+static BTreeNode *node_balance(BTreeNode *node)
+{
+    int balance = node_height(node->left) - node_height(node->right);
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = node_rotate_left(node->left);
+        }
+
+        return node_rotate_right(node);
+    } else if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = node_rotate_right(node->right);
+        }
+
+        return node_rotate_left(node);
+    }
+
+    node_update_height(node);
+    return node;
+}
+
 void btree_init(BTree *tree)
 {
     tree->size = 0;
     tree->root = NULL;
 }
 
+/**
+ * Recursively builds a balanced subtree from the sorted range [first, last).
+ */
+static BTreeNode *btree_node_build_recursive(const int64_t *pairs, int64_t first, int64_t last, bool *ok)
+{
+    if (first >= last || !*ok) {
+        return NULL;
+    }
+
+    int64_t middle = first + (last - first) / 2;
+    BTreeNode *node = node_create(pairs[middle * 2], pairs[middle * 2 + 1]);
+    if (is_null(node)) {
+        *ok = false;
+        return NULL;
+    }
+
+    node->left = btree_node_build_recursive(pairs, first, middle, ok);
+    node->right = btree_node_build_recursive(pairs, middle + 1, last, ok);
+    node_update_height(node);
+    return node;
+}
+
 /**
  * Recursively destroys tree nodes.
  */
@@ -53,10 +128,26 @@ void btree_destroy(BTree *tree)
     }
 }
 
+bool btree_build_sorted(BTree *tree, const int64_t *pairs, int64_t count)
+{
+    assert(tree_is_empty(tree));
+    bool ok = true;
+    tree->root = btree_node_build_recursive(pairs, 0, count, &ok);
+    tree->size = count;
+    if (!ok) {
+        btree_destroy(tree);
+    }
+
+    return ok;
+}
+
 bool btree_contains(const BTree *tree, int64_t key)
 {
     BTreeNode *current = tree->root;
     while (!is_null(current)) {
+        // Both children are requested while this node is compared, so the next step does not wait for memory
+        minidb_prefetch(current->left);
+        minidb_prefetch(current->right);
         if (current->key == key) {
             return true;
         }
@@ -70,13 +161,13 @@ bool btree_contains(const BTree *tree, int64_t key)
 /**
  * Recursively searches for a node that matches the given key.
  */
-static BTreeNode *btree_node_search_recursive(BTreeNode *node, int64_t key, BTreeNode **parent)
+static BTreeNode *btree_node_search_recursive(BTreeNode *node, int64_t key)
 {
-    BTreeNode *last = NULL;
     BTreeNode *current = node;
 
     while (current != NULL && current->key != key) {
-        last = current;
+        minidb_prefetch(current->left);
+        minidb_prefetch(current->right);
         if (key < current->key) {
             current = current->left;
         } else {
@@ -84,47 +175,41 @@ static BTreeNode *btree_node_search_recursive(BTreeNode *node, int64_t key, BTre
         }
     }
 
-    if (!is_null(parent)) {
-        *parent = last;
-    }
-
     return current;
 }
 
 BTreeNode *btree_search(const BTree *tree, int64_t key)
 {
     if (tree->size > 0) {
-        return btree_node_search_recursive(tree->root, key, NULL);
+        return btree_node_search_recursive(tree->root, key);
     }
 
     return NULL;
 }
 
 /**
- * Recursively inserts a new node in the tree.
+ * Recursively inserts a new node in the subtree and returns the root of the rebalanced subtree.
  */
-static BTreeNode *btree_node_insert_recursive(BTreeNode *parent, int64_t key, int64_t value)
+static BTreeNode *btree_node_insert_recursive(BTreeNode *node, int64_t key, int64_t value, BTreeNode **new_node)
 {
-    BTreeNode **child = key < parent->key ? &parent->left : &parent->right;
-    if (is_null(*child)) {
-        *child = node_create(key, value);
-        return *child;
+    if (is_null(node)) {
+        *new_node = node_create(key, value);
+        return *new_node;
+    }
+
+    if (key < node->key) {
+        node->left = btree_node_insert_recursive(node->left, key, value, new_node);
     } else {
-        return btree_node_insert_recursive(*child, key, value);
+        node->right = btree_node_insert_recursive(node->right, key, value, new_node);
     }
+
+    return node_balance(node);
 }
 
 BTreeNode *btree_insert(BTree *tree, int64_t key, int64_t value)
 {
     BTreeNode *new_node = NULL;
-    if (tree_is_empty(tree)) {
-        assert(tree->root == NULL);
-        new_node = node_create(key, value);
-        tree->root = new_node;
-    } else {
-        new_node = btree_node_insert_recursive(tree->root, key, value);
-    }
-
+    tree->root = btree_node_insert_recursive(tree->root, key, value, &new_node);
     if (!is_null(new_node)) {
         tree->size++;
     }
@@ -133,79 +218,66 @@ BTreeNode *btree_insert(BTree *tree, int64_t key, int64_t value)
 }
 
 /**
- * Finds the node that contains the smallest key.
+ * Detaches the node that contains the smallest key of the subtree, and returns the root of the rebalanced subtree.
  */
-static BTreeNode *btree_node_search_successor(BTreeNode *node)
+static BTreeNode *btree_node_remove_min(BTreeNode *node, BTreeNode **min)
 {
-    while (!is_null(node->left)) {
-        node = node->left;
+    if (is_null(node->left)) {
+        *min = node;
+        return node->right;
     }
 
-    return node;
+    node->left = btree_node_remove_min(node->left, min);
+    return node_balance(node);
 }
 
 /**
- * Recursively removes a node from the tree.
+ * Recursively removes a node from the subtree and returns the root of the rebalanced subtree.
  */
-static bool btree_node_remove_recursive(BTreeNode **root, int64_t key, int64_t *value)
+static BTreeNode *btree_node_remove_recursive(BTreeNode *node, int64_t key, int64_t *value, bool *removed)
 {
-    BTreeNode *parent = NULL;
-    BTreeNode *current = btree_node_search_recursive(*root, key, &parent);
-
-    if (is_null(current)) {
-        return false;
+    if (is_null(node)) {
+        return NULL;
     }
 
-    if (!is_null(value)) {
-        *value = current->value;
-    }
-
-    if (node_is_leaf(current)) {
-        if (current != *root) {
-            if (current == parent->left) {
-                parent->left = NULL;
-            } else {
-                parent->right = NULL;
-            }
-        } else {
-            *root = NULL;
+    if (key < node->key) {
+        node->left = btree_node_remove_recursive(node->left, key, value, removed);
+    } else if (key > node->key) {
+        node->right = btree_node_remove_recursive(node->right, key, value, removed);
+    } else {
+        BTreeNode *left = node->left;
+        BTreeNode *right = node->right;
+        if (!is_null(value)) {
+            *value = node->value;
         }
 
-        free(current);
-    } else if (node_is_branch(current)) {
-        BTreeNode *successor = btree_node_search_successor(current->right);
-        int64_t subkey = successor->key;
-        int64_t old_val = successor->value;
-        btree_node_remove_recursive(root, subkey, NULL);
-        current->key = subkey;
-        current->value = old_val;
-    } else {
-        BTreeNode *child = !is_null(current->left) ? current->left : current->right;
-        if (current != *root) {
-            if (current == parent->left) {
-                parent->left = child;
-            } else {
-                parent->right = child;
-            }
-        } else {
-            *root = child;
+        *removed = true;
+        free(node);
+        if (is_null(right)) {
+            return left;
         }
 
-        free(current);
+        // The successor takes the place of the removed node
+        BTreeNode *successor;
+        right = btree_node_remove_min(right, &successor);
+        successor->left = left;
+        successor->right = right;
+        return node_balance(successor);
     }
 
-    return true;
+    return node_balance(node);
 }
 
 bool btree_remove(BTree *tree, int64_t key, int64_t *address)
 {
+    bool removed = false;
     if (!tree_is_empty(tree)) {
-        if (btree_node_remove_recursive(&tree->root, key, address)) {
+        tree->root = btree_node_remove_recursive(tree->root, key, address, &removed);
+        if (removed) {
             tree->size--;
             assert(tree->size >= 0);
-            return true;
         }
     }
 
-    return false;
+    return removed;
 }
@@ -3,12 +3,17 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * A node of an AVL tree: the heights of the two subtrees of every node differ by at most one, so keys
+ * inserted in order (e.g. increasing row keys) do not degrade the tree into a list.
+ */
 typedef struct BTreeNode
 {
     int64_t key;
     int64_t value;
     struct BTreeNode *left;
     struct BTreeNode *right;
+    int height;
 } BTreeNode;
 
 typedef struct BTree
@@ -24,6 +29,17 @@ typedef struct BTree
  */
 void btree_init(BTree *tree);
 
+/**
+ * Builds a balanced tree from keys sorted in ascending order. The tree must be empty.
+ *
+ * @param tree The tree to build.
+ * @param pairs The sorted keys, each one followed by its value.
+ * @param count The number of key-value pairs.
+ *
+ * @return True on success, false if a node could not be allocated.
+ */
+bool btree_build_sorted(BTree *tree, const int64_t *pairs, int64_t count);
+
 /**
  * Deallocates the memory used by the tree and its nodes.
  *
@@ -0,0 +1,376 @@
+#include "changelog.h"
+#include "crc32c.h"
+#include "expiry.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CHANGELOG_MAGIC UINT64_C(0x31474E484342444D) // "MDBCHNG1"
+#define CHANGELOG_VERSION UINT64_C(2)
+#define CHANGELOG_COMMIT 1
+#define CHANGELOG_READ_AHEAD (1024 * 1024)
+
+typedef struct MiniDbChangeLogHeader
+{
+    uint64_t magic;
+    uint64_t version;
+} MiniDbChangeLogHeader;
+
+/**
+ * Stored before the data of every change. The checksum covers the rest of the record and the data.
+ */
+typedef struct MiniDbChangeRecord
+{
+    uint32_t checksum;
+    uint32_t reserved;
+    int64_t timestamp;
+    int32_t type;
+    int32_t flags;
+    int64_t key;
+    uint64_t length;
+} MiniDbChangeRecord;
+
+/**
+ * CRC32C of the record, except its checksum, followed by its data.
+ */
+static uint32_t changelog_checksum(const MiniDbChangeRecord *record, const void *data)
+{
+    uint32_t checksum = minidb_crc32c(0, &record->reserved, sizeof(MiniDbChangeRecord) - sizeof(uint32_t));
+    return minidb_crc32c(checksum, data, record->length);
+}
+
+static bool changelog_pread(int fd, void *buffer, size_t size, int64_t offset)
+{
+    unsigned char *bytes = buffer;
+    while (size > 0) {
+        ssize_t read_bytes = pread(fd, bytes, size, offset);
+        if (read_bytes <= 0) {
+            return false;
+        }
+
+        bytes += read_bytes;
+        size -= read_bytes;
+        offset += read_bytes;
+    }
+
+    return true;
+}
+
+static MiniDbState changelog_check_header(int fd)
+{
+    MiniDbChangeLogHeader header;
+    if (!changelog_pread(fd, &header, sizeof(header), 0)
+        || header.magic != CHANGELOG_MAGIC
+        || header.version != CHANGELOG_VERSION) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    return MINIDB_OK;
+}
+
+static const unsigned char *changelog_change_at(MiniDbChangeLogReader *reader, int64_t position, MiniDbChangeRecord *record);
+
+void minidb_changelog_init(MiniDbChangeLog *log)
+{
+    log->fd = -1;
+    log->size = 0;
+    log->buffer = NULL;
+    log->buffer_size = 0;
+    log->buffer_capacity = 0;
+    log->last_change = 0;
+    log->failed = false;
+}
+
+MiniDbState minidb_changelog_open(MiniDbChangeLog *log, const char *path)
+{
+    minidb_changelog_init(log);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    if (st.st_size == 0) {
+        MiniDbChangeLogHeader header = {CHANGELOG_MAGIC, CHANGELOG_VERSION};
+        if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+            close(fd);
+            return MINIDB_ERROR;
+        }
+
+        log->fd = fd;
+        log->size = MINIDB_CHANGELOG_START;
+        return MINIDB_OK;
+    }
+
+    MiniDbState state = changelog_check_header(fd);
+    if (state != MINIDB_OK) {
+        close(fd);
+        return state;
+    }
+
+    // Find the end of the last complete batch, validating every change on the way
+    MiniDbChangeLogReader reader = {fd, NULL, 0, 0, 0};
+    MiniDbChangeRecord record;
+    int64_t position = MINIDB_CHANGELOG_START;
+    int64_t next = position;
+    while (!is_null(changelog_change_at(&reader, next, &record))) {
+        next += sizeof(MiniDbChangeRecord) + record.length;
+        if (record.flags & CHANGELOG_COMMIT) {
+            position = next;
+        }
+    }
+
+    free(reader.window);
+    if (position < st.st_size && ftruncate(fd, position) != 0) {
+        close(fd);
+        return MINIDB_ERROR;
+    }
+
+    log->fd = fd;
+    log->size = position;
+    return MINIDB_OK;
+}
+
+void minidb_changelog_close(MiniDbChangeLog *log)
+{
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+
+    free(log->buffer);
+    minidb_changelog_init(log);
+}
+
+void minidb_changelog_append(MiniDbChangeLog *log, MiniDbOpType type, int64_t key, const void *data, size_t length)
+{
+    if (log->fd < 0 || log->failed) {
+        return;
+    }
+
+    size_t needed = log->buffer_size + sizeof(MiniDbChangeRecord) + length;
+    if (needed > log->buffer_capacity) {
+        size_t capacity = log->buffer_capacity > 0 ? log->buffer_capacity : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+
+        unsigned char *buffer = realloc(log->buffer, capacity);
+        if (is_null(buffer)) {
+            log->failed = true;
+            return;
+        }
+
+        log->buffer = buffer;
+        log->buffer_capacity = capacity;
+    }
+
+    MiniDbChangeRecord record = {0, 0, minidb_expiry_now(), (int32_t) type, 0, key, length};
+    record.checksum = changelog_checksum(&record, data);
+    memcpy(log->buffer + log->buffer_size, &record, sizeof(record));
+    if (length > 0) {
+        memcpy(log->buffer + log->buffer_size + sizeof(record), data, length);
+    }
+
+    log->last_change = log->buffer_size;
+    log->buffer_size = needed;
+}
+
+MiniDbState minidb_changelog_commit(MiniDbChangeLog *log)
+{
+    if (log->fd < 0 || (log->buffer_size == 0 && !log->failed)) {
+        return MINIDB_OK;
+    }
+
+    MiniDbState state = MINIDB_ERROR;
+    if (!log->failed) {
+        MiniDbChangeRecord record;
+        unsigned char *last = log->buffer + log->last_change;
+        memcpy(&record, last, sizeof(record));
+        record.flags |= CHANGELOG_COMMIT;
+        record.checksum = changelog_checksum(&record, last + sizeof(record));
+        memcpy(last, &record, sizeof(record));
+
+        size_t written = 0;
+        while (written < log->buffer_size) {
+            ssize_t result = pwrite(log->fd, log->buffer + written, log->buffer_size - written, log->size + written);
+            if (result <= 0) {
+                break;
+            }
+
+            written += result;
+        }
+
+        if (written == log->buffer_size) {
+            log->size += written;
+            state = MINIDB_OK;
+        } else if (ftruncate(log->fd, log->size) != 0) {
+            // Later batches would follow the partial one, so the log stops here; readers stop at the partial batch
+            close(log->fd);
+            log->fd = -1;
+        }
+    }
+
+    log->buffer_size = 0;
+    log->failed = false;
+    return state;
+}
+
+MiniDbState minidb_changelog_sync(const MiniDbChangeLog *log)
+{
+    return log->fd < 0 || fsync(log->fd) == 0 ? MINIDB_OK : MINIDB_ERROR;
+}
+
+void minidb_changelog_discard(MiniDbChangeLog *log)
+{
+    log->buffer_size = 0;
+    log->failed = false;
+}
+
+MiniDbState minidb_changelog_reader_open(MiniDbChangeLogReader *reader, const char *path)
+{
+    reader->fd = -1;
+    reader->window = NULL;
+    reader->window_start = 0;
+    reader->window_size = 0;
+    reader->window_capacity = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    MiniDbState state = changelog_check_header(fd);
+    if (state != MINIDB_OK) {
+        close(fd);
+        return state;
+    }
+
+    reader->fd = fd;
+    return MINIDB_OK;
+}
+
+void minidb_changelog_reader_close(MiniDbChangeLogReader *reader)
+{
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+
+    free(reader->window);
+    reader->fd = -1;
+    reader->window = NULL;
+    reader->window_size = 0;
+    reader->window_capacity = 0;
+}
+
+int64_t minidb_changelog_reader_size(const MiniDbChangeLogReader *reader)
+{
+    struct stat st;
+    return fstat(reader->fd, &st) == 0 ? (int64_t) st.st_size : INT64_C(0);
+}
+
+/**
+ * Returns the bytes [offset, offset + size) of the file, reading ahead so consecutive changes are
+ * read with a few large requests. Returns NULL if the file is shorter.
+ */
+static const unsigned char *changelog_fetch(MiniDbChangeLogReader *reader, int64_t offset, size_t size)
+{
+    if (offset >= reader->window_start && offset + (int64_t) size <= reader->window_start + (int64_t) reader->window_size) {
+        return reader->window + (offset - reader->window_start);
+    }
+
+    size_t capacity = size > CHANGELOG_READ_AHEAD ? size : CHANGELOG_READ_AHEAD;
+    if (capacity > reader->window_capacity) {
+        unsigned char *window = realloc(reader->window, capacity);
+        if (is_null(window)) {
+            return NULL;
+        }
+
+        reader->window = window;
+        reader->window_capacity = capacity;
+    }
+
+    // The window is refilled from the requested offset, so the end of a growing file is read again
+    ssize_t read_bytes = pread(reader->fd, reader->window, capacity, offset);
+    reader->window_start = offset;
+    reader->window_size = read_bytes > 0 ? (size_t) read_bytes : 0;
+    return reader->window_size >= size ? reader->window : NULL;
+}
+
+/**
+ * Validates the change at a position. Returns a pointer to its data, or NULL if there is no complete change there.
+ */
+static const unsigned char *changelog_change_at(MiniDbChangeLogReader *reader, int64_t position, MiniDbChangeRecord *record)
+{
+    const unsigned char *bytes = changelog_fetch(reader, position, sizeof(MiniDbChangeRecord));
+    if (is_null(bytes)) {
+        return NULL;
+    }
+
+    // A length past the end of the file is a torn or damaged record; the size is only checked when
+    // the record does not fit in the window, so most records need no extra request
+    memcpy(record, bytes, sizeof(MiniDbChangeRecord));
+    int64_t window_end = reader->window_start + (int64_t) reader->window_size;
+    int64_t data_start = position + (int64_t) sizeof(MiniDbChangeRecord);
+    if (record->length > (uint64_t) (window_end - data_start)
+        && record->length > (uint64_t) (minidb_changelog_reader_size(reader) - data_start)) {
+        return NULL;
+    }
+
+    bytes = changelog_fetch(reader, position, sizeof(MiniDbChangeRecord) + record->length);
+    if (is_null(bytes) || record->checksum != changelog_checksum(record, bytes + sizeof(MiniDbChangeRecord))) {
+        return NULL;
+    }
+
+    return bytes + sizeof(MiniDbChangeRecord);
+}
+
+MiniDbState minidb_changelog_read(MiniDbChangeLogReader *reader, int64_t position, int64_t max_changes,
+                                  MiniDbTransaction *changes, int64_t *end, int64_t *timestamp)
+{
+    // Find the end of the last complete batch first, so no change of an incomplete one is returned
+    int64_t batch_end = position;
+    int64_t batch_count = 0;
+    int64_t count = 0;
+    int64_t next = position;
+    MiniDbChangeRecord record;
+    *timestamp = -1;
+    while (batch_count < max_changes && !is_null(changelog_change_at(reader, next, &record))) {
+        next += sizeof(MiniDbChangeRecord) + record.length;
+        count++;
+        if (record.flags & CHANGELOG_COMMIT) {
+            batch_end = next;
+            batch_count = count;
+            *timestamp = record.timestamp;
+        }
+    }
+
+    *end = position;
+    while (*end < batch_end) {
+        const unsigned char *data = changelog_change_at(reader, *end, &record);
+        if (is_null(data)) {
+            return MINIDB_ERROR;
+        }
+
+        MiniDbState state = minidb_transaction_append(changes, record.type, record.key, data, record.length);
+        if (state != MINIDB_OK) {
+            return state;
+        }
+
+        *end += sizeof(MiniDbChangeRecord) + record.length;
+    }
+
+    return MINIDB_OK;
+}
+
+int64_t minidb_changelog_timestamp(MiniDbChangeLogReader *reader, int64_t position)
+{
+    MiniDbChangeRecord record;
+    return is_null(changelog_change_at(reader, position, &record)) ? -1 : record.timestamp;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "minidb.h"
+#include "transaction.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The position of the first change in a change log, right after its header.
+ */
+#define MINIDB_CHANGELOG_START ((int64_t) 16)
+
+/**
+ * The changes applied to a database, appended to the -changes file so replicas can follow them.
+ * Changes are buffered while a write or a commit is applied and written with a single write() when
+ * it is over; the last change of each batch is flagged, so readers never see half of a transaction.
+ */
+typedef struct MiniDbChangeLog
+{
+    int fd;                 // -1 if the database does not log its changes
+    int64_t size;           // Size of the file, which ends with a complete batch
+    unsigned char *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    size_t last_change;     // Position of the last change in the buffer
+    bool failed;            // A change of the current batch could not be buffered
+} MiniDbChangeLog;
+
+typedef struct MiniDbChangeLogReader
+{
+    int fd;
+    unsigned char *window;  // Bytes of the file read ahead, starting at window_start
+    int64_t window_start;
+    size_t window_size;
+    size_t window_capacity;
+} MiniDbChangeLogReader;
+
+void minidb_changelog_init(MiniDbChangeLog *log);
+
+/**
+ * Opens or creates a change log. A batch left incomplete by a crash is cut off the end of the file.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the file is not a change log.
+ */
+MiniDbState minidb_changelog_open(MiniDbChangeLog *log, const char *path);
+
+void minidb_changelog_close(MiniDbChangeLog *log);
+
+/**
+ * Buffers a change. Does nothing if the log is closed.
+ *
+ * @param log The change log.
+ * @param type The type of operation.
+ * @param key The key of the row.
+ * @param data The row data, or the expiry time for MINIDB_OP_EXPIRE.
+ * @param length The length of the data.
+ */
+void minidb_changelog_append(MiniDbChangeLog *log, MiniDbOpType type, int64_t key, const void *data, size_t length);
+
+/**
+ * Ends the current batch and writes its changes to the file.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR if the batch could not be written whole.
+ */
+MiniDbState minidb_changelog_commit(MiniDbChangeLog *log);
+
+/**
+ * Syncs the changes written so far to the storage device. Does nothing if the log is closed.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR if the file could not be synced.
+ */
+MiniDbState minidb_changelog_sync(const MiniDbChangeLog *log);
+
+/**
+ * Drops the changes of the current batch without writing them.
+ */
+void minidb_changelog_discard(MiniDbChangeLog *log);
+
+/**
+ * Opens a change log for reading.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the file is not a change log.
+ */
+MiniDbState minidb_changelog_reader_open(MiniDbChangeLogReader *reader, const char *path);
+
+void minidb_changelog_reader_close(MiniDbChangeLogReader *reader);
+
+/**
+ * Returns the current size of the file.
+ */
+int64_t minidb_changelog_reader_size(const MiniDbChangeLogReader *reader);
+
+/**
+ * Reads the complete batches that follow a position, stopping after the batch that reaches
+ * max_changes. Batches are never split, and a batch still being written is left for the next call.
+ *
+ * @param reader The reader.
+ * @param position The position of the first change to read.
+ * @param max_changes The number of changes after which no more batches are read.
+ * @param changes Where the changes will be stored (must be empty).
+ * @param end Where the position that follows the last change read will be stored.
+ * @param timestamp Where the time the last change read was logged will be stored, in milliseconds since the epoch,
+ *                  or -1 if no change was read.
+ *
+ * @return MINIDB_OK on success, even if no change was read.
+ */
+MiniDbState minidb_changelog_read(MiniDbChangeLogReader *reader, int64_t position, int64_t max_changes,
+                                  MiniDbTransaction *changes, int64_t *end, int64_t *timestamp);
+
+/**
+ * Returns the time the change at the given position was logged, in milliseconds since the epoch,
+ * or -1 if there is no complete change at that position.
+ */
+int64_t minidb_changelog_timestamp(MiniDbChangeLogReader *reader, int64_t position);
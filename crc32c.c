@@ -0,0 +1,238 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_X86 1
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLYNOMIAL UINT32_C(0x82F63B78) // Reflected Castagnoli polynomial
+
+/**
+ * Long buffers are checksummed as three interleaved lanes of this many bytes, so three crc32 instructions
+ * are in flight at once instead of each one waiting for the previous one.
+ */
+#define CRC32C_LANE 512
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_lane_shift[4][256]; // Appends CRC32C_LANE zero bytes to a checksum
+static bool crc32c_use_hardware = false;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_slicing(uint32_t crc, const uint8_t *bytes, size_t size);
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+        }
+
+        crc32c_table[0][i] = crc;
+    }
+
+    // Table k gives the checksum of a byte followed by k zero bytes
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t crc = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        }
+    }
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    crc32c_use_hardware = __builtin_cpu_supports("sse4.2");
+
+    // Appending zero bytes is linear, so the shift of a byte at each position is tabulated as for the checksum itself
+    static const uint8_t zeros[CRC32C_LANE] = {0};
+    for (int k = 0; k < 4; k++) {
+        for (uint32_t i = 0; i < 256; i++) {
+            crc32c_lane_shift[k][i] = crc32c_slicing(i << (8 * k), zeros, sizeof(zeros));
+        }
+    }
+#endif
+}
+
+static uint32_t crc32c_slicing(uint32_t crc, const uint8_t *bytes, size_t size)
+{
+    while (size > 0 && ((uintptr_t) bytes & 7) != 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+        size--;
+    }
+
+    // Eight bytes per step, each one looked up in its own table (little-endian word order)
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF]
+              ^ crc32c_table[6][(word >> 8) & 0xFF]
+              ^ crc32c_table[5][(word >> 16) & 0xFF]
+              ^ crc32c_table[4][(word >> 24) & 0xFF]
+              ^ crc32c_table[3][(word >> 32) & 0xFF]
+              ^ crc32c_table[2][(word >> 40) & 0xFF]
+              ^ crc32c_table[1][(word >> 48) & 0xFF]
+              ^ crc32c_table[0][word >> 56];
+        bytes += 8;
+        size -= 8;
+    }
+
+    while (size > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes++) & 0xFF];
+        size--;
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+static uint32_t crc32c_shift(uint32_t crc)
+{
+    return crc32c_lane_shift[0][crc & 0xFF]
+           ^ crc32c_lane_shift[1][(crc >> 8) & 0xFF]
+           ^ crc32c_lane_shift[2][(crc >> 16) & 0xFF]
+           ^ crc32c_lane_shift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *bytes, size_t size)
+{
+#ifdef __x86_64__
+    // Unaligned loads cost nothing here, so the bytes are read as they come
+    while (size >= 3 * CRC32C_LANE) {
+        uint64_t crc0 = crc;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t word0;
+            uint64_t word1;
+            uint64_t word2;
+            memcpy(&word0, bytes + i, sizeof(word0));
+            memcpy(&word1, bytes + CRC32C_LANE + i, sizeof(word1));
+            memcpy(&word2, bytes + 2 * CRC32C_LANE + i, sizeof(word2));
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+
+        crc = crc32c_shift(crc32c_shift((uint32_t) crc0) ^ (uint32_t) crc1) ^ (uint32_t) crc2;
+        bytes += 3 * CRC32C_LANE;
+        size -= 3 * CRC32C_LANE;
+    }
+
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        size -= 8;
+    }
+
+    crc = (uint32_t) crc64;
+#endif
+
+    while (size >= 4) {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        bytes += 4;
+        size -= 4;
+    }
+
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        size--;
+    }
+
+    return crc;
+}
+#endif
+
+uint32_t minidb_crc32c(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_X86
+    if (crc32c_use_hardware) {
+        return ~crc32c_sse42(~crc, data, size);
+    }
+#endif
+
+    return ~crc32c_slicing(~crc, data, size);
+}
+
+uint32_t minidb_crc32c_portable(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_slicing(~crc, data, size);
+}
+
+bool minidb_crc32c_hardware(void)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_use_hardware;
+}
+
+static uint32_t crc32c_matrix_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (int i = 0; vector != 0; i++, vector >>= 1) {
+        if (vector & 1) {
+            sum ^= matrix[i];
+        }
+    }
+
+    return sum;
+}
+
+static void crc32c_matrix_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int i = 0; i < 32; i++) {
+        square[i] = crc32c_matrix_times(matrix, matrix[i]);
+    }
+}
+
+/**
+ * Appending size2 zero bytes to the first range is a linear operator on its checksum, applied here by
+ * squaring the operator of a single zero bit (the method of zlib's crc32_combine).
+ */
+uint32_t minidb_crc32c_combine(uint32_t crc1, uint32_t crc2, int64_t size2)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    if (size2 <= 0) {
+        return crc1;
+    }
+
+    odd[0] = CRC32C_POLYNOMIAL;
+    for (int i = 1; i < 32; i++) {
+        odd[i] = UINT32_C(1) << (i - 1);
+    }
+
+    crc32c_matrix_square(even, odd); // Two zero bits
+    crc32c_matrix_square(odd, even); // Four zero bits
+
+    do {
+        crc32c_matrix_square(even, odd);
+        if (size2 & 1) {
+            crc1 = crc32c_matrix_times(even, crc1);
+        }
+
+        size2 >>= 1;
+        if (size2 == 0) {
+            break;
+        }
+
+        crc32c_matrix_square(odd, even);
+        if (size2 & 1) {
+            crc1 = crc32c_matrix_times(odd, crc1);
+        }
+
+        size2 >>= 1;
+    } while (size2 != 0);
+
+    return crc1 ^ crc2;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Updates a CRC32C (Castagnoli) checksum with the given bytes. Uses the SSE4.2 crc32 instruction when the
+ * processor has it and slicing-by-8 tables otherwise; both give the same result.
+ *
+ * @param crc The checksum of the previous bytes, or 0 to start a new one.
+ * @param data The bytes to add.
+ * @param size The number of bytes.
+ *
+ * @return The checksum of the previous bytes followed by these ones.
+ */
+uint32_t minidb_crc32c(uint32_t crc, const void *data, size_t size);
+
+/**
+ * Same as minidb_crc32c, but always uses the slicing-by-8 tables.
+ */
+uint32_t minidb_crc32c_portable(uint32_t crc, const void *data, size_t size);
+
+/**
+ * Returns the checksum of two byte ranges one after the other, from the checksum of each range and the
+ * size of the second one. Lets several threads checksum parts of a file on their own.
+ */
+uint32_t minidb_crc32c_combine(uint32_t crc1, uint32_t crc2, int64_t size2);
+
+/**
+ * Returns true if minidb_crc32c uses the crc32 instruction.
+ */
+bool minidb_crc32c_hardware(void);
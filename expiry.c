@@ -0,0 +1,231 @@
+#include "expiry.h"
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Stale items are dropped once the queue grows past this many times the number of keys with an expiry time.
+ */
+#define EXPIRY_STALE_FACTOR 2
+#define EXPIRY_MIN_QUEUE 64
+
+void minidb_expiry_init(MiniDbExpiry *expiry)
+{
+    btree_init(&expiry->by_key);
+    expiry->queue = NULL;
+    expiry->queue_count = 0;
+    expiry->queue_capacity = 0;
+}
+
+void minidb_expiry_destroy(MiniDbExpiry *expiry)
+{
+    btree_destroy(&expiry->by_key);
+    free(expiry->queue);
+    minidb_expiry_init(expiry);
+}
+
+#define item_before(a, b) ((a).expires_at < (b).expires_at)
+
+static void expiry_sift_up(MiniDbExpiryItem *queue, int64_t position)
+{
+    MiniDbExpiryItem item = queue[position];
+    while (position > 0) {
+        int64_t parent = (position - 1) / 2;
+        if (!item_before(item, queue[parent])) {
+            break;
+        }
+
+        queue[position] = queue[parent];
+        position = parent;
+    }
+
+    queue[position] = item;
+}
+
+static void expiry_sift_down(MiniDbExpiryItem *queue, int64_t count, int64_t position)
+{
+    MiniDbExpiryItem item = queue[position];
+    while (true) {
+        int64_t child = position * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+
+        if (child + 1 < count && item_before(queue[child + 1], queue[child])) {
+            child++;
+        }
+
+        if (!item_before(queue[child], item)) {
+            break;
+        }
+
+        queue[position] = queue[child];
+        position = child;
+    }
+
+    queue[position] = item;
+}
+
+static bool expiry_reserve(MiniDbExpiry *expiry, int64_t count)
+{
+    if (count <= expiry->queue_capacity) {
+        return true;
+    }
+
+    int64_t capacity = expiry->queue_capacity > 0 ? expiry->queue_capacity : EXPIRY_MIN_QUEUE;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+
+    MiniDbExpiryItem *queue = realloc(expiry->queue, capacity * sizeof(MiniDbExpiryItem));
+    if (is_null(queue)) {
+        return false;
+    }
+
+    expiry->queue = queue;
+    expiry->queue_capacity = capacity;
+    return true;
+}
+
+static void expiry_heapify(MiniDbExpiry *expiry)
+{
+    for (int64_t i = expiry->queue_count / 2 - 1; i >= 0; i--) {
+        expiry_sift_down(expiry->queue, expiry->queue_count, i);
+    }
+}
+
+/**
+ * Rebuilds the queue from 'by_key', dropping the stale items.
+ */
+static void expiry_rebuild(MiniDbExpiry *expiry)
+{
+    BTreeNode **stack = malloc((expiry->by_key.size + 1) * sizeof(BTreeNode *));
+    if (is_null(stack) || !expiry_reserve(expiry, expiry->by_key.size)) {
+        free(stack);
+        return;
+    }
+
+    int64_t depth = 0;
+    expiry->queue_count = 0;
+    if (!is_null(expiry->by_key.root)) {
+        stack[depth++] = expiry->by_key.root;
+    }
+
+    while (depth > 0) {
+        BTreeNode *node = stack[--depth];
+        expiry->queue[expiry->queue_count].expires_at = node->value;
+        expiry->queue[expiry->queue_count].key = node->key;
+        expiry->queue_count++;
+        if (!is_null(node->left)) {
+            stack[depth++] = node->left;
+        }
+
+        if (!is_null(node->right)) {
+            stack[depth++] = node->right;
+        }
+    }
+
+    free(stack);
+    expiry_heapify(expiry);
+}
+
+bool minidb_expiry_load(MiniDbExpiry *expiry, const int64_t *pairs, int64_t count)
+{
+    btree_destroy(&expiry->by_key);
+    if (!btree_build_sorted(&expiry->by_key, pairs, count)) {
+        return false;
+    }
+
+    // The queue survives the rewrites of the index, it is only built when the index is opened
+    if (expiry->queue_count == 0 && count > 0 && expiry_reserve(expiry, count)) {
+        for (int64_t i = 0; i < count; i++) {
+            expiry->queue[i].key = pairs[i * 2];
+            expiry->queue[i].expires_at = pairs[i * 2 + 1];
+        }
+
+        expiry->queue_count = count;
+        expiry_heapify(expiry);
+    }
+
+    return true;
+}
+
+void minidb_expiry_set(MiniDbExpiry *expiry, int64_t key, int64_t expires_at)
+{
+    BTreeNode *node = btree_search(&expiry->by_key, key);
+    if (!is_null(node)) {
+        node->value = expires_at;
+    } else if (is_null(btree_insert(&expiry->by_key, key, expires_at))) {
+        return;
+    }
+
+    if (expiry->queue_count > EXPIRY_STALE_FACTOR * expiry->by_key.size + EXPIRY_MIN_QUEUE) {
+        expiry_rebuild(expiry);
+        return;
+    }
+
+    // Without room in the queue the row is still hidden once it expires, and it is reclaimed after the next open
+    if (expiry_reserve(expiry, expiry->queue_count + 1)) {
+        expiry->queue[expiry->queue_count].expires_at = expires_at;
+        expiry->queue[expiry->queue_count].key = key;
+        expiry_sift_up(expiry->queue, expiry->queue_count++);
+    }
+}
+
+void minidb_expiry_remove(MiniDbExpiry *expiry, int64_t key)
+{
+    if (expiry->by_key.size > 0) {
+        btree_remove(&expiry->by_key, key, NULL);
+    }
+}
+
+bool minidb_expiry_is_expired(const MiniDbExpiry *expiry, int64_t key, int64_t now)
+{
+    if (expiry->by_key.size == 0) {
+        return false;
+    }
+
+    const BTreeNode *node = btree_search(&expiry->by_key, key);
+    return !is_null(node) && node->value <= now;
+}
+
+/**
+ * Drops the items at the top of the queue that no longer match the expiry time of their key.
+ */
+static void expiry_drop_stale(MiniDbExpiry *expiry)
+{
+    while (expiry->queue_count > 0) {
+        const BTreeNode *node = btree_search(&expiry->by_key, expiry->queue[0].key);
+        if (!is_null(node) && node->value == expiry->queue[0].expires_at) {
+            return;
+        }
+
+        expiry->queue[0] = expiry->queue[--expiry->queue_count];
+        expiry_sift_down(expiry->queue, expiry->queue_count, 0);
+    }
+}
+
+int64_t minidb_expiry_next(MiniDbExpiry *expiry)
+{
+    expiry_drop_stale(expiry);
+    return expiry->queue_count > 0 ? expiry->queue[0].expires_at : INT64_MAX;
+}
+
+bool minidb_expiry_pop_due(MiniDbExpiry *expiry, int64_t now, int64_t *key)
+{
+    expiry_drop_stale(expiry);
+    if (expiry->queue_count == 0 || expiry->queue[0].expires_at > now) {
+        return false;
+    }
+
+    *key = expiry->queue[0].key;
+    expiry->queue[0] = expiry->queue[--expiry->queue_count];
+    expiry_sift_down(expiry->queue, expiry->queue_count, 0);
+    return true;
+}
+
+int64_t minidb_expiry_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
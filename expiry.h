@@ -0,0 +1,69 @@
+#pragma once
+
+#include "minidb.h"
+#include "btree.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct MiniDbExpiryItem
+{
+    int64_t expires_at;
+    int64_t key;
+} MiniDbExpiryItem;
+
+/**
+ * The expiry times of the rows that have one. 'by_key' is the authoritative copy, stored in the index
+ * file; 'queue' is a min-heap ordered by expiry time used to find the rows to reclaim. Changing or
+ * removing an expiry time leaves the old item in the queue, it is discarded when it reaches the top.
+ */
+typedef struct MiniDbExpiry
+{
+    BTree by_key;
+    MiniDbExpiryItem *queue;
+    int64_t queue_count;
+    int64_t queue_capacity;
+} MiniDbExpiry;
+
+void minidb_expiry_init(MiniDbExpiry *expiry);
+
+void minidb_expiry_destroy(MiniDbExpiry *expiry);
+
+/**
+ * Replaces the expiry times with the given ones.
+ *
+ * @param pairs The keys sorted in ascending order, each one followed by its expiry time.
+ * @param count The number of pairs.
+ *
+ * @return True on success, false if memory could not be allocated.
+ */
+bool minidb_expiry_load(MiniDbExpiry *expiry, const int64_t *pairs, int64_t count);
+
+/**
+ * Sets the expiry time of a key, in milliseconds since the epoch.
+ */
+void minidb_expiry_set(MiniDbExpiry *expiry, int64_t key, int64_t expires_at);
+
+void minidb_expiry_remove(MiniDbExpiry *expiry, int64_t key);
+
+/**
+ * Returns true if the key has an expiry time not later than 'now'.
+ */
+bool minidb_expiry_is_expired(const MiniDbExpiry *expiry, int64_t key, int64_t now);
+
+/**
+ * Returns the earliest expiry time, or INT64_MAX if no key has one.
+ */
+int64_t minidb_expiry_next(MiniDbExpiry *expiry);
+
+/**
+ * Takes the next key whose expiry time is not later than 'now' out of the queue. The key keeps its
+ * expiry time until it is removed.
+ *
+ * @return True if a key was found, in which case key is set.
+ */
+bool minidb_expiry_pop_due(MiniDbExpiry *expiry, int64_t now, int64_t *key);
+
+/**
+ * Returns the current time in milliseconds since the epoch.
+ */
+int64_t minidb_expiry_now(void);
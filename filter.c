@@ -0,0 +1,79 @@
+#include "filter.h"
+
+#define FILTER_BLOCK_BITS (MINIDB_FILTER_BLOCK_WORDS * 32)
+
+// Odd constants used to derive one bit per word from the low half of the hash
+static const uint32_t filter_salts[MINIDB_FILTER_BLOCK_WORDS] = {
+        0x47B6137BU, 0x44974D91U, 0x8824AD5BU, 0xA2B7289DU,
+        0x705495C7U, 0x2DF1424BU, 0x9EFC4947U, 0x5C6BFB31U,
+};
+
+/**
+ * splitmix64 finalizer, so that sequential keys land in unrelated blocks.
+ */
+static uint64_t filter_hash(int64_t key)
+{
+    uint64_t x = (uint64_t) key;
+    x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return x ^ (x >> 31);
+}
+
+static uint32_t *filter_block(const MiniDbFilter *filter, uint64_t hash)
+{
+    // Maps the high half of the hash to [0, block_count) without a division
+    uint64_t block = ((hash >> 32) * (uint64_t) filter->block_count) >> 32;
+    return filter->blocks + block * MINIDB_FILTER_BLOCK_WORDS;
+}
+
+int64_t minidb_filter_block_count(int64_t key_count, int bits_per_key)
+{
+    if (key_count <= 0 || bits_per_key <= 0) {
+        return 0;
+    }
+
+    int64_t bits = key_count * bits_per_key;
+    return (bits + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS;
+}
+
+void minidb_filter_add(MiniDbFilter *filter, int64_t key)
+{
+    if (filter->block_count == 0) {
+        return;
+    }
+
+    uint64_t hash = filter_hash(key);
+    uint32_t *block = filter_block(filter, hash);
+    for (int i = 0; i < MINIDB_FILTER_BLOCK_WORDS; i++) {
+        block[i] |= UINT32_C(1) << (((uint32_t) hash * filter_salts[i]) >> 27);
+    }
+}
+
+void minidb_filter_add_concurrent(MiniDbFilter *filter, int64_t key)
+{
+    if (filter->block_count == 0) {
+        return;
+    }
+
+    uint64_t hash = filter_hash(key);
+    uint32_t *block = filter_block(filter, hash);
+    for (int i = 0; i < MINIDB_FILTER_BLOCK_WORDS; i++) {
+        __atomic_fetch_or(&block[i], UINT32_C(1) << (((uint32_t) hash * filter_salts[i]) >> 27), __ATOMIC_RELAXED);
+    }
+}
+
+bool minidb_filter_may_contain(const MiniDbFilter *filter, int64_t key)
+{
+    if (filter->block_count == 0) {
+        return true;
+    }
+
+    uint64_t hash = filter_hash(key);
+    const uint32_t *block = filter_block(filter, hash);
+    uint32_t missing = 0;
+    for (int i = 0; i < MINIDB_FILTER_BLOCK_WORDS; i++) {
+        missing |= ~block[i] & (UINT32_C(1) << (((uint32_t) hash * filter_salts[i]) >> 27));
+    }
+
+    return missing == 0;
+}
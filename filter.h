@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MINIDB_FILTER_DEFAULT_BITS_PER_KEY 10
+
+/**
+ * Each block is 8 words of 32 bits (half a cache line) and every key sets one bit in each word of
+ * a single block, so a lookup touches one block and the 8 word tests can be vectorized.
+ */
+#define MINIDB_FILTER_BLOCK_WORDS 8
+
+/**
+ * A split block Bloom filter over 64-bit keys. Keys can be added but not removed, so the filter may
+ * report removed keys as present; keys that were never added are reported as present at the
+ * false positive rate given by the bits per key.
+ */
+typedef struct MiniDbFilter
+{
+    uint32_t *blocks;    // block_count * MINIDB_FILTER_BLOCK_WORDS words
+    int64_t block_count; // 0 if there is no filter
+} MiniDbFilter;
+
+/**
+ * Returns the number of blocks needed to store key_count keys with the given bits per key.
+ */
+int64_t minidb_filter_block_count(int64_t key_count, int bits_per_key);
+
+void minidb_filter_add(MiniDbFilter *filter, int64_t key);
+
+/**
+ * Same as minidb_filter_add, but safe to call from several threads at once.
+ */
+void minidb_filter_add_concurrent(MiniDbFilter *filter, int64_t key);
+
+/**
+ * Returns false if the key was never added. Filters without blocks return true for every key.
+ */
+bool minidb_filter_may_contain(const MiniDbFilter *filter, int64_t key);
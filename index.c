@@ -1,71 +1,1324 @@
 #include "index.h"
+#include "crc32c.h"
+#include "parallel.h"
+#include "prefetch.h"
+#include "transaction.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define INDEX_MAGIC UINT64_C(0x313058444942444D) // "MDBIDX01"
+#define INDEX_VERSION UINT32_C(7)
+#define INDEX_TMP_SUFFIX ".tmp"
+#define INDEX_WRITE_BUFFER 4096
+#define INDEX_PARALLEL_MIN_ENTRIES (INT64_C(1) << 20)
+
+/**
+ * Number of entries of a compressed block. A lookup decodes up to this many entries after searching the directory.
+ */
+#define INDEX_BLOCK_ENTRIES 64
+
+/**
+ * Largest encoded block: the entry count and the first slot, then a key delta and a slot delta per entry,
+ * each one a varint of up to 10 bytes.
+ */
+#define INDEX_BLOCK_MAX_BYTES (2 * 10 + (INDEX_BLOCK_ENTRIES - 1) * 2 * 10)
+
+#define INDEX_DATA_BUFFER (64 * 1024)
+
+/**
+ * Header of the index file. It is followed by the block directory, the compressed search entries, the
+ * sorted freelist entries, the expiry times sorted by key and the blocks of the Bloom filter, so the
+ * file can be mapped and searched without parsing it. Every section starts at a multiple of 8 bytes.
+ */
+typedef struct MiniDbIndexHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_checksum;
+    int64_t search_count;
+    int64_t block_count;
+    int64_t blocks_size;
+    int64_t value_base;
+    int64_t value_stride;
+    int64_t free_count;
+    int64_t expiry_count;
+    int64_t filter_blocks;
+    uint32_t entries_checksum;  // CRC32C of everything that follows the header, verified by minidb_index_verify
+    uint32_t lists_checksum;    // CRC32C of the freelist, the expiry times and the filter, verified when the image is mapped
+} MiniDbIndexHeader;
+
+// Values of MiniDbIndex.block_states
+#define INDEX_BLOCK_UNCHECKED 0
+#define INDEX_BLOCK_INTACT 1
+#define INDEX_BLOCK_DAMAGED 2
+
+#define index_filter_size(blocks) ((size_t) (blocks) * MINIDB_FILTER_BLOCK_WORDS * sizeof(uint32_t))
+
+/**
+ * Smallest range of an image checksummed by a thread of its own; smaller images are checksummed by the calling thread.
+ */
+#define INDEX_VERIFY_MIN_CHUNK (INT64_C(4) << 20)
+
+static uint32_t index_header_checksum(const MiniDbIndexHeader *header)
+{
+    MiniDbIndexHeader copy = *header;
+    copy.header_checksum = 0;
+    return minidb_crc32c(0, &copy, sizeof(copy));
+}
+
+typedef struct MiniDbIndexVerifyTask
+{
+    const uint8_t *data;
+    int64_t size;
+    uint32_t checksum;
+} MiniDbIndexVerifyTask;
+
+static void *index_verify_worker(void *arg)
+{
+    MiniDbIndexVerifyTask *task = arg;
+    task->checksum = minidb_crc32c(0, task->data, task->size);
+    return NULL;
+}
+
+/**
+ * Computes the checksum of everything that follows the header of a mapped image. Large images are
+ * split into ranges checksummed by their own thread, and the checksums of the ranges are combined.
+ */
+static uint32_t index_image_checksum(const void *map, size_t map_size, int worker_threads)
+{
+    const uint8_t *image = (const uint8_t *) map + sizeof(MiniDbIndexHeader);
+    int64_t size = (int64_t) (map_size - sizeof(MiniDbIndexHeader));
+
+    int task_count = minidb_parallel_thread_count(worker_threads);
+    if (task_count > size / INDEX_VERIFY_MIN_CHUNK) {
+        task_count = size / INDEX_VERIFY_MIN_CHUNK > 1 ? (int) (size / INDEX_VERIFY_MIN_CHUNK) : 1;
+    }
+
+    MiniDbIndexVerifyTask *tasks = task_count > 1 ? calloc(task_count, sizeof(MiniDbIndexVerifyTask)) : NULL;
+    if (is_null(tasks)) {
+        return minidb_crc32c(0, image, size);
+    }
+
+    for (int t = 0; t < task_count; t++) {
+        int64_t start = size * t / task_count;
+        tasks[t].data = image + start;
+        tasks[t].size = size * (t + 1) / task_count - start;
+    }
+
+    minidb_parallel_run(index_verify_worker, tasks, sizeof(MiniDbIndexVerifyTask), task_count);
+
+    uint32_t checksum = 0;
+    for (int t = 0; t < task_count; t++) {
+        checksum = minidb_crc32c_combine(checksum, tasks[t].checksum, tasks[t].size);
+    }
+
+    free(tasks);
+    return checksum;
+}
+
+static uint8_t *index_varint_put(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+/**
+ * Reads a varint. Returns NULL if it does not end before 'end'.
+ */
+static const uint8_t *index_varint_get(const uint8_t *in, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        result |= (uint64_t) (byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            *value = result;
+            return in;
+        }
+    }
+
+    return NULL;
+}
+
+// Differences between slots may be negative, zigzag encoding keeps the small ones short
+#define index_zigzag(x) (((uint64_t) (x) << 1) ^ (0 - ((uint64_t) (x) >> 63)))
+#define index_unzigzag(x) (((x) >> 1) ^ (0 - ((x) & 1)))
 
 void minidb_index_init(MiniDbIndex *index)
 {
-    btree_init(&index->search);
+    index->directory = NULL;
+    index->block_count = 0;
+    index->block_states = NULL;
+    index->blocks = NULL;
+    index->blocks_size = 0;
+    index->image_count = 0;
+    index->image_value_base = 0;
+    index->image_value_stride = 1;
+    index->map = NULL;
+    index->map_size = 0;
+    btree_init(&index->delta);
+    btree_init(&index->removed);
+    index->size = 0;
     btree_init(&index->freelist);
-    index->fd = NULL;
+    minidb_expiry_init(&index->expiry);
+    index->filter.blocks = NULL;
+    index->filter.block_count = 0;
+    index->filter_copied = false;
+    index->filter_bits_per_key = MINIDB_FILTER_DEFAULT_BITS_PER_KEY;
+    index->worker_threads = 0;
+    index->value_base = 0;
+    index->value_stride = 1;
+    index->path[0] = '\0';
+}
+
+static void index_unmap(MiniDbIndex *index)
+{
+    if (index->filter_copied) {
+        free(index->filter.blocks);
+        index->filter_copied = false;
+    }
+
+    if (!is_null(index->map)) {
+#ifdef _WIN32
+        free(index->map);
+#else
+        munmap(index->map, index->map_size);
+#endif
+    }
+
+    free(index->block_states);
+
+    index->map = NULL;
+    index->map_size = 0;
+    index->directory = NULL;
+    index->block_count = 0;
+    index->block_states = NULL;
+    index->blocks = NULL;
+    index->blocks_size = 0;
+    index->image_count = 0;
+    index->filter.blocks = NULL;
+    index->filter.block_count = 0;
 }
 
-MiniDbState minidb_index_open(MiniDbIndex *index, const char *path, int64_t row_count, int64_t freelist_count)
+/**
+ * Maps an index file. The entries are paged in by the operating system as they are searched.
+ */
+static MiniDbState index_map(MiniDbIndex *index, const char *path)
 {
-    bool is_new_file = row_count == INT64_C(0) && freelist_count == INT64_C(0);
-    FILE *fd = fopen(path, is_new_file ? "w+" : "r+");
+    FILE *fd = fopen(path, "rb");
     if (is_null(fd)) {
+        // The file is created on the first write
+        return MINIDB_OK;
+    }
+
+    MiniDbIndexHeader header;
+    fseek(fd, 0, SEEK_END);
+    long file_size = ftell(fd);
+    fseek(fd, 0, SEEK_SET);
+
+    if (file_size == 0) {
+        fclose(fd);
+        return MINIDB_OK;
+    }
+
+    if (fread(&header, sizeof(header), 1, fd) != 1
+        || header.magic != INDEX_MAGIC
+        || header.version != INDEX_VERSION
+        || header.header_checksum != index_header_checksum(&header)
+        || header.search_count < 0 || header.free_count < 0 || header.expiry_count < 0 || header.filter_blocks < 0
+        || header.block_count < 0 || header.block_count > header.search_count
+        || (header.block_count == 0) != (header.search_count == 0)
+        || header.blocks_size < 0 || header.blocks_size % sizeof(uint64_t) != 0
+        || header.value_stride <= 0
+        || (size_t) file_size != sizeof(header) + header.block_count * sizeof(MiniDbIndexBlock) + header.blocks_size
+                                 + (header.free_count + header.expiry_count) * sizeof(MiniDbIndexEntry)
+                                 + index_filter_size(header.filter_blocks)) {
+        fclose(fd);
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    void *map;
+#ifdef _WIN32
+    map = malloc(file_size);
+    if (is_null(map)) {
+        fclose(fd);
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    fseek(fd, 0, SEEK_SET);
+    fread(map, file_size, 1, fd);
+#else
+    map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+    if (map == MAP_FAILED) {
+        fclose(fd);
         return MINIDB_ERROR_CANNOT_OPEN_FILE;
     }
+#endif
 
-    index->fd = fd;
-    if (!is_new_file) {
-        // Load index from file
-        int64_t i;
-        BTreeNode node;
-        fseek(fd, 0, SEEK_SET);
+    fclose(fd);
 
-        // search index
-        for (i = 0; i < row_count; i++) {
-            fread(&node.key, sizeof(node.key), 1, fd);
-            fread(&node.value, sizeof(node.value), 1, fd);
-            btree_insert(&index->search, node.key, node.value);
-        }
+    // The freelist and the expiry times are loaded right away and the filter answers lookups without
+    // decoding a block, so they are verified now; the blocks of entries are verified one by one when
+    // they are first decoded
+    const MiniDbIndexEntry *free_entries = (const MiniDbIndexEntry *) ((const uint8_t *) map + sizeof(header) + header.block_count * sizeof(MiniDbIndexBlock) + header.blocks_size);
+    const MiniDbIndexEntry *expiry_entries = free_entries + header.free_count;
+    size_t lists_size = (header.free_count + header.expiry_count) * sizeof(MiniDbIndexEntry) + index_filter_size(header.filter_blocks);
+    uint8_t *block_states = header.block_count > 0 ? calloc(header.block_count, sizeof(uint8_t)) : NULL;
+    if (minidb_crc32c(0, free_entries, lists_size) != header.lists_checksum || (header.block_count > 0 && is_null(block_states))) {
+#ifdef _WIN32
+        free(map);
+#else
+        munmap(map, file_size);
+#endif
+        free(block_states);
+        return header.block_count > 0 && is_null(block_states) ? MINIDB_ERROR_MALLOC_FAIL : MINIDB_ERROR_CORRUPTED_FILE;
+    }
 
-        // freelist index
-        for (i = 0; i < freelist_count; i++) {
-            fread(&node.key, sizeof(node.key), 1, fd);
-            fread(&node.value, sizeof(node.value), 1, fd);
-            btree_insert(&index->freelist, node.key, node.value);
-        }
+    index->map = map;
+    index->map_size = file_size;
+    index->directory = (const MiniDbIndexBlock *) ((const uint8_t *) map + sizeof(header));
+    index->block_count = header.block_count;
+    index->block_states = block_states;
+    index->blocks = (const uint8_t *) (index->directory + header.block_count);
+    index->blocks_size = header.blocks_size;
+    index->image_count = header.search_count;
+    index->image_value_base = header.value_base;
+    index->image_value_stride = header.value_stride;
+    index->size = header.search_count;
+    if (index->filter_bits_per_key > 0) {
+        index->filter.blocks = (uint32_t *) (expiry_entries + header.expiry_count);
+        index->filter.block_count = header.filter_blocks;
+    }
+
+    // The freelist and the expiry times are usually small, so they are loaded into balanced trees right away
+    btree_destroy(&index->freelist);
+    if (!btree_build_sorted(&index->freelist, (const int64_t *) free_entries, header.free_count)
+        || !minidb_expiry_load(&index->expiry, (const int64_t *) expiry_entries, header.expiry_count)) {
+        index_unmap(index);
+        return MINIDB_ERROR_MALLOC_FAIL;
     }
 
     return MINIDB_OK;
 }
 
-void minidb_index_close(MiniDbIndex *index)
+MiniDbState minidb_index_open(MiniDbIndex *index, const char *path)
+{
+    size_t len = strlen(path);
+    if (len >= sizeof(index->path) - sizeof(INDEX_TMP_SUFFIX)) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    memcpy(index->path, path, len + 1);
+    return index_map(index, index->path);
+}
+
+void minidb_index_release(MiniDbIndex *index)
 {
-    minidb_index_write(index);
-    fflush(index->fd);
-    fclose(index->fd);
-    btree_destroy(&index->search);
+    index_unmap(index);
+    btree_destroy(&index->delta);
+    btree_destroy(&index->removed);
     btree_destroy(&index->freelist);
+    minidb_expiry_destroy(&index->expiry);
+}
+
+/**
+ * Returns the position of the first entry whose key is not less than the given key.
+ */
+static int64_t index_entries_lower_bound(const MiniDbIndexEntry *entries, int64_t count, int64_t key)
+{
+    int64_t first = 0;
+
+    while (count > 0) {
+        int64_t step = count / 2;
+        // The next probe is the middle of either half: both are requested before this one is compared
+        minidb_prefetch(&entries[first + step / 2]);
+        minidb_prefetch(&entries[first + step + 1 + (count - step - 1) / 2]);
+        if (entries[first + step].key < key) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    return first;
+}
+
+/**
+ * Returns the block that may hold the given key: the last one whose first key is not greater than it, or 0.
+ */
+static int64_t index_directory_find(const MiniDbIndex *index, int64_t key)
+{
+    const MiniDbIndexBlock *directory = index->directory;
+    int64_t first = 0;
+    int64_t count = index->block_count;
+
+    while (count > 0) {
+        int64_t step = count / 2;
+        minidb_prefetch(&directory[first + step / 2]);
+        minidb_prefetch(&directory[first + step + 1 + (count - step - 1) / 2]);
+        if (directory[first + step].first_key <= key) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    return first > 0 ? first - 1 : 0;
+}
+
+/**
+ * Decodes the entries of a block one at a time.
+ */
+typedef struct MiniDbIndexReader
+{
+    const MiniDbIndex *index;
+    const uint8_t *next;
+    const uint8_t *end;
+    int64_t remaining;
+    int64_t key;
+    uint64_t slot;
+    bool damaged; // The block does not match its checksum or could not be decoded
+} MiniDbIndexReader;
+
+#define index_reader_value(reader) \
+    ((int64_t) ((uint64_t) (reader)->index->image_value_base + (reader)->slot * (uint64_t) (reader)->index->image_value_stride))
+
+static uint32_t index_block_checksum(const MiniDbIndexBlock *entry, const uint8_t *data)
+{
+    uint32_t checksum = minidb_crc32c(0, entry, offsetof(MiniDbIndexBlock, checksum));
+    return minidb_crc32c(checksum, data, entry->size);
 }
 
-static void minidb_index_write_node_recursive(const BTreeNode *node, FILE *fd)
+/**
+ * Returns true if a block lies within the image and matches its checksum. The block is only checksummed
+ * the first time; concurrent readers may both check it, and both reach the same result.
+ */
+static bool index_block_intact(const MiniDbIndex *index, int64_t block)
 {
+    uint8_t state = __atomic_load_n(&index->block_states[block], __ATOMIC_RELAXED);
+    if (state == INDEX_BLOCK_UNCHECKED) {
+        const MiniDbIndexBlock *entry = &index->directory[block];
+        bool intact = entry->offset <= (uint64_t) index->blocks_size
+                      && entry->size <= (uint64_t) index->blocks_size - entry->offset
+                      && index_block_checksum(entry, index->blocks + entry->offset) == entry->checksum;
+        state = intact ? INDEX_BLOCK_INTACT : INDEX_BLOCK_DAMAGED;
+        __atomic_store_n(&index->block_states[block], state, __ATOMIC_RELAXED);
+    }
+
+    return state == INDEX_BLOCK_INTACT;
+}
+
+/**
+ * Positions the reader on the first entry of a block. Returns false if the block is damaged, in which case
+ * damaged is set. Every block holds at least one entry.
+ */
+static bool index_reader_open(MiniDbIndexReader *reader, const MiniDbIndex *index, int64_t block)
+{
+    const MiniDbIndexBlock *entry = &index->directory[block];
+    uint64_t count;
+    uint64_t slot;
+
+    reader->index = index;
+    reader->damaged = true;
+    if (!index_block_intact(index, block)) {
+        return false;
+    }
+
+    reader->next = index->blocks + entry->offset;
+    reader->end = reader->next + entry->size;
+    reader->next = index_varint_get(reader->next, reader->end, &count);
+    if (is_null(reader->next) || count == 0 || count > INDEX_BLOCK_ENTRIES) {
+        return false;
+    }
+
+    reader->next = index_varint_get(reader->next, reader->end, &slot);
+    if (is_null(reader->next)) {
+        return false;
+    }
+
+    reader->remaining = (int64_t) count - 1;
+    reader->key = entry->first_key;
+    reader->slot = index_unzigzag(slot);
+    reader->damaged = false;
+    return true;
+}
+
+/**
+ * Moves the reader to the next entry of the block. Returns false at the end of the block, or if the rest
+ * of the block cannot be decoded, in which case damaged is set.
+ */
+static bool index_reader_next(MiniDbIndexReader *reader)
+{
+    uint64_t key_delta;
+    uint64_t slot_delta;
+
+    if (reader->remaining == 0) {
+        return false;
+    }
+
+    reader->next = index_varint_get(reader->next, reader->end, &key_delta);
+    if (is_null(reader->next)) {
+        reader->damaged = true;
+        return false;
+    }
+
+    reader->next = index_varint_get(reader->next, reader->end, &slot_delta);
+    if (is_null(reader->next)) {
+        reader->damaged = true;
+        return false;
+    }
+
+    reader->remaining--;
+    reader->key = (int64_t) ((uint64_t) reader->key + key_delta);
+    reader->slot += index_unzigzag(slot_delta);
+    return true;
+}
+
+/**
+ * Walks the image in key order, one decoded block at a time.
+ */
+typedef struct MiniDbIndexCursor
+{
+    const MiniDbIndex *index;
+    int64_t block;
+    int count;
+    int position;
+    bool damaged; // A block could not be decoded, so the walk stopped there
+    MiniDbIndexEntry entries[INDEX_BLOCK_ENTRIES];
+} MiniDbIndexCursor;
+
+static void index_cursor_load(MiniDbIndexCursor *cursor, int64_t block)
+{
+    MiniDbIndexReader reader;
+
+    cursor->block = block;
+    cursor->count = 0;
+    cursor->position = 0;
+    if (block >= cursor->index->block_count) {
+        return;
+    }
+
+    if (!index_reader_open(&reader, cursor->index, block)) {
+        cursor->damaged = true;
+        return;
+    }
+
+    do {
+        cursor->entries[cursor->count].key = reader.key;
+        cursor->entries[cursor->count].value = index_reader_value(&reader);
+        cursor->count++;
+    } while (index_reader_next(&reader));
+
+    if (reader.damaged) {
+        cursor->count = 0;
+        cursor->damaged = true;
+    }
+}
+
+/**
+ * Returns the current entry, or NULL past the last one. The entry is only valid until the cursor moves.
+ */
+static const MiniDbIndexEntry *index_cursor_entry(const MiniDbIndexCursor *cursor)
+{
+    return cursor->position < cursor->count ? &cursor->entries[cursor->position] : NULL;
+}
+
+static void index_cursor_next(MiniDbIndexCursor *cursor)
+{
+    if (++cursor->position >= cursor->count && cursor->block < cursor->index->block_count && !cursor->damaged) {
+        index_cursor_load(cursor, cursor->block + 1);
+    }
+}
+
+/**
+ * Positions the cursor on the first entry whose key is not less than the given key.
+ */
+static void index_cursor_seek(MiniDbIndexCursor *cursor, const MiniDbIndex *index, int64_t key)
+{
+    cursor->index = index;
+    cursor->damaged = false;
+    index_cursor_load(cursor, index_directory_find(index, key));
+    while (cursor->position < cursor->count && cursor->entries[cursor->position].key < key) {
+        cursor->position++;
+    }
+
+    if (cursor->position == cursor->count && cursor->block < index->block_count && !cursor->damaged) {
+        index_cursor_load(cursor, cursor->block + 1);
+    }
+}
+
+static void index_cursor_close(MiniDbIndexCursor *cursor)
+{
+    cursor->block = cursor->index->block_count;
+    cursor->count = 0;
+    cursor->position = 0;
+}
+
+static MiniDbState index_image_search(const MiniDbIndex *index, int64_t key, int64_t *value)
+{
+    MiniDbIndexReader reader;
+    if (index->block_count == 0) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    if (!index_reader_open(&reader, index, index_directory_find(index, key))) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    while (reader.key < key && index_reader_next(&reader)) {
+    }
+
+    if (reader.damaged) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    if (reader.key == key) {
+        if (!is_null(value)) {
+            *value = index_reader_value(&reader);
+        }
+
+        return MINIDB_OK;
+    }
+
+    return MINIDB_ERROR_ROW_NOT_FOUND;
+}
+
+MiniDbState minidb_index_search(const MiniDbIndex *index, int64_t key, int64_t *value)
+{
+    if (!minidb_filter_may_contain(&index->filter, key)) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    BTreeNode *node = btree_search(&index->delta, key);
+    if (!is_null(node)) {
+        if (!is_null(value)) {
+            *value = node->value;
+        }
+
+        return MINIDB_OK;
+    }
+
+    if (btree_contains(&index->removed, key)) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    return index_image_search(index, key, value);
+}
+
+/**
+ * Adds a key to the filter. The mapped filter is read-only, so it is copied on the first insert.
+ */
+static void index_filter_add(MiniDbIndex *index, int64_t key)
+{
+    if (index->filter.block_count > 0 && !index->filter_copied) {
+        size_t size = index_filter_size(index->filter.block_count);
+        uint32_t *blocks = malloc(size);
+        if (is_null(blocks)) {
+            // Without the filter every lookup goes to the image, which is slower but still correct
+            index->filter.blocks = NULL;
+            index->filter.block_count = 0;
+            return;
+        }
+
+        memcpy(blocks, index->filter.blocks, size);
+        index->filter.blocks = blocks;
+        index->filter_copied = true;
+    }
+
+    minidb_filter_add(&index->filter, key);
+}
+
+void minidb_index_insert(MiniDbIndex *index, int64_t key, int64_t value)
+{
+    BTreeNode *node = btree_search(&index->delta, key);
     if (!is_null(node)) {
-        minidb_index_write_node_recursive(node->left, fd);
-        fwrite(&node->key, sizeof(node->key), 1, fd);
-        fwrite(&node->value, sizeof(node->value), 1, fd);
-        minidb_index_write_node_recursive(node->right, fd);
+        node->value = value;
+        return;
+    }
+
+    if (minidb_index_search(index, key, NULL) != MINIDB_OK) {
+        index->size++;
+        index_filter_add(index, key);
+    }
+
+    btree_insert(&index->delta, key, value);
+}
+
+bool minidb_index_remove(MiniDbIndex *index, int64_t key, int64_t *old_value)
+{
+    if (minidb_index_search(index, key, old_value) != MINIDB_OK) {
+        return false;
+    }
+
+    btree_remove(&index->delta, key, NULL);
+    minidb_expiry_remove(&index->expiry, key);
+    if (index_image_search(index, key, NULL) == MINIDB_OK && !btree_contains(&index->removed, key)) {
+        btree_insert(&index->removed, key, 0);
+    }
+
+    index->size--;
+    return true;
+}
+
+typedef struct MiniDbIndexMerge
+{
+    MiniDbIndexCursor cursor;
+    int64_t first;
+    int64_t last;
+    bool (*callback)(int64_t, int64_t, void *);
+    void *context;
+    bool stop;
+} MiniDbIndexMerge;
+
+/**
+ * Emits the image entries whose key is less than 'limit' (and within the range), skipping removed keys.
+ */
+static void index_merge_image_until(MiniDbIndexMerge *merge, int64_t limit, bool unbounded)
+{
+    const MiniDbIndex *index = merge->cursor.index;
+    const MiniDbIndexEntry *entry;
+    while (!merge->stop && !is_null(entry = index_cursor_entry(&merge->cursor))) {
+        if (entry->key > merge->last) {
+            index_cursor_close(&merge->cursor);
+            break;
+        }
+
+        if (!unbounded && entry->key >= limit) {
+            break;
+        }
+
+        if (!btree_contains(&index->removed, entry->key)) {
+            merge->stop = !merge->callback(entry->key, entry->value, merge->context);
+        }
+
+        index_cursor_next(&merge->cursor);
+    }
+
+    // The entries of a damaged block are unknown, so nothing that follows it can be emitted in order
+    merge->stop |= merge->cursor.damaged;
+}
+
+static void index_merge_recursive(MiniDbIndexMerge *merge, const BTreeNode *node)
+{
+    if (!is_null(node) && !merge->stop) {
+        if (node->key < merge->first) {
+            index_merge_recursive(merge, node->right);
+            return;
+        }
+
+        minidb_prefetch(node->right);
+        index_merge_recursive(merge, node->left);
+        if (node->key > merge->last) {
+            return;
+        }
+
+        index_merge_image_until(merge, node->key, false);
+
+        // The delta entry replaces the image entry with the same key
+        const MiniDbIndexEntry *entry = index_cursor_entry(&merge->cursor);
+        if (!is_null(entry) && entry->key == node->key) {
+            index_cursor_next(&merge->cursor);
+        }
+
+        if (!merge->stop) {
+            merge->stop = !merge->callback(node->key, node->value, merge->context);
+            index_merge_recursive(merge, node->right);
+        }
+    }
+}
+
+MiniDbState minidb_index_foreach(const MiniDbIndex *index, bool (*callback)(int64_t, int64_t, void *), void *context)
+{
+    return minidb_index_foreach_range(index, INT64_MIN, INT64_MAX, callback, context);
+}
+
+MiniDbState minidb_index_foreach_range(const MiniDbIndex *index, int64_t first, int64_t last, bool (*callback)(int64_t, int64_t, void *), void *context)
+{
+    MiniDbIndexMerge merge;
+    merge.first = first;
+    merge.last = last;
+    merge.callback = callback;
+    merge.context = context;
+    merge.stop = false;
+    index_cursor_seek(&merge.cursor, index, first);
+    merge.stop = merge.cursor.damaged;
+    index_merge_recursive(&merge, index->delta.root);
+    index_merge_image_until(&merge, 0, true);
+    return merge.cursor.damaged ? MINIDB_ERROR_CORRUPTED_FILE : MINIDB_OK;
+}
+
+/**
+ * Writes a range of the image, right after the header, and adds it to the checksum of the bytes that precede it.
+ *
+ * @param offset The position of the range within the image.
+ *
+ * @return False if the range could not be written.
+ */
+static bool index_write_at(FILE *fd, const void *data, size_t size, int64_t offset, uint32_t *checksum)
+{
+    *checksum = minidb_crc32c(*checksum, data, size);
+    return pwrite(fileno(fd), data, size, sizeof(MiniDbIndexHeader) + offset) == (ssize_t) size;
+}
+
+/**
+ * Encodes a block of entries, storing their values as slot numbers.
+ *
+ * @return The size of the block in bytes.
+ */
+static size_t index_block_encode(const MiniDbIndexEntry *entries, int count, int64_t base, int64_t stride, uint8_t *out)
+{
+    uint8_t *start = out;
+    uint64_t previous = (uint64_t) ((entries[0].value - base) / stride);
+
+    out = index_varint_put(out, (uint64_t) count);
+    out = index_varint_put(out, index_zigzag(previous));
+    for (int i = 1; i < count; i++) {
+        uint64_t slot = (uint64_t) ((entries[i].value - base) / stride);
+        out = index_varint_put(out, (uint64_t) entries[i].key - (uint64_t) entries[i - 1].key);
+        out = index_varint_put(out, index_zigzag(slot - previous));
+        previous = slot;
+    }
+
+    return out - start;
+}
+
+/**
+ * A key range of the new image. Every part merges its slices of the image, the delta and the removed
+ * keys: once to count its entries, blocks and bytes, and once more to write them at their final position.
+ * The bytes of every part are padded to a multiple of 8. Every part checksums its directory blocks and its
+ * bytes on its own, and the checksums are combined in file order once all of them are written.
+ */
+typedef struct MiniDbIndexPart
+{
+    const MiniDbIndex *index;
+    int64_t image_first;      // Keys of the image that belong to the part: [image_first, image_end)
+    int64_t image_end;
+    bool image_bounded;       // False if the part takes every image key from image_first on
+    const MiniDbIndexEntry *delta;
+    int64_t delta_count;
+    const MiniDbIndexEntry *removed;
+    int64_t removed_count;
+    int64_t value_base;
+    int64_t value_stride;
+    FILE *fd;
+    MiniDbFilter *filter;     // NULL while counting
+    bool shared_filter;
+    int64_t first_block;      // Position of the first block of the part in the new directory
+    int64_t blocks_offset;    // Position of the first byte of the part within the compressed entries
+    int64_t blocks_start;     // Position of the compressed entries within the image
+    int64_t count;
+    int64_t block_count;
+    int64_t blocks_size;
+    bool unaligned;           // A value is not a slot of value_stride bytes from value_base
+    MiniDbIndexEntry pending[INDEX_BLOCK_ENTRIES];
+    int pending_count;
+    MiniDbIndexBlock *directory_buffer;
+    int64_t directory_buffered;
+    uint8_t *data_buffer;
+    size_t data_buffered;
+    uint32_t directory_checksum;
+    uint32_t data_checksum;
+    bool failed;
+    bool damaged;             // A block of the current image is damaged, so the new one would miss its entries
+} MiniDbIndexPart;
+
+static void index_part_flush_directory(MiniDbIndexPart *part)
+{
+    int64_t block = part->first_block + part->block_count - part->directory_buffered;
+    size_t size = part->directory_buffered * sizeof(MiniDbIndexBlock);
+    part->failed |= !index_write_at(part->fd, part->directory_buffer, size, block * (int64_t) sizeof(MiniDbIndexBlock), &part->directory_checksum);
+    part->directory_buffered = 0;
+}
+
+/**
+ * Writes the buffered bytes of the part, except for the last few if they do not fill a word.
+ */
+static void index_part_flush_data(MiniDbIndexPart *part)
+{
+    size_t size = part->data_buffered & ~(sizeof(uint64_t) - 1);
+    int64_t offset = part->blocks_start + part->blocks_offset + part->blocks_size - (int64_t) part->data_buffered;
+    part->failed |= !index_write_at(part->fd, part->data_buffer, size, offset, &part->data_checksum);
+    memmove(part->data_buffer, part->data_buffer + size, part->data_buffered - size);
+    part->data_buffered -= size;
+}
+
+/**
+ * Encodes the pending entries as a block. While counting, the block is only measured.
+ */
+static void index_part_close_block(MiniDbIndexPart *part)
+{
+    uint8_t scratch[INDEX_BLOCK_MAX_BYTES];
+    uint8_t *out = is_null(part->filter) ? scratch : part->data_buffer + part->data_buffered;
+    size_t size = index_block_encode(part->pending, part->pending_count, part->value_base, part->value_stride, out);
+
+    if (!is_null(part->filter)) {
+        MiniDbIndexBlock *block = &part->directory_buffer[part->directory_buffered++];
+        block->first_key = part->pending[0].key;
+        block->offset = (uint64_t) (part->blocks_offset + part->blocks_size);
+        block->size = (uint32_t) size;
+        block->checksum = index_block_checksum(block, out);
+        part->data_buffered += size;
+    }
+
+    part->count += part->pending_count;
+    part->block_count++;
+    part->blocks_size += (int64_t) size;
+    part->pending_count = 0;
+
+    if (!is_null(part->filter)) {
+        if (part->directory_buffered == INDEX_WRITE_BUFFER) {
+            index_part_flush_directory(part);
+        }
+
+        if (part->data_buffered >= INDEX_DATA_BUFFER) {
+            index_part_flush_data(part);
+        }
+    }
+}
+
+static void index_part_add(MiniDbIndexPart *part, const MiniDbIndexEntry *entry)
+{
+    if (is_null(part->filter)) {
+        part->unaligned |= (entry->value - part->value_base) % part->value_stride != 0;
+    } else if (part->shared_filter) {
+        minidb_filter_add_concurrent(part->filter, entry->key);
+    } else {
+        minidb_filter_add(part->filter, entry->key);
+    }
+
+    part->pending[part->pending_count++] = *entry;
+    if (part->pending_count == INDEX_BLOCK_ENTRIES) {
+        index_part_close_block(part);
+    }
+}
+
+/**
+ * Closes the last block and pads the bytes of the part to a multiple of 8.
+ */
+static void index_part_finish(MiniDbIndexPart *part)
+{
+    if (part->pending_count > 0) {
+        index_part_close_block(part);
+    }
+
+    int64_t padding = (int64_t) (-(uint64_t) part->blocks_size & (sizeof(uint64_t) - 1));
+    if (!is_null(part->filter)) {
+        memset(part->data_buffer + part->data_buffered, 0, padding);
+        part->data_buffered += padding;
+        part->blocks_size += padding;
+        index_part_flush_data(part);
+        if (part->directory_buffered > 0) {
+            index_part_flush_directory(part);
+        }
+    } else {
+        part->blocks_size += padding;
     }
 }
 
-void minidb_index_write(const MiniDbIndex *index)
+/**
+ * Returns the next image entry of the part, or NULL once they are all merged.
+ */
+static const MiniDbIndexEntry *index_part_image_entry(const MiniDbIndexPart *part, const MiniDbIndexCursor *cursor)
 {
-    fseek(index->fd, 0, SEEK_SET);
-    minidb_index_write_node_recursive(index->search.root, index->fd);
-    minidb_index_write_node_recursive(index->freelist.root, index->fd);
-    fflush(index->fd);
+    const MiniDbIndexEntry *entry = index_cursor_entry(cursor);
+    if (!is_null(entry) && part->image_bounded && entry->key >= part->image_end) {
+        return NULL;
+    }
+
+    return entry;
+}
+
+static void *index_part_worker(void *arg)
+{
+    MiniDbIndexPart *part = arg;
+    MiniDbIndexCursor *cursor = malloc(sizeof(MiniDbIndexCursor));
+    int64_t j = 0;
+    int64_t k = 0;
+
+    part->count = 0;
+    part->block_count = 0;
+    part->blocks_size = 0;
+    part->unaligned = false;
+    part->pending_count = 0;
+    part->directory_buffered = 0;
+    part->data_buffered = 0;
+    part->directory_checksum = 0;
+    part->data_checksum = 0;
+    if (!is_null(part->filter)) {
+        part->directory_buffer = malloc(INDEX_WRITE_BUFFER * sizeof(MiniDbIndexBlock));
+        part->data_buffer = malloc(INDEX_DATA_BUFFER + INDEX_BLOCK_MAX_BYTES);
+    }
+
+    if (is_null(cursor) || (!is_null(part->filter) && (is_null(part->directory_buffer) || is_null(part->data_buffer)))) {
+        part->failed = true;
+        free(cursor);
+        free(part->directory_buffer);
+        free(part->data_buffer);
+        part->directory_buffer = NULL;
+        part->data_buffer = NULL;
+        return NULL;
+    }
+
+    index_cursor_seek(cursor, part->index, part->image_first);
+    while (true) {
+        const MiniDbIndexEntry *image = index_part_image_entry(part, cursor);
+        MiniDbIndexEntry entry;
+        if (j < part->delta_count && (is_null(image) || part->delta[j].key <= image->key)) {
+            // The delta entry replaces the image entry with the same key
+            if (!is_null(image) && image->key == part->delta[j].key) {
+                index_cursor_next(cursor);
+            }
+
+            entry = part->delta[j++];
+        } else if (!is_null(image)) {
+            entry = *image;
+            index_cursor_next(cursor);
+            while (k < part->removed_count && part->removed[k].key < entry.key) {
+                k++;
+            }
+
+            if (k < part->removed_count && part->removed[k].key == entry.key) {
+                continue;
+            }
+        } else {
+            break;
+        }
+
+        index_part_add(part, &entry);
+    }
+
+    part->damaged |= cursor->damaged;
+    index_part_finish(part);
+    free(cursor);
+    free(part->directory_buffer);
+    free(part->data_buffer);
+    part->directory_buffer = NULL;
+    part->data_buffer = NULL;
+    return NULL;
+}
+
+/**
+ * Copies the entries of a tree into a sorted array. Returns NULL if the tree is empty or memory could not be allocated.
+ */
+static MiniDbIndexEntry *index_tree_to_array(const BTree *tree, bool *failed)
+{
+    if (tree->size == 0) {
+        return NULL;
+    }
+
+    MiniDbIndexEntry *entries = malloc(tree->size * sizeof(MiniDbIndexEntry));
+    BTreeNode **stack = malloc(tree->size * sizeof(BTreeNode *));
+    if (is_null(entries) || is_null(stack)) {
+        free(entries);
+        free(stack);
+        *failed = true;
+        return NULL;
+    }
+
+    int64_t count = 0;
+    int64_t depth = 0;
+    BTreeNode *node = tree->root;
+    while (!is_null(node) || depth > 0) {
+        if (!is_null(node)) {
+            stack[depth++] = node;
+            node = node->left;
+        } else {
+            node = stack[--depth];
+            entries[count].key = node->key;
+            entries[count].value = node->value;
+            count++;
+            node = node->right;
+        }
+    }
+
+    free(stack);
+    return entries;
+}
+
+/**
+ * Counts the entries, blocks and bytes of every part and sets where each one is written.
+ *
+ * @return False if a value cannot be stored as a slot number, or if a block of the current image is damaged.
+ */
+static bool index_count_parts(MiniDbIndexPart *parts, int part_count, MiniDbIndexHeader *header)
+{
+    minidb_parallel_run(index_part_worker, parts, sizeof(MiniDbIndexPart), part_count);
+
+    header->search_count = 0;
+    header->block_count = 0;
+    header->blocks_size = 0;
+    for (int p = 0; p < part_count; p++) {
+        if (parts[p].unaligned || parts[p].damaged) {
+            return false;
+        }
+
+        parts[p].first_block = header->block_count;
+        parts[p].blocks_offset = header->blocks_size;
+        header->search_count += parts[p].count;
+        header->block_count += parts[p].block_count;
+        header->blocks_size += parts[p].blocks_size;
+    }
+
+    for (int p = 0; p < part_count; p++) {
+        parts[p].blocks_start = header->block_count * (int64_t) sizeof(MiniDbIndexBlock);
+    }
+
+    return true;
+}
+
+/**
+ * Splits the key space into part_count ranges of about the same number of entries and runs the parts
+ * in parallel, first counting and then writing their entries. Sets the counts and the value layout of the header.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if a block of the current image is damaged.
+ */
+static MiniDbState index_write_search_entries(const MiniDbIndex *index, FILE *fd, MiniDbFilter *filter, MiniDbIndexHeader *header, uint32_t *checksum)
+{
+    bool failed = false;
+    MiniDbIndexEntry *delta = index_tree_to_array(&index->delta, &failed);
+    MiniDbIndexEntry *removed = index_tree_to_array(&index->removed, &failed);
+    int64_t delta_count = index->delta.size;
+    int64_t removed_count = index->removed.size;
+
+    int part_count = 1;
+    if (index->image_count + delta_count >= INDEX_PARALLEL_MIN_ENTRIES) {
+        part_count = minidb_parallel_thread_count(index->worker_threads);
+    }
+
+    MiniDbIndexPart *parts = calloc(part_count, sizeof(MiniDbIndexPart));
+    if (failed || is_null(parts)) {
+        free(delta);
+        free(removed);
+        free(parts);
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    // The bounds are taken from the larger of the two sorted inputs: the image directory or the delta
+    bool image_bounds = index->image_count >= delta_count;
+    int64_t image_first = INT64_MIN;
+    int64_t delta_start = 0;
+    int64_t removed_start = 0;
+
+    for (int p = 0; p < part_count; p++) {
+        MiniDbIndexPart *part = &parts[p];
+        int64_t delta_end = delta_count;
+        int64_t removed_end = removed_count;
+        part->image_bounded = p + 1 < part_count;
+        if (part->image_bounded) {
+            part->image_end = image_bounds ? index->directory[index->block_count * (p + 1) / part_count].first_key
+                                           : delta[delta_count * (p + 1) / part_count].key;
+            delta_end = index_entries_lower_bound(delta, delta_count, part->image_end);
+            removed_end = index_entries_lower_bound(removed, removed_count, part->image_end);
+        }
+
+        part->index = index;
+        part->image_first = image_first;
+        part->delta = delta + delta_start;
+        part->delta_count = delta_end - delta_start;
+        part->removed = removed + removed_start;
+        part->removed_count = removed_end - removed_start;
+        part->value_base = index->value_base;
+        part->value_stride = index->value_stride > 0 ? index->value_stride : 1;
+        part->fd = fd;
+        part->shared_filter = part_count > 1;
+        image_first = part->image_end;
+        delta_start = delta_end;
+        removed_start = removed_end;
+    }
+
+    bool damaged = false;
+    if (!index_count_parts(parts, part_count, header)) {
+        // Values that are not slots of the configured size are stored as they are
+        for (int p = 0; p < part_count; p++) {
+            damaged |= parts[p].damaged;
+            parts[p].value_base = 0;
+            parts[p].value_stride = 1;
+        }
+
+        damaged = damaged || !index_count_parts(parts, part_count, header);
+    }
+
+    if (damaged) {
+        // The entries of the damaged blocks would be dropped from the new image for good
+        free(delta);
+        free(removed);
+        free(parts);
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    header->value_base = parts[0].value_base;
+    header->value_stride = parts[0].value_stride;
+    for (int p = 0; p < part_count; p++) {
+        parts[p].filter = filter;
+    }
+
+    // The filter is sized now that the number of keys is known
+    filter->block_count = minidb_filter_block_count(header->search_count, index->filter_bits_per_key);
+    if (filter->block_count > 0) {
+        filter->blocks = calloc(filter->block_count, index_filter_size(1));
+        if (is_null(filter->blocks)) {
+            // The image is still valid without a filter
+            filter->block_count = 0;
+        }
+    }
+
+    minidb_parallel_run(index_part_worker, parts, sizeof(MiniDbIndexPart), part_count);
+
+    // The directory comes first, then the compressed entries, each one in part order
+    *checksum = 0;
+    for (int p = 0; p < part_count; p++) {
+        failed |= parts[p].failed;
+        *checksum = minidb_crc32c_combine(*checksum, parts[p].directory_checksum, parts[p].block_count * (int64_t) sizeof(MiniDbIndexBlock));
+    }
+
+    for (int p = 0; p < part_count; p++) {
+        *checksum = minidb_crc32c_combine(*checksum, parts[p].data_checksum, parts[p].blocks_size);
+    }
+
+    free(delta);
+    free(removed);
+    free(parts);
+    return failed ? MINIDB_ERROR : MINIDB_OK;
+}
+
+/**
+ * Replaces the index file with a new image atomically, so a crash leaves either of them intact.
+ */
+static bool index_replace_file(const char *tmp_path, const char *path)
+{
+#ifdef _WIN32
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(tmp_path, path) == 0;
+#endif
+}
+
+MiniDbState minidb_index_write(MiniDbIndex *index, bool sync)
+{
+    char tmp_path[sizeof(index->path) + sizeof(INDEX_TMP_SUFFIX)];
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", index->path, INDEX_TMP_SUFFIX);
+
+    FILE *fd = fopen(tmp_path, "wb");
+    if (is_null(fd)) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    MiniDbIndexHeader header = {0};
+    MiniDbFilter filter = {NULL, 0};
+    uint32_t checksum;
+    MiniDbState state = index_write_search_entries(index, fd, &filter, &header, &checksum);
+    if (state != MINIDB_OK) {
+        free(filter.blocks);
+        fclose(fd);
+        remove(tmp_path);
+        return state;
+    }
+
+    // The freelist and the expiry times are written by this thread, right after the search entries
+    bool failed = false;
+    int64_t offset = header.block_count * (int64_t) sizeof(MiniDbIndexBlock) + header.blocks_size;
+    MiniDbIndexEntry *freelist = index_tree_to_array(&index->freelist, &failed);
+    if (!is_null(freelist)) {
+        header.free_count = index->freelist.size;
+        failed |= !index_write_at(fd, freelist, header.free_count * sizeof(MiniDbIndexEntry), offset, &header.lists_checksum);
+        offset += header.free_count * (int64_t) sizeof(MiniDbIndexEntry);
+        free(freelist);
+    }
+
+    MiniDbIndexEntry *expiry = index_tree_to_array(&index->expiry.by_key, &failed);
+    if (!is_null(expiry)) {
+        header.expiry_count = index->expiry.by_key.size;
+        failed |= !index_write_at(fd, expiry, header.expiry_count * sizeof(MiniDbIndexEntry), offset, &header.lists_checksum);
+        offset += header.expiry_count * (int64_t) sizeof(MiniDbIndexEntry);
+        free(expiry);
+    }
+
+    header.filter_blocks = filter.block_count;
+    if (filter.block_count > 0) {
+        failed |= !index_write_at(fd, filter.blocks, index_filter_size(filter.block_count), offset, &header.lists_checksum);
+    }
+
+    size_t lists_size = (header.free_count + header.expiry_count) * sizeof(MiniDbIndexEntry) + index_filter_size(filter.block_count);
+    checksum = minidb_crc32c_combine(checksum, header.lists_checksum, (int64_t) lists_size);
+
+    free(filter.blocks);
+    if (failed) {
+        fclose(fd);
+        remove(tmp_path);
+        return MINIDB_ERROR;
+    }
+
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.entries_checksum = checksum;
+    header.header_checksum = index_header_checksum(&header);
+    failed = pwrite(fileno(fd), &header, sizeof(header), 0) != (ssize_t) sizeof(header);
+    if (sync && !failed) {
+        failed = !minidb_file_sync(fd);
+    }
+
+    failed |= fclose(fd) != 0;
+    if (failed) {
+        remove(tmp_path);
+        return MINIDB_ERROR;
+    }
+
+    // The new image is loaded before it replaces the old one, so if either step fails the index is left as it was
+    MiniDbIndex image;
+    minidb_index_init(&image);
+    image.filter_bits_per_key = index->filter_bits_per_key;
+    state = index_map(&image, tmp_path);
+    if (state == MINIDB_OK && !index_replace_file(tmp_path, index->path)) {
+        state = MINIDB_ERROR;
+    }
+
+    if (state != MINIDB_OK) {
+        minidb_index_release(&image);
+        remove(tmp_path);
+        return state;
+    }
+
+    image.worker_threads = index->worker_threads;
+    image.value_base = index->value_base;
+    image.value_stride = index->value_stride;
+    memcpy(image.path, index->path, sizeof(image.path));
+    minidb_index_release(index);
+    *index = image;
+    return MINIDB_OK;
+}
+
+void minidb_index_sync(const MiniDbIndex *index)
+{
+    FILE *fd = fopen(index->path, "rb");
+    if (!is_null(fd)) {
+        minidb_file_sync(fd);
+        fclose(fd);
+    }
+}
+
+bool minidb_index_verify(const MiniDbIndex *index)
+{
+    if (is_null(index->map)) {
+        return true;
+    }
+
+    const MiniDbIndexHeader *header = index->map;
+    return index_image_checksum(index->map, index->map_size, index->worker_threads) == header->entries_checksum;
 }
@@ -2,20 +2,148 @@
 
 #include "minidb.h"
 #include "btree.h"
+#include "filter.h"
+#include "expiry.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 
+typedef struct MiniDbIndexEntry
+{
+    int64_t key;
+    int64_t value;
+} MiniDbIndexEntry;
+
+/**
+ * An entry of the block directory of the image: the first key of a block of compressed entries, the
+ * position of its first byte and its size. The checksum is the CRC32C of the first key and the offset
+ * followed by the bytes of the block, and is verified the first time the block is decoded.
+ */
+typedef struct MiniDbIndexBlock
+{
+    int64_t first_key;
+    uint64_t offset;
+    uint32_t checksum;
+    uint32_t size;
+} MiniDbIndexBlock;
+
+/**
+ * The search index is made of a read-only image of sorted entries, mapped directly from the
+ * index file, plus the changes made since the image was written: 'delta' holds inserted and
+ * updated entries and 'removed' holds the image keys that were deleted.
+ *
+ * The image stores the entries in compressed blocks: keys as the difference with the previous key and
+ * values as slot numbers, (value - value_base) / value_stride, so rows stored one after the other take
+ * a couple of bytes each. A lookup searches the block directory and decodes a single block.
+ *
+ * The Bloom filter stored along with the image answers most lookups of absent keys without searching.
+ * Keys inserted into 'delta' are added to it as well, so it covers every key in the index.
+ *
+ * The expiry times of the rows are stored in the index file too, after the freelist.
+ */
 typedef struct MiniDbIndex
 {
-    BTree search;
+    const MiniDbIndexBlock *directory;
+    int64_t block_count;
+    uint8_t *block_states;   // Whether each block was checked yet, and whether it matched its checksum
+    const uint8_t *blocks;
+    int64_t blocks_size;
+    int64_t image_count;
+    int64_t image_value_base;
+    int64_t image_value_stride;
+    void *map;
+    size_t map_size;
+    BTree delta;
+    BTree removed;
+    int64_t size;
     BTree freelist;
-    FILE *fd;
+    MiniDbExpiry expiry;
+    MiniDbFilter filter;
+    bool filter_copied;      // The filter was copied out of the image to add keys to it
+    int filter_bits_per_key; // Size of the filter written with the next image, 0 to write no filter
+    int worker_threads;      // Threads used to write and verify large images, 0 for one per processor
+    int64_t value_base;      // Values of the next image are stored as slot numbers of this size from value_base
+    int64_t value_stride;
+    char path[MINIDB_PATH_MAX];
 } MiniDbIndex;
 
 void minidb_index_init(MiniDbIndex *index);
 
-MiniDbState minidb_index_open(MiniDbIndex *index, const char *path, int64_t row_count, int64_t freelist_count);
+/**
+ * Opens an index file, or starts an empty index if the file does not exist. Only the header, the freelist,
+ * the expiry times and the filter are verified here; each block of entries is verified when it is first
+ * decoded, and lookups, walks and writes that need a damaged block fail with MINIDB_ERROR_CORRUPTED_FILE.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the header, the freelist, the expiry
+ *         times or the filter do not match their checksums.
+ */
+MiniDbState minidb_index_open(MiniDbIndex *index, const char *path);
+
+/**
+ * Releases the index without writing it, leaving the index file as it is.
+ */
+void minidb_index_release(MiniDbIndex *index);
+
+/**
+ * Writes a new image with every entry and atomically replaces the index file. Large images are split
+ * into key ranges that are merged and written by several threads.
+ *
+ * @param index The index to write.
+ * @param sync If true, the new image is synced to the storage device before it replaces the old one.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if a block of the current image is damaged,
+ *         since the new image would lose its entries. On failure the index file and the entries in memory
+ *         are left as they were.
+ */
+MiniDbState minidb_index_write(MiniDbIndex *index, bool sync);
+
+/**
+ * Syncs the current index file to the storage device.
+ */
+void minidb_index_sync(const MiniDbIndex *index);
+
+/**
+ * Verifies the checksum of the directory, the entries and the filter stored in the image. Reads the whole image,
+ * with worker_threads threads if it is large. Opening the image only verifies the parts loaded into memory.
+ *
+ * @return True if the image is intact.
+ */
+bool minidb_index_verify(const MiniDbIndex *index);
+
+/**
+ * Searches the value of a key.
+ *
+ * @param index The index.
+ * @param key The key to search.
+ * @param value Where the value will be stored if the key is found (optional).
+ *
+ * @return MINIDB_OK if the key was found, MINIDB_ERROR_ROW_NOT_FOUND if it was not,
+ *         MINIDB_ERROR_CORRUPTED_FILE if the block that may hold it is damaged.
+ */
+MiniDbState minidb_index_search(const MiniDbIndex *index, int64_t key, int64_t *value);
+
+/**
+ * Inserts a key or replaces its value if it already exists.
+ */
+void minidb_index_insert(MiniDbIndex *index, int64_t key, int64_t value);
+
+/**
+ * Removes a key, along with its expiry time.
+ *
+ * @return True if the key was found and removed, in which case old_value is set (if not NULL).
+ */
+bool minidb_index_remove(MiniDbIndex *index, int64_t key, int64_t *old_value);
 
-void minidb_index_close(MiniDbIndex *index);
+/**
+ * Calls callback for each entry of the search index, in key order, until it returns false.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the walk stopped at a damaged block.
+ */
+MiniDbState minidb_index_foreach(const MiniDbIndex *index, bool (*callback)(int64_t, int64_t, void *), void *context);
 
-void minidb_index_write(const MiniDbIndex *index);
+/**
+ * Calls callback for each entry whose key is in [first, last], in key order, until it returns false.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the walk stopped at a damaged block.
+ */
+MiniDbState minidb_index_foreach_range(const MiniDbIndex *index, int64_t first, int64_t last, bool (*callback)(int64_t, int64_t, void *), void *context);
@@ -69,6 +69,12 @@ static void print_help_text()
             " insert         Insertar un registro.                           \n"
             " update         Actualizar un registro existente.               \n"
             " delete         Borrar un registro.                             \n"
+            " ttl            Borrar un registro pasados unos segundos.       \n"
+            " begin          Iniciar una transacción.                        \n"
+            " commit         Confirmar la transacción actual.                \n"
+            " rollback       Descartar la transacción actual.                \n"
+            " backup         Copiar la base de datos sin cerrarla.           \n"
+            " verify         Comprobar las sumas de una copia de seguridad.  \n"
     );
 }
 
@@ -156,6 +162,7 @@ int main(void)
             printf("Data Size      : %zu\n", info.data_size);
             printf("Row Count      : %zu\n", info.row_count);
             printf("Free Count     : %zu\n", info.free_count);
+            printf("Page Count     : %zu\n", info.page_count);
             printf("Db Data Size   : %zu\n", info.data_size * info.row_count);
             puts("");
         } else if (strcmp(command, "select") == 0) {
@@ -209,6 +216,75 @@ int main(void)
             }
 
             puts("Tupla eliminada correctamente\n");
+        } else if (strcmp(command, "ttl") == 0) {
+            int ncontrol;
+            int seconds;
+            prompt_int("N. control: ", ncontrol);
+            prompt_int("Segundos (0 = nunca): ", seconds);
+
+            error = minidb_set_ttl(db, ncontrol, (int64_t) seconds * 1000);
+            if (error != MINIDB_OK) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            puts("Caducidad actualizada correctamente\n");
+        } else if (strcmp(command, "begin") == 0) {
+            error = minidb_begin(db);
+            if (error != MINIDB_OK) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            puts("Transacción iniciada\n");
+        } else if (strcmp(command, "commit") == 0) {
+            error = minidb_commit(db);
+            if (error != MINIDB_OK) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            puts("Transacción confirmada\n");
+        } else if (strcmp(command, "rollback") == 0) {
+            error = minidb_rollback(db);
+            if (error != MINIDB_OK) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            puts("Transacción descartada\n");
+        } else if (strcmp(command, "backup") == 0) {
+            char backup_path[COMMAND_MAX_STRLEN];
+            prompt_string("Path: ", backup_path);
+
+            error = minidb_backup_incremental(db, backup_path);
+            if (error != MINIDB_OK) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            puts("Copia de seguridad completada\n");
+        } else if (strcmp(command, "verify") == 0) {
+            char verify_path[COMMAND_MAX_STRLEN];
+            prompt_string("Path: ", verify_path);
+
+            MiniDbVerifyReport report;
+            error = minidb_verify(verify_path, 0, &report);
+            if (error != MINIDB_OK && error != MINIDB_ERROR_CORRUPTED_FILE) {
+                printf("Error: %s\n\n", minidb_error_get_str(error));
+                continue;
+            }
+
+            printf("Encabezado     : %s\n", report.header_ok ? "Ok" : "Dañado");
+            printf("Indice         : %s\n", report.index_ok ? "Ok" : "Dañado");
+            printf("Tuplas         : %lld\n", (long long) report.rows_checked);
+            printf("Paginas        : %lld\n", (long long) report.pages_checked);
+            printf("Dañadas        : %lld\n", (long long) report.corrupted);
+            if (report.first_corrupted >= 0) {
+                printf("Primer error   : byte %lld\n", (long long) report.first_corrupted);
+            }
+
+            puts(error == MINIDB_OK ? "La base de datos está intacta\n" : "La base de datos está dañada\n");
         } else {
             if (command[0] != '\0') {
                 puts("Error: comando no reconocido.\n");
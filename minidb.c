@@ -1,69 +1,331 @@
 #include "minidb.h"
+#include "backup.h"
+#include "changelog.h"
+#include "crc32c.h"
 #include "index.h"
+#include "pager.h"
+#include "parallel.h"
+#include "transaction.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #define MINIDB_INDEX_SUFFIX "-index"
+#define MINIDB_JOURNAL_SUFFIX "-journal"
+#define MINIDB_CHANGES_SUFFIX "-changes"
+#define MINIDB_REPLICA_SUFFIX "-replica"
+#define MINIDB_BACKUP_MAX_ROUNDS 8
+#define MINIDB_BACKUP_FINAL_BLOCKS 64
+#define MINIDB_SCAN_BATCH 64
+#define MINIDB_SCAN_WINDOW (64 * 1024)
+#define MINIDB_SCAN_ADVISE_SLOW_NS 2000
+#define MINIDB_SCAN_ADVISE_PROBE 16
+#define MINIDB_RECLAIM_BATCH 4096
+#define MINIDB_RECLAIM_INTERVAL_MS 1000
+#define MINIDB_REPLICA_BATCH 4096
+#define MINIDB_VERIFY_CHUNK (1024 * 1024)
+#define MINIDB_REPLICA_MAGIC UINT64_C(0x314C50455242444D) // "MDBREPL1"
+#define MINIDB_FILE_MAGIC UINT64_C(0x31454C494642444D) // "MDBFILE1"
+#define MINIDB_FILE_VERSION UINT32_C(1)
 #define RETURN_CASE_AS_STRING(caseval) case caseval: return #caseval
 #define SWITCH_UNREACHABLE_DEFAULT_CASE() default: assert(0)
 
+/**
+ * Stored at the beginning of the data file. The checksum is the CRC32C of the header with the checksum set to 0.
+ */
 typedef struct MiniDbHeader
 {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t checksum;
     size_t data_size;
     int64_t row_count;
     int64_t free_count;
+    int64_t page_count;
+    int64_t free_page;
 } MiniDbHeader;
 
+/**
+ * State shared between the writers and the background flusher. Protected by MiniDb.lock.
+ */
+typedef struct MiniDbFlusher
+{
+    MiniDbOptions options;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    bool requested;
+    bool dirty_index;
+    bool dirty_rows;
+    int64_t dirty_ops;
+    size_t dirty_bytes;
+    uint64_t generation;
+    bool ready;           // The options are set, so the thread can be started when rows get an expiry time
+    int64_t last_reclaim; // When expired rows were last reclaimed, in milliseconds since the epoch
+    int64_t next_flush;   // When the SYNC_INTERVAL policy flushes next, in milliseconds since the epoch
+    pthread_cond_t wake;
+    pthread_cond_t flushed;
+} MiniDbFlusher;
+
 struct MiniDb
 {
     MiniDbHeader header;
     MiniDbIndex index;
+    BTree released;                      // Rows deleted since the index file was last written, which it may still point to
+    MiniDbPager pager;
+    MiniDbTransaction tx;
+    bool in_transaction;
+    bool failed;                         // A batch of changes was applied only in part, so nothing is written until reopened
+    uint64_t write_epoch;                // Incremented by every change, so scans know when their read-ahead is stale
     FILE *fd;
+    char journal_path[MINIDB_PATH_MAX];
+    pthread_mutex_t lock;
+    int lock_depth;                      // How many times the thread that holds the lock took it
+    MiniDbFlusher flusher;
+    MiniDbChangeMap changes;             // Blocks of the data file written since the last backup
+    bool backup_running;
+    char backup_path[MINIDB_PATH_MAX];   // Target of the last backup, empty if the next one must be full
+    MiniDbChangeLog changelog;
 };
 
+#define minidb_is_varlen(db) ((db)->header.data_size == MINIDB_VARLEN)
+
+/**
+ * Fixed-size rows are stored one after the other, each one followed by the CRC32C of its data.
+ */
+#define minidb_row_size(db) ((int64_t) (db)->header.data_size + (int64_t) sizeof(uint32_t))
+
+/**
+ * Every write is persisted before it returns, rather than deferred to the background flusher.
+ */
+#define minidb_persists_every_op(db) ((db)->flusher.options.sync_policy == MINIDB_SYNC_EVERY_OP \
+                                      || (db)->flusher.options.sync_policy == MINIDB_SYNC_EVERY_OP_DURABLE)
+#define minidb_syncs_every_op(db) ((db)->flusher.options.sync_policy == MINIDB_SYNC_EVERY_OP_DURABLE)
+
+// Readers take the lock as well, since they move the position of the shared data file
+#define minidb_lock(db) minidb_lock_acquire((MiniDb *) (db))
+#define minidb_unlock(db) minidb_lock_release((MiniDb *) (db))
+
+static void minidb_lock_acquire(MiniDb *db)
+{
+    pthread_mutex_lock(&db->lock);
+    db->lock_depth++;
+}
+
+static void minidb_lock_release(MiniDb *db)
+{
+    db->lock_depth--;
+    pthread_mutex_unlock(&db->lock);
+}
+
+/**
+ * Waits on a condition variable of the flusher until the deadline, or forever if it is NULL. The lock
+ * must be held exactly once, since waiting only releases one level of the recursive lock.
+ */
+static void minidb_lock_wait(MiniDb *db, pthread_cond_t *condition, const struct timespec *deadline)
+{
+    assert(db->lock_depth == 1);
+    db->lock_depth = 0;
+    if (is_null(deadline)) {
+        pthread_cond_wait(condition, &db->lock);
+    } else {
+        pthread_cond_timedwait(condition, &db->lock, deadline);
+    }
+
+    db->lock_depth = 1;
+}
+
 const char *minidb_error_get_str(MiniDbState value)
 {
     switch (value) {
         RETURN_CASE_AS_STRING(MINIDB_OK);
         RETURN_CASE_AS_STRING(MINIDB_ERROR);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_MALLOC_FAIL);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_CANNOT_OPEN_FILE);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_NULL_POINTER);
         RETURN_CASE_AS_STRING(MINIDB_ERROR_ROW_NOT_FOUND);
         RETURN_CASE_AS_STRING(MINIDB_ERROR_DUPLICATED_KEY_VIOLATION);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_BUFFER_TOO_SMALL);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_UNSUPPORTED_OPERATION);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_TRANSACTION_ACTIVE);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_NO_TRANSACTION);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_CORRUPTED_FILE);
+        RETURN_CASE_AS_STRING(MINIDB_ERROR_REOPEN_REQUIRED);
         SWITCH_UNREACHABLE_DEFAULT_CASE();
     }
 }
 
-static void minidb_build_index_file_path(const char *base_path, char *output, size_t output_size)
+static void minidb_build_file_path(const char *base_path, const char *suffix, char *output, size_t output_size)
 {
     size_t len = strlen(base_path);
-    size_t total_len = len + sizeof(MINIDB_INDEX_SUFFIX) - 1;
-    if (total_len >= output_size) {
-        total_len = output_size - 1;
+    size_t suffix_len = strlen(suffix);
+    if (len >= output_size) {
+        len = output_size - 1;
+    }
+
+    if (len + suffix_len >= output_size) {
+        suffix_len = output_size - len - 1;
     }
 
     memcpy(output, base_path, len);
-    memcpy(output + len, MINIDB_INDEX_SUFFIX, sizeof(MINIDB_INDEX_SUFFIX) - 1);
-    output[total_len] = '\0';
+    memcpy(output + len, suffix, suffix_len);
+    output[len + suffix_len] = '\0';
 }
 
-static void minidb_header_write(const MiniDb *mini)
+/**
+ * Writes the header at the beginning of the data file. Returns false if it could not be written.
+ */
+static bool minidb_header_write(MiniDb *mini)
 {
+    if (minidb_is_varlen(mini)) {
+        mini->header.page_count = mini->pager.page_count;
+        mini->header.free_page = mini->pager.free_page;
+    }
+
+    mini->header.magic = MINIDB_FILE_MAGIC;
+    mini->header.version = MINIDB_FILE_VERSION;
+    mini->header.checksum = 0;
+    mini->header.checksum = minidb_crc32c(0, &mini->header, sizeof(MiniDbHeader));
     fseek(mini->fd, 0, SEEK_SET);
-    fwrite(&mini->header, sizeof(MiniDbHeader), 1, mini->fd);
-    fflush(mini->fd);
+    bool written = fwrite(&mini->header, sizeof(MiniDbHeader), 1, mini->fd) == 1 && fflush(mini->fd) == 0;
+    minidb_changes_mark(&mini->changes, 0, sizeof(MiniDbHeader));
+    return written;
+}
+
+/**
+ * Returns true if the header read from a data file belongs to a database of this version and matches its checksum.
+ */
+static bool minidb_header_check(const MiniDbHeader *header)
+{
+    MiniDbHeader copy = *header;
+    copy.checksum = 0;
+    return header->magic == MINIDB_FILE_MAGIC
+           && header->version == MINIDB_FILE_VERSION
+           && header->checksum == minidb_crc32c(0, &copy, sizeof(copy));
 }
 
 static void minidb_initialize_empty(MiniDb *mini)
 {
+    mini->header.magic = MINIDB_FILE_MAGIC;
+    mini->header.version = MINIDB_FILE_VERSION;
+    mini->header.checksum = 0;
     mini->header.data_size = UINT64_C(0);
     mini->header.row_count = INT64_C(0);
     mini->header.free_count = INT64_C(0);
+    mini->header.page_count = INT64_C(0);
+    mini->header.free_page = INT64_C(0);
     minidb_index_init(&mini->index);
+    btree_init(&mini->released);
+    minidb_pager_init(&mini->pager, NULL, 0, 0);
+    minidb_transaction_init(&mini->tx);
+    mini->in_transaction = false;
+    mini->failed = false;
+    mini->write_epoch = 0;
+    mini->journal_path[0] = '\0';
+    memset(&mini->flusher, 0, sizeof(MiniDbFlusher));
+    mini->flusher.options.sync_policy = MINIDB_SYNC_EVERY_OP;
+    minidb_changes_init(&mini->changes);
+    mini->backup_running = false;
+    mini->backup_path[0] = '\0';
+    minidb_changelog_init(&mini->changelog);
+
+    // Recursive, so the callbacks of minidb_select_all can call back into the database
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mini->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    mini->lock_depth = 0;
+    pthread_cond_init(&mini->flusher.wake, NULL);
+    pthread_cond_init(&mini->flusher.flushed, NULL);
+}
+
+static void minidb_destroy_sync(MiniDb *mini)
+{
+    pthread_cond_destroy(&mini->flusher.wake);
+    pthread_cond_destroy(&mini->flusher.flushed);
+    pthread_mutex_destroy(&mini->lock);
+}
+
+/**
+ * Closes the files and frees the database without writing anything. The flusher thread must not be running.
+ */
+static void minidb_release(MiniDb *mini)
+{
+    minidb_transaction_clear(&mini->tx);
+    minidb_changelog_close(&mini->changelog);
+    minidb_index_release(&mini->index);
+    btree_destroy(&mini->released);
+    minidb_pager_destroy(&mini->pager);
+    minidb_changes_destroy(&mini->changes);
+    fclose(mini->fd);
+    minidb_destroy_sync(mini);
+    free(mini);
+}
+
+/**
+ * Applies the options that affect the index. Must be called before the index is opened.
+ */
+static void minidb_index_configure(MiniDb *mini, const MiniDbOptions *options)
+{
+    // Fixed-size rows are stored one after the other, so the index only needs their slot number
+    if (!minidb_is_varlen(mini)) {
+        mini->index.value_base = sizeof(MiniDbHeader);
+        mini->index.value_stride = minidb_row_size(mini);
+    }
+
+    if (is_null(options)) {
+        return;
+    }
+
+    if (options->filter_bits_per_key != 0) {
+        mini->index.filter_bits_per_key = options->filter_bits_per_key > 0 ? options->filter_bits_per_key : 0;
+    }
+
+    mini->index.worker_threads = options->worker_threads;
+}
+
+static MiniDbState minidb_journal_recover(MiniDb *db);
+
+static MiniDbState minidb_persist(MiniDb *db, bool index_changed, bool sync);
+
+static int64_t minidb_data_file_size(MiniDb *db);
+
+static MiniDbState minidb_flusher_start(MiniDb *db, const MiniDbOptions *options);
+
+static void minidb_flusher_stop(MiniDb *db);
+
+/**
+ * Opens the change log if the options ask for it. A new database starts with an empty log.
+ */
+static MiniDbState minidb_changelog_configure(MiniDb *mini, const char *path, const MiniDbOptions *options, bool create)
+{
+    if (is_null(options) || !options->change_log) {
+        return MINIDB_OK;
+    }
+
+    char changes_path[MINIDB_PATH_MAX];
+    minidb_build_file_path(path, MINIDB_CHANGES_SUFFIX, changes_path, sizeof(changes_path));
+    if (create) {
+        remove(changes_path);
+    }
+
+    return minidb_changelog_open(&mini->changelog, changes_path);
 }
 
 MiniDbState minidb_create(MiniDb **db, const char *path, size_t data_size)
+{
+    return minidb_create_ex(db, path, data_size, NULL);
+}
+
+MiniDbState minidb_create_ex(MiniDb **db, const char *path, size_t data_size, const MiniDbOptions *options)
 {
     *db = NULL;
     FILE *fd = fopen(path, "w+");
@@ -81,12 +343,31 @@ MiniDbState minidb_create(MiniDb **db, const char *path, size_t data_size)
     mini->header.data_size = data_size;
     mini->fd = fd;
 
-    char index_path[1024];
-    minidb_build_index_file_path(path, index_path, sizeof(index_path));
-    MiniDbState state = minidb_index_open(&mini->index, index_path, mini->header.row_count, mini->header.free_count);
+    if (minidb_is_varlen(mini)) {
+        // Page 0 is reserved for the header
+        mini->header.page_count = INT64_C(1);
+        minidb_pager_init(&mini->pager, fd, mini->header.page_count, mini->header.free_page);
+        mini->pager.changes = &mini->changes;
+    }
+
+    char index_path[MINIDB_PATH_MAX];
+    minidb_build_file_path(path, MINIDB_INDEX_SUFFIX, index_path, sizeof(index_path));
+    minidb_build_file_path(path, MINIDB_JOURNAL_SUFFIX, mini->journal_path, sizeof(mini->journal_path));
+    remove(index_path);
+    remove(mini->journal_path);
+    minidb_index_configure(mini, options);
+    MiniDbState state = minidb_index_open(&mini->index, index_path);
+    if (state == MINIDB_OK) {
+        // The changes logged by a previous database with the same path do not apply to this one
+        state = minidb_changelog_configure(mini, path, options, true);
+    }
+
+    if (state == MINIDB_OK) {
+        state = minidb_flusher_start(mini, options);
+    }
+
     if (state != MINIDB_OK) {
-        fclose(fd);
-        free(mini);
+        minidb_release(mini);
         return state;
     }
 
@@ -95,7 +376,17 @@ MiniDbState minidb_create(MiniDb **db, const char *path, size_t data_size)
     return MINIDB_OK;
 }
 
+MiniDbState minidb_create_varlen(MiniDb **db, const char *path)
+{
+    return minidb_create(db, path, MINIDB_VARLEN);
+}
+
 MiniDbState minidb_open(MiniDb **db, const char *path)
+{
+    return minidb_open_ex(db, path, NULL);
+}
+
+MiniDbState minidb_open_ex(MiniDb **db, const char *path, const MiniDbOptions *options)
 {
     *db = NULL;
     FILE *fd = fopen(path, "r+");
@@ -111,14 +402,44 @@ MiniDbState minidb_open(MiniDb **db, const char *path)
 
     minidb_initialize_empty(mini);
     mini->fd = fd;
-    fread(&mini->header, sizeof(MiniDbHeader), 1, fd);
+    if (fread(&mini->header, sizeof(MiniDbHeader), 1, fd) != 1 || !minidb_header_check(&mini->header)) {
+        minidb_release(mini);
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    if (minidb_is_varlen(mini)) {
+        minidb_pager_init(&mini->pager, fd, mini->header.page_count, mini->header.free_page);
+        mini->pager.changes = &mini->changes;
+    }
 
-    char index_path[1024];
-    minidb_build_index_file_path(path, index_path, sizeof(index_path));
-    MiniDbState state = minidb_index_open(&mini->index, index_path, mini->header.row_count, mini->header.free_count);
+    char index_path[MINIDB_PATH_MAX];
+    minidb_build_file_path(path, MINIDB_INDEX_SUFFIX, index_path, sizeof(index_path));
+    minidb_build_file_path(path, MINIDB_JOURNAL_SUFFIX, mini->journal_path, sizeof(mini->journal_path));
+    minidb_index_configure(mini, options);
+    MiniDbState state = minidb_index_open(&mini->index, index_path);
     if (state != MINIDB_OK) {
-        fclose(fd);
-        free(mini);
+        minidb_release(mini);
+        return state;
+    }
+
+    // The index file is replaced atomically, so its counters win over the ones in the header
+    mini->header.row_count = mini->index.size;
+    mini->header.free_count = mini->index.freelist.size;
+
+    // Opened first, so the changes replayed from the journal are logged as well
+    state = minidb_changelog_configure(mini, path, options, false);
+    if (state == MINIDB_OK) {
+        state = minidb_journal_recover(mini);
+    }
+
+    if (state == MINIDB_OK) {
+        state = minidb_flusher_start(mini, options);
+    }
+
+    // Nothing is written if the database cannot be opened, so a journal that could not be replayed is kept for the next try
+    if (state != MINIDB_OK) {
+        minidb_release(mini);
+        return state;
     }
 
     *db = mini;
@@ -129,129 +450,2111 @@ void minidb_close(MiniDb **db)
 {
     if (!is_null(db)) {
         MiniDb *mini = *db;
-        minidb_index_close(&mini->index);
-        minidb_header_write(mini);
-        fflush(mini->fd);
-        fclose(mini->fd);
-        free(mini);
+        minidb_flusher_stop(mini);
+        // Also logs the changes still deferred by the flush policy
+        minidb_persist(mini, true, false);
+        minidb_release(mini);
         *db = NULL;
     }
 }
 
 void minidb_get_info(const MiniDb *db, MiniDbInfo *result)
 {
+    minidb_lock(db);
     result->data_size = db->header.data_size;
     result->row_count = db->header.row_count;
     result->free_count = db->header.free_count;
+    result->page_count = minidb_is_varlen(db) ? db->pager.page_count : INT64_C(0);
+    minidb_unlock(db);
 }
 
-MiniDbState minidb_select(const MiniDb *db, int64_t key, void *result)
+/**
+ * Looks up the key in the operations buffered by the open transaction. Returns true if the
+ * transaction decides the result of the lookup, in which case op is NULL for deleted rows.
+ */
+static bool minidb_pending_lookup(const MiniDb *db, int64_t key, const MiniDbOp **op)
+{
+    if (db->in_transaction) {
+        *op = minidb_transaction_find(&db->tx, key);
+        if (!is_null(*op)) {
+            if ((*op)->type == MINIDB_OP_DELETE) {
+                *op = NULL;
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Returns true if the row has an expiry time and it has passed. Expired rows stay in the index until
+ * they are reclaimed, but they are no longer visible.
+ */
+static bool minidb_row_expired(const MiniDb *db, int64_t key)
+{
+    return db->index.expiry.by_key.size > 0 && minidb_expiry_is_expired(&db->index.expiry, key, minidb_expiry_now());
+}
+
+static MiniDbState minidb_select_row(const MiniDb *db, int64_t key, void *result)
 {
-    BTreeNode *node = btree_search(&db->index.search, key);
-    if (is_null(node)) {
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    const MiniDbOp *op;
+    if (minidb_pending_lookup(db, key, &op)) {
+        if (is_null(op)) {
+            return MINIDB_ERROR_ROW_NOT_FOUND;
+        }
+
+        memcpy(result, op->data, db->header.data_size);
+        return MINIDB_OK;
+    }
+
+    int64_t address;
+    MiniDbState state = minidb_index_search(&db->index, key, &address);
+    if (state != MINIDB_OK) {
+        return state;
+    } else if (minidb_row_expired(db, key)) {
         return MINIDB_ERROR_ROW_NOT_FOUND;
     }
 
-    fseek(db->fd, node->value, SEEK_SET);
-    fread(result, db->header.data_size, 1, db->fd);
-    return MINIDB_OK;
+    uint32_t checksum;
+    fseek(db->fd, address, SEEK_SET);
+    if (fread(result, db->header.data_size, 1, db->fd) != 1 || fread(&checksum, sizeof(checksum), 1, db->fd) != 1) {
+        return MINIDB_ERROR;
+    }
+
+    return checksum == minidb_crc32c(0, result, db->header.data_size) ? MINIDB_OK : MINIDB_ERROR_CORRUPTED_FILE;
+}
+
+MiniDbState minidb_select(const MiniDb *db, int64_t key, void *result)
+{
+    minidb_lock(db);
+    MiniDbState state = minidb_select_row(db, key, result);
+    minidb_unlock(db);
+    return state;
+}
+
+typedef struct MiniDbScanCursor
+{
+    const MiniDb *db;
+    void *buffer;
+    size_t buffer_size;
+    void (*callback)(int64_t, void *);
+    void (*varlen_callback)(int64_t, void *, size_t);
+    void (*range_callback)(int64_t, void *, void *);
+    void *context;
+    MiniDbState state;
+    int64_t now;                               // Rows that expired before the scan started are skipped
+    MiniDbIndexEntry batch[MINIDB_SCAN_BATCH]; // The next rows to visit, so their reads can be announced early
+    int batch_count;
+    int64_t resume;                            // The key the next batch starts from
+    bool finished;                             // Set once the last key of the range was visited
+    int64_t remaining;                         // Rows left to visit before the scan stops
+    uint8_t *window;                           // Rows read ahead from the data file
+    size_t window_capacity;
+    int64_t window_offset;
+    int64_t window_length;
+    uint64_t window_epoch;
+    int advise_skip;                           // Batches left before the scattered rows are announced again
+} MiniDbScanCursor;
+
+static int64_t minidb_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void minidb_index_traverse(const MiniDb *db, BTreeNode *current, void *result, void (*callback)(int64_t, void *))
+/**
+ * Tells the kernel which parts of the data file the batch is about to read. Rows that follow each other
+ * in the file are announced as a single range; scattered rows (or pages) are announced one by one, so
+ * their reads are already in flight when the rows are visited.
+ *
+ * Announcing rows that are already cached only costs system calls, so when announcing a batch turns out
+ * to be fast (the kernel found the pages in the cache), the next batches skip it and only probe again
+ * from time to time.
+ *
+ * @return True if the rows of the batch are laid out sequentially in the file.
+ */
+static bool minidb_scan_advise(MiniDbScanCursor *cursor)
 {
-    if (!is_null(current)) {
-        minidb_index_traverse(db, current->left, result, callback);
-        minidb_select(db, current->key, result);
-        callback(current->key, result);
-        minidb_index_traverse(db, current->right, result, callback);
+    const MiniDb *db = cursor->db;
+    const MiniDbIndexEntry *batch = cursor->batch;
+    int64_t row_size = minidb_is_varlen(db) ? MINIDB_PAGE_SIZE : minidb_row_size(db);
+    bool sequential = !minidb_is_varlen(db);
+
+    for (int i = 1; i < cursor->batch_count && sequential; i++) {
+        int64_t gap = batch[i].value - batch[i - 1].value;
+        sequential = gap > 0 && gap <= 2 * row_size;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    int fd = fileno(db->fd);
+    if (sequential) {
+        int64_t first = batch[0].value;
+        int64_t last = batch[cursor->batch_count - 1].value + row_size;
+        if (first < cursor->window_offset || last > cursor->window_offset + cursor->window_length) {
+            posix_fadvise(fd, first, last - first, POSIX_FADV_WILLNEED);
+        }
+    } else if (cursor->advise_skip > 0) {
+        cursor->advise_skip--;
+    } else {
+        int64_t start = minidb_clock_ns();
+        for (int i = 0; i < cursor->batch_count; i++) {
+            int64_t offset = minidb_is_varlen(db) ? (batch[i].value >> 16) * MINIDB_PAGE_SIZE : batch[i].value;
+            posix_fadvise(fd, offset, row_size, POSIX_FADV_WILLNEED);
+        }
+
+        if ((minidb_clock_ns() - start) / cursor->batch_count < MINIDB_SCAN_ADVISE_SLOW_NS) {
+            cursor->advise_skip = MINIDB_SCAN_ADVISE_PROBE;
+        }
     }
+#endif
+
+    return sequential;
 }
 
-MiniDbState minidb_select_all(const MiniDb *db, void (*callback)(int64_t, void *))
+/**
+ * Reads a fixed-size row and verifies its checksum. Sequential batches read a whole window of rows at once
+ * and serve the following rows from it; scattered rows are read one by one.
+ */
+static MiniDbState minidb_scan_read_row(MiniDbScanCursor *cursor, int64_t address, bool sequential)
 {
-    void *result = malloc(db->header.data_size);
-    if (is_null(result)) {
-        return MINIDB_ERROR_MALLOC_FAIL;
+    const MiniDb *db = cursor->db;
+    int64_t size = minidb_row_size(db);
+
+    if (cursor->window_epoch != db->write_epoch) {
+        // A callback changed the database: its rows may still be buffered by the C library
+        fflush(db->fd);
+        cursor->window_length = 0;
+        cursor->window_epoch = db->write_epoch;
+    }
+
+    if (address < cursor->window_offset || address + size > cursor->window_offset + cursor->window_length) {
+        size_t length = sequential ? cursor->window_capacity : (size_t) size;
+        ssize_t read_bytes = pread(fileno(db->fd), cursor->window, length, address);
+        if (read_bytes < size) {
+            cursor->window_length = 0;
+            return MINIDB_ERROR;
+        }
+
+        cursor->window_offset = address;
+        cursor->window_length = read_bytes;
+    }
+
+    const uint8_t *row = cursor->window + (address - cursor->window_offset);
+    uint32_t checksum;
+    memcpy(&checksum, row + db->header.data_size, sizeof(checksum));
+    if (checksum != minidb_crc32c(0, row, db->header.data_size)) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
     }
 
-    minidb_index_traverse(db, db->index.search.root, result, callback);
-    free(result);
+    memcpy(cursor->buffer, row, db->header.data_size);
     return MINIDB_OK;
 }
 
 /**
- * Finds the smallest free address available. Returns NULL if the freelist index is empty.
+ * Reads the rows of the batch and passes them to the callback of the cursor. A callback that changes the
+ * database makes the rest of the batch stale, so the batch stops there and the scan resumes right after
+ * the last row it visited.
  */
-static const BTreeNode *minidb_freelist_find_node(const MiniDb *db)
+static void minidb_scan_flush(MiniDbScanCursor *cursor)
 {
-    const BTreeNode *node = db->index.freelist.root;
-    if (!is_null(node)) {
-        while (!is_null(node->left)) {
-            node = node->left;
+    const MiniDb *db = cursor->db;
+    uint64_t epoch = db->write_epoch;
+    bool sequential = cursor->batch_count > 1 && minidb_scan_advise(cursor);
+
+    for (int i = 0; i < cursor->batch_count && cursor->state == MINIDB_OK && db->write_epoch == epoch; i++) {
+        cursor->remaining--;
+        int64_t key = cursor->batch[i].key;
+        int64_t address = cursor->batch[i].value;
+        cursor->finished = key == INT64_MAX;
+        cursor->resume = key + !cursor->finished;
+
+        if (!minidb_is_varlen(db)) {
+            cursor->state = minidb_scan_read_row(cursor, address, sequential);
+            if (cursor->state != MINIDB_OK) {
+                break;
+            }
+
+            if (!is_null(cursor->range_callback)) {
+                cursor->range_callback(key, cursor->buffer, cursor->context);
+            } else {
+                cursor->callback(key, cursor->buffer);
+            }
+
+            continue;
+        }
+
+        size_t length;
+        MiniDbState state = minidb_pager_read(&db->pager, address, cursor->buffer, cursor->buffer_size, &length);
+        if (state == MINIDB_ERROR_BUFFER_TOO_SMALL) {
+            void *buffer = realloc(cursor->buffer, length);
+            if (is_null(buffer)) {
+                cursor->state = MINIDB_ERROR_MALLOC_FAIL;
+                break;
+            }
+
+            cursor->buffer = buffer;
+            cursor->buffer_size = length;
+            state = minidb_pager_read(&db->pager, address, cursor->buffer, cursor->buffer_size, &length);
         }
+
+        if (state != MINIDB_OK) {
+            cursor->state = state;
+            break;
+        }
+
+        cursor->varlen_callback(key, cursor->buffer, length);
     }
 
-    return node;
+    cursor->batch_count = 0;
 }
 
-MiniDbState minidb_insert(MiniDb *db, int64_t key, void *data)
+/**
+ * Adds a row to the batch of the cursor, stopping the walk of the index once the batch is full. The batch
+ * is visited after the walk, so the callbacks never run while the index is being walked.
+ */
+static bool minidb_scan_visit(int64_t key, int64_t address, void *context)
 {
-    if (btree_contains(&db->index.search, key)) {
-        return MINIDB_ERROR_DUPLICATED_KEY_VIOLATION;
+    MiniDbScanCursor *cursor = context;
+    if (minidb_expiry_is_expired(&cursor->db->index.expiry, key, cursor->now)) {
+        return true;
     }
 
-    const BTreeNode *free_node = minidb_freelist_find_node(db);
-    int64_t address;
+    cursor->batch[cursor->batch_count].key = key;
+    cursor->batch[cursor->batch_count].value = address;
+    return ++cursor->batch_count < MINIDB_SCAN_BATCH && cursor->batch_count < cursor->remaining;
+}
 
-    if (is_null(free_node)) {
-        address = sizeof(MiniDbHeader) + db->header.data_size * db->header.row_count;
-    } else {
-        address = free_node->value;
-        btree_remove(&db->index.freelist, free_node->key, NULL);
-        db->header.free_count--;
-        assert(db->header.free_count == db->index.freelist.size);
+/**
+ * Visits the first 'limit' committed rows whose key is in [first, last], in key order.
+ */
+static MiniDbState minidb_scan(const MiniDb *db, int64_t first, int64_t last, int64_t limit, MiniDbScanCursor *cursor)
+{
+    cursor->db = db;
+    cursor->buffer_size = minidb_is_varlen(db) ? MINIDB_PAGE_SIZE : db->header.data_size;
+    cursor->buffer = malloc(cursor->buffer_size);
+    cursor->window_capacity = minidb_row_size(db) > MINIDB_SCAN_WINDOW ? (size_t) minidb_row_size(db) : MINIDB_SCAN_WINDOW;
+    cursor->window = minidb_is_varlen(db) ? NULL : malloc(cursor->window_capacity);
+    cursor->state = MINIDB_OK;
+    if (is_null(cursor->buffer) || (!minidb_is_varlen(db) && is_null(cursor->window))) {
+        free(cursor->buffer);
+        free(cursor->window);
+        return MINIDB_ERROR_MALLOC_FAIL;
     }
 
-    fseek(db->fd, address, SEEK_SET);
-    fwrite(data, db->header.data_size, 1, db->fd);
-    db->header.row_count++;
+    minidb_lock(db);
+    cursor->window_epoch = db->write_epoch;
+    cursor->now = minidb_expiry_now();
+    fflush(db->fd);
+    cursor->resume = first;
+    cursor->finished = false;
+    cursor->remaining = limit;
+    while (cursor->state == MINIDB_OK && !cursor->finished && cursor->resume <= last && cursor->remaining > 0) {
+        MiniDbState state = minidb_index_foreach_range(&db->index, cursor->resume, last, minidb_scan_visit, cursor);
+        if (cursor->batch_count == 0 && state == MINIDB_OK) {
+            break;
+        }
 
-    btree_insert(&db->index.search, key, address);
-    minidb_header_write(db);
-    minidb_index_write(&db->index);
-    return MINIDB_OK;
+        // The rows that precede a damaged block of the index are still visited, then the scan fails
+        minidb_scan_flush(cursor);
+        if (cursor->state == MINIDB_OK) {
+            cursor->state = state;
+        }
+    }
+
+    minidb_unlock(db);
+    free(cursor->buffer);
+    free(cursor->window);
+    return cursor->state;
 }
 
-MiniDbState minidb_update(MiniDb *db, int64_t key, void *data)
+MiniDbState minidb_select_all(const MiniDb *db, void (*callback)(int64_t, void *))
 {
-    BTreeNode *node = btree_search(&db->index.search, key);
-    if (is_null(node)) {
-        return MINIDB_ERROR_ROW_NOT_FOUND;
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
     }
 
-    fseek(db->fd, node->value, SEEK_SET);
-    fwrite(data, db->header.data_size, 1, db->fd);
-    fflush(db->fd);
-    return MINIDB_OK;
+    MiniDbScanCursor cursor = {0};
+    cursor.callback = callback;
+    return minidb_scan(db, INT64_MIN, INT64_MAX, INT64_MAX, &cursor);
 }
 
-MiniDbState minidb_delete(MiniDb *db, int64_t key)
+MiniDbState minidb_select_range(const MiniDb *db, int64_t first, int64_t last, void (*callback)(int64_t, void *, void *), void *context)
 {
-    if (db->header.row_count > 0) {
-        int64_t old_address;
-        bool removed = btree_remove(&db->index.search, key, &old_address);
-        if (removed) {
-            db->header.row_count--;
-            assert(db->header.row_count == db->index.search.size);
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    MiniDbScanCursor cursor = {0};
+    cursor.range_callback = callback;
+    cursor.context = context;
+    return minidb_scan(db, first, last, INT64_MAX, &cursor);
+}
+
+MiniDbState minidb_select_range_limit(const MiniDb *db, int64_t first, int64_t last, int64_t limit, void (*callback)(int64_t, void *, void *), void *context)
+{
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    MiniDbScanCursor cursor = {0};
+    cursor.range_callback = callback;
+    cursor.context = context;
+    return minidb_scan(db, first, last, limit, &cursor);
+}
+
+/**
+ * State shared by the threads of a parallel scan. Rows are identified by their slot in the data file.
+ */
+typedef struct MiniDbParallelScanShared
+{
+    const MiniDb *db;
+    const MiniDbParallelScan *scan;
+    int64_t *slot_keys;
+    uint8_t *slot_used;
+    int64_t slot_count;
+    int64_t slots_per_chunk;
+    int64_t chunk_count;
+    int64_t next_chunk;
+    int64_t now;
+} MiniDbParallelScanShared;
+
+typedef struct MiniDbParallelScanWorker
+{
+    MiniDbParallelScanShared *shared;
+    void *state;
+    MiniDbState result;
+} MiniDbParallelScanWorker;
+
+static bool minidb_parallel_scan_collect(int64_t key, int64_t address, void *context)
+{
+    MiniDbParallelScanShared *shared = context;
+    if (minidb_expiry_is_expired(&shared->db->index.expiry, key, shared->now)) {
+        return true;
+    }
+
+    int64_t slot = (address - (int64_t) sizeof(MiniDbHeader)) / minidb_row_size(shared->db);
+    if (slot >= 0 && slot < shared->slot_count) {
+        shared->slot_keys[slot] = key;
+        shared->slot_used[slot] = 1;
+    }
+
+    return true;
+}
 
-            btree_insert(&db->index.freelist, old_address, old_address);
-            db->header.free_count++;
-            assert(db->header.free_count == db->index.freelist.size);
+static void *minidb_parallel_scan_worker(void *arg)
+{
+    MiniDbParallelScanWorker *worker = arg;
+    MiniDbParallelScanShared *shared = worker->shared;
+    const MiniDbParallelScan *scan = shared->scan;
+    size_t data_size = shared->db->header.data_size;
+    size_t row_size = minidb_row_size(shared->db);
+    int fd = fileno(shared->db->fd);
+
+    worker->state = is_null(scan->init) ? NULL : scan->init(scan->context);
+    uint8_t *buffer = malloc(shared->slots_per_chunk * row_size);
+    if (is_null(buffer)) {
+        worker->result = MINIDB_ERROR_MALLOC_FAIL;
+        return NULL;
+    }
+
+    // Every thread takes the next chunk as soon as it finishes the previous one
+    int64_t chunk;
+    while ((chunk = __atomic_fetch_add(&shared->next_chunk, 1, __ATOMIC_RELAXED)) < shared->chunk_count) {
+        int64_t first = chunk * shared->slots_per_chunk;
+        int64_t count = shared->slot_count - first < shared->slots_per_chunk ? shared->slot_count - first : shared->slots_per_chunk;
+        size_t size = count * row_size;
+        if (pread(fd, buffer, size, (off_t) (sizeof(MiniDbHeader) + first * row_size)) != (ssize_t) size) {
+            worker->result = MINIDB_ERROR;
+            break;
+        }
+
+        for (int64_t i = 0; i < count && worker->result == MINIDB_OK; i++) {
+            if (shared->slot_used[first + i]) {
+                const uint8_t *row = buffer + i * row_size;
+                uint32_t checksum;
+                memcpy(&checksum, row + data_size, sizeof(checksum));
+                if (checksum != minidb_crc32c(0, row, data_size)) {
+                    worker->result = MINIDB_ERROR_CORRUPTED_FILE;
+                } else {
+                    scan->callback(shared->slot_keys[first + i], (void *) row, worker->state);
+                }
+            }
+        }
 
-            minidb_header_write(db);
-            minidb_index_write(&db->index);
+        if (worker->result != MINIDB_OK) {
+            break;
         }
     }
 
-    return MINIDB_OK;
+    free(buffer);
+    return NULL;
+}
+
+MiniDbState minidb_select_all_parallel(const MiniDb *db, const MiniDbParallelScan *scan)
+{
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    MiniDbParallelScanShared shared = {db, scan};
+    int thread_count = minidb_parallel_thread_count(scan->thread_count);
+    MiniDbParallelScanWorker *workers = calloc(thread_count, sizeof(MiniDbParallelScanWorker));
+    if (is_null(workers)) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    minidb_lock(db);
+    shared.slot_count = (minidb_data_file_size((MiniDb *) db) - (int64_t) sizeof(MiniDbHeader)) / minidb_row_size(db);
+    if (shared.slot_count < 0) {
+        shared.slot_count = 0;
+    }
+
+    // Rows are read in chunks of about 256 KiB
+    shared.slots_per_chunk = (256 * 1024) / minidb_row_size(db) + 1;
+    shared.chunk_count = (shared.slot_count + shared.slots_per_chunk - 1) / shared.slots_per_chunk;
+    shared.slot_keys = malloc((shared.slot_count + 1) * sizeof(int64_t));
+    shared.slot_used = calloc(shared.slot_count + 1, sizeof(uint8_t));
+
+    MiniDbState state = MINIDB_OK;
+    if (is_null(shared.slot_keys) || is_null(shared.slot_used)) {
+        state = MINIDB_ERROR_MALLOC_FAIL;
+    } else {
+        shared.now = minidb_expiry_now();
+        state = minidb_index_foreach(&db->index, minidb_parallel_scan_collect, &shared);
+    }
+
+    if (state == MINIDB_OK) {
+        for (int i = 0; i < thread_count; i++) {
+            workers[i].shared = &shared;
+            workers[i].result = MINIDB_OK;
+        }
+
+        minidb_parallel_run(minidb_parallel_scan_worker, workers, sizeof(MiniDbParallelScanWorker), thread_count);
+    }
+
+    minidb_unlock(db);
+
+    for (int i = 0; i < thread_count && state == MINIDB_OK; i++) {
+        if (workers[i].result != MINIDB_OK) {
+            state = workers[i].result;
+        }
+    }
+
+    if (!is_null(scan->reduce)) {
+        for (int i = 0; i < thread_count; i++) {
+            if (!is_null(workers[i].shared)) {
+                scan->reduce(workers[i].state, scan->context);
+            }
+        }
+    }
+
+    free(shared.slot_keys);
+    free(shared.slot_used);
+    free(workers);
+    return state;
+}
+
+static MiniDbState minidb_select_row_varlen(const MiniDb *db, int64_t key, void *buffer, size_t buffer_size, size_t *length)
+{
+    if (!minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    const MiniDbOp *op;
+    if (minidb_pending_lookup(db, key, &op)) {
+        if (is_null(op)) {
+            return MINIDB_ERROR_ROW_NOT_FOUND;
+        }
+
+        *length = op->length;
+        if (op->length > buffer_size) {
+            return MINIDB_ERROR_BUFFER_TOO_SMALL;
+        }
+
+        memcpy(buffer, op->data, op->length);
+        return MINIDB_OK;
+    }
+
+    int64_t rid;
+    MiniDbState state = minidb_index_search(&db->index, key, &rid);
+    if (state != MINIDB_OK) {
+        return state;
+    } else if (minidb_row_expired(db, key)) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    return minidb_pager_read(&db->pager, rid, buffer, buffer_size, length);
+}
+
+MiniDbState minidb_select_varlen(const MiniDb *db, int64_t key, void *buffer, size_t buffer_size, size_t *length)
+{
+    minidb_lock(db);
+    MiniDbState state = minidb_select_row_varlen(db, key, buffer, buffer_size, length);
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_select_all_varlen(const MiniDb *db, void (*callback)(int64_t, void *, size_t))
+{
+    if (!minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    MiniDbScanCursor cursor = {0};
+    cursor.varlen_callback = callback;
+    return minidb_scan(db, INT64_MIN, INT64_MAX, INT64_MAX, &cursor);
+}
+
+/**
+ * Finds the smallest free address available. Returns NULL if the freelist index is empty.
+ */
+static const BTreeNode *minidb_freelist_find_node(const MiniDb *db)
+{
+    const BTreeNode *node = db->index.freelist.root;
+    if (!is_null(node)) {
+        while (!is_null(node->left)) {
+            node = node->left;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * Writes a fixed-size row and its checksum at the given address.
+ */
+static void minidb_row_write(MiniDb *db, int64_t address, const void *data)
+{
+    uint32_t checksum = minidb_crc32c(0, data, db->header.data_size);
+    fseek(db->fd, address, SEEK_SET);
+    fwrite(data, db->header.data_size, 1, db->fd);
+    fwrite(&checksum, sizeof(checksum), 1, db->fd);
+    minidb_changes_mark(&db->changes, address, minidb_row_size(db));
+}
+
+/**
+ * Stores a new row. The key must not exist. Does not persist the header nor the index.
+ */
+static MiniDbState minidb_row_insert(MiniDb *db, int64_t key, const void *data, size_t length)
+{
+    int64_t address;
+
+    if (minidb_is_varlen(db)) {
+        MiniDbState state = minidb_pager_insert(&db->pager, data, length, &address);
+        if (state != MINIDB_OK) {
+            return state;
+        }
+    } else {
+        const BTreeNode *free_node = minidb_freelist_find_node(db);
+        if (is_null(free_node)) {
+            // The freelist is empty, so every free slot is a released one
+            address = sizeof(MiniDbHeader) + minidb_row_size(db) * (db->header.row_count + db->header.free_count);
+        } else {
+            address = free_node->value;
+            btree_remove(&db->index.freelist, free_node->key, NULL);
+            db->header.free_count--;
+            assert(db->header.free_count == db->index.freelist.size + db->released.size);
+        }
+
+        minidb_row_write(db, address, data);
+    }
+
+    db->header.row_count++;
+    minidb_index_insert(&db->index, key, address);
+    return MINIDB_OK;
+}
+
+/**
+ * Replaces an existing row. Sets index_changed if the row was moved to another address.
+ */
+static MiniDbState minidb_row_update(MiniDb *db, int64_t key, const void *data, size_t length, bool *index_changed)
+{
+    int64_t address;
+    MiniDbState state = minidb_index_search(&db->index, key, &address);
+    if (state != MINIDB_OK) {
+        return state;
+    }
+
+    if (minidb_is_varlen(db)) {
+        int64_t rid = address;
+        state = minidb_pager_update(&db->pager, &rid, data, length);
+        if (state != MINIDB_OK) {
+            return state;
+        }
+
+        if (rid != address) {
+            // The old record is released like the one of a deleted row
+            btree_insert(&db->released, address, address);
+            minidb_index_insert(&db->index, key, rid);
+            *index_changed = true;
+        }
+    } else {
+        minidb_row_write(db, address, data);
+    }
+
+    return MINIDB_OK;
+}
+
+/**
+ * Removes a row. Its space is released once the index file no longer points to it (see minidb_index_persist):
+ * reusing it earlier would make the row of another key appear under this one after a crash.
+ * Returns false if the key does not exist.
+ */
+static bool minidb_row_delete(MiniDb *db, int64_t key)
+{
+    if (db->header.row_count > 0) {
+        int64_t old_address;
+        bool removed = minidb_index_remove(&db->index, key, &old_address);
+        if (removed) {
+            db->header.row_count--;
+            assert(db->header.row_count == db->index.size);
+
+            btree_insert(&db->released, old_address, old_address);
+            if (!minidb_is_varlen(db)) {
+                db->header.free_count++;
+                assert(db->header.free_count == db->index.freelist.size + db->released.size);
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void minidb_flusher_wake_for_expiry(MiniDb *db);
+
+/**
+ * Sets or clears (expires_at = 0) the expiry time of a row. Returns false if the row does not exist.
+ */
+static bool minidb_row_expire(MiniDb *db, int64_t key, int64_t expires_at)
+{
+    if (minidb_index_search(&db->index, key, NULL) != MINIDB_OK) {
+        return false;
+    }
+
+    if (expires_at == 0) {
+        minidb_expiry_remove(&db->index.expiry, key);
+    } else {
+        minidb_expiry_set(&db->index.expiry, key, expires_at);
+        minidb_flusher_wake_for_expiry(db);
+    }
+
+    return true;
+}
+
+/**
+ * Applies an operation to the database. Sets index_changed if the header and index must be persisted.
+ */
+static MiniDbState minidb_apply(MiniDb *db, const MiniDbOp *op, bool *index_changed)
+{
+    MiniDbState state = MINIDB_OK;
+    bool changed = false;
+    int64_t expires_at;
+    db->write_epoch++;
+    switch (op->type) {
+        case MINIDB_OP_INSERT:
+            // An expired row that was not reclaimed yet gives its key to the new one
+            if (minidb_row_expired(db, op->key)) {
+                *index_changed |= minidb_row_delete(db, op->key);
+            }
+
+            state = minidb_row_insert(db, op->key, op->data, op->length);
+            changed = state == MINIDB_OK;
+            *index_changed |= changed;
+            break;
+        case MINIDB_OP_UPDATE:
+            state = minidb_row_update(db, op->key, op->data, op->length, index_changed);
+            changed = state == MINIDB_OK;
+            break;
+        case MINIDB_OP_DELETE:
+            changed = minidb_row_delete(db, op->key);
+            *index_changed |= changed;
+            break;
+        case MINIDB_OP_EXPIRE:
+            memcpy(&expires_at, op->data, sizeof(expires_at));
+            changed = minidb_row_expire(db, op->key, expires_at);
+            *index_changed |= changed;
+            break;
+        SWITCH_UNREACHABLE_DEFAULT_CASE();
+    }
+
+    if (changed) {
+        minidb_changelog_append(&db->changelog, op->type, op->key, op->data, op->length);
+    }
+
+    return state;
+}
+
+/**
+ * Adds the slots of the released rows to the freelist, or takes them back out of it.
+ */
+static void minidb_freelist_add_released(BTree *freelist, const BTreeNode *node, bool add)
+{
+    if (!is_null(node)) {
+        if (add) {
+            btree_insert(freelist, node->key, node->value);
+        } else {
+            btree_remove(freelist, node->key, NULL);
+        }
+
+        minidb_freelist_add_released(freelist, node->left, add);
+        minidb_freelist_add_released(freelist, node->right, add);
+    }
+}
+
+static void minidb_pager_remove_released(MiniDbPager *pager, const BTreeNode *node)
+{
+    if (!is_null(node)) {
+        minidb_pager_remove(pager, node->key);
+        minidb_pager_remove_released(pager, node->left);
+        minidb_pager_remove_released(pager, node->right);
+    }
+}
+
+/**
+ * Writes the index, then releases the space of the rows deleted since it was last written, since the
+ * index file no longer points to them. The free slots of fixed-size rows are stored in the index file,
+ * so they are added to the freelist right before it is written, and taken out again if the write fails.
+ */
+static MiniDbState minidb_index_persist(MiniDb *db, bool sync)
+{
+    bool varlen = minidb_is_varlen(db);
+    if (!varlen) {
+        minidb_freelist_add_released(&db->index.freelist, db->released.root, true);
+    }
+
+    MiniDbState state = minidb_index_write(&db->index, sync);
+    if (state != MINIDB_OK) {
+        if (!varlen) {
+            minidb_freelist_add_released(&db->index.freelist, db->released.root, false);
+        }
+
+        return state;
+    }
+
+    if (varlen) {
+        minidb_pager_remove_released(&db->pager, db->released.root);
+    }
+
+    btree_destroy(&db->released);
+    return MINIDB_OK;
+}
+
+/**
+ * Writes the header and the index if they changed, otherwise only flushes the rows, then logs the changes:
+ * replicas see them once they reached the files of the primary. If sync is true, the files and the change
+ * log are also synced to the storage device.
+ *
+ * @return MINIDB_OK on success. The index is not written if the rows could not be, so it never points to
+ *         rows that are missing from the data file, and the changes are not logged if either could not be.
+ */
+static MiniDbState minidb_persist(MiniDb *db, bool index_changed, bool sync)
+{
+    if (db->failed) {
+        return MINIDB_ERROR_REOPEN_REQUIRED;
+    }
+
+    // Changes deferred by the flush policy are written along with these ones
+    index_changed |= db->flusher.dirty_index;
+    bool written = !index_changed || minidb_header_write(db);
+    written &= sync ? minidb_file_sync(db->fd) : fflush(db->fd) == 0;
+
+    MiniDbState state = written ? MINIDB_OK : MINIDB_ERROR;
+    if (written && index_changed) {
+        state = minidb_index_persist(db, sync);
+    }
+
+    // A failed write is retried by the next one
+    db->flusher.dirty_index = state != MINIDB_OK && index_changed;
+    db->flusher.dirty_rows = state != MINIDB_OK;
+    db->flusher.dirty_ops = 0;
+    db->flusher.dirty_bytes = 0;
+    if (state == MINIDB_OK) {
+        state = minidb_changelog_commit(&db->changelog);
+    }
+
+    if (state == MINIDB_OK && sync) {
+        state = minidb_changelog_sync(&db->changelog);
+    }
+
+    return state;
+}
+
+static void minidb_defer(MiniDb *db, bool index_changed, size_t length);
+
+
+/**
+ * Finds out whether the key exists, taking into account the operations buffered by the open transaction.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the block of the index that may hold the key is damaged.
+ */
+static MiniDbState minidb_key_exists(const MiniDb *db, int64_t key, bool *exists)
+{
+    if (db->in_transaction) {
+        const MiniDbOp *op = minidb_transaction_find(&db->tx, key);
+        if (!is_null(op)) {
+            *exists = op->type != MINIDB_OP_DELETE;
+            return MINIDB_OK;
+        }
+    }
+
+    MiniDbState state = minidb_index_search(&db->index, key, NULL);
+    *exists = state == MINIDB_OK && !minidb_row_expired(db, key);
+    return state == MINIDB_ERROR_ROW_NOT_FOUND ? MINIDB_OK : state;
+}
+
+/**
+ * Validates a write on a key and either buffers its operations in the open transaction or applies and
+ * persists them right away. The first operation decides whether the write is valid.
+ */
+static MiniDbState minidb_write_ops(MiniDb *db, const MiniDbOp *ops, int count)
+{
+    if (db->failed) {
+        return MINIDB_ERROR_REOPEN_REQUIRED;
+    }
+
+    // A damaged index cannot tell whether the key exists
+    bool exists;
+    MiniDbState state = minidb_key_exists(db, ops[0].key, &exists);
+    if (state != MINIDB_OK) {
+        return state;
+    } else if (ops[0].type == MINIDB_OP_INSERT && exists) {
+        return MINIDB_ERROR_DUPLICATED_KEY_VIOLATION;
+    } else if ((ops[0].type == MINIDB_OP_UPDATE || ops[0].type == MINIDB_OP_EXPIRE) && !exists) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    } else if (ops[0].type == MINIDB_OP_DELETE && !exists) {
+        return MINIDB_OK;
+    }
+
+    if (db->in_transaction) {
+        for (int i = 0; i < count && state == MINIDB_OK; i++) {
+            state = minidb_transaction_append(&db->tx, ops[i].type, ops[i].key, ops[i].data, ops[i].length);
+        }
+
+        return state;
+    }
+
+    bool index_changed = false;
+    size_t length = 0;
+    for (int i = 0; i < count && state == MINIDB_OK; i++) {
+        state = minidb_apply(db, &ops[i], &index_changed);
+        length += ops[i].length;
+    }
+
+    MiniDbState persist_state = MINIDB_OK;
+    if (minidb_persists_every_op(db)) {
+        persist_state = minidb_persist(db, index_changed, minidb_syncs_every_op(db));
+    } else {
+        // The changes are logged by the flush that persists them
+        minidb_defer(db, index_changed, length);
+    }
+
+    return state != MINIDB_OK ? state : persist_state;
+}
+
+static MiniDbState minidb_write(MiniDb *db, MiniDbOpType type, int64_t key, const void *data, size_t length)
+{
+    MiniDbOp op = {type, key, length, (void *) data};
+    return minidb_write_ops(db, &op, 1);
+}
+
+static MiniDbState minidb_write_locked(MiniDb *db, MiniDbOpType type, int64_t key, const void *data, size_t length)
+{
+    minidb_lock(db);
+    MiniDbState state = minidb_write(db, type, key, data, length);
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_insert(MiniDb *db, int64_t key, void *data)
+{
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    return minidb_write_locked(db, MINIDB_OP_INSERT, key, data, db->header.data_size);
+}
+
+MiniDbState minidb_insert_varlen(MiniDb *db, int64_t key, const void *data, size_t length)
+{
+    if (!minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    return minidb_write_locked(db, MINIDB_OP_INSERT, key, data, length);
+}
+
+/**
+ * Returns the expiry time of a row that lives for ttl_ms from now, or 0 if it never expires.
+ */
+static int64_t minidb_expires_at(int64_t ttl_ms)
+{
+    return ttl_ms == MINIDB_NO_TTL ? 0 : minidb_expiry_now() + ttl_ms;
+}
+
+MiniDbState minidb_insert_ttl(MiniDb *db, int64_t key, void *data, int64_t ttl_ms)
+{
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    int64_t expires_at = minidb_expires_at(ttl_ms);
+    MiniDbOp ops[] = {
+        {MINIDB_OP_INSERT, key, db->header.data_size, data},
+        {MINIDB_OP_EXPIRE, key, sizeof(expires_at), &expires_at},
+    };
+
+    minidb_lock(db);
+    MiniDbState state = minidb_write_ops(db, ops, expires_at == 0 ? 1 : 2);
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_update(MiniDb *db, int64_t key, void *data)
+{
+    if (minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    return minidb_write_locked(db, MINIDB_OP_UPDATE, key, data, db->header.data_size);
+}
+
+MiniDbState minidb_update_varlen(MiniDb *db, int64_t key, const void *data, size_t length)
+{
+    if (!minidb_is_varlen(db)) {
+        return MINIDB_ERROR_UNSUPPORTED_OPERATION;
+    }
+
+    return minidb_write_locked(db, MINIDB_OP_UPDATE, key, data, length);
+}
+
+MiniDbState minidb_delete(MiniDb *db, int64_t key)
+{
+    return minidb_write_locked(db, MINIDB_OP_DELETE, key, NULL, 0);
+}
+
+MiniDbState minidb_set_ttl(MiniDb *db, int64_t key, int64_t ttl_ms)
+{
+    int64_t expires_at = minidb_expires_at(ttl_ms);
+    return minidb_write_locked(db, MINIDB_OP_EXPIRE, key, &expires_at, sizeof(expires_at));
+}
+
+MiniDbState minidb_begin(MiniDb *db)
+{
+    MiniDbState state = MINIDB_ERROR_TRANSACTION_ACTIVE;
+    minidb_lock(db);
+    if (db->failed) {
+        state = MINIDB_ERROR_REOPEN_REQUIRED;
+    } else if (!db->in_transaction) {
+        db->in_transaction = true;
+        state = MINIDB_OK;
+    }
+
+    minidb_unlock(db);
+    return state;
+}
+
+/**
+ * Turns inserts and updates into whichever of the two applies to the current state of the row.
+ * Replaying operations this way gives the same result when part of them were already applied.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the block of the index that may hold the key is damaged.
+ */
+static MiniDbState minidb_upsert_type(const MiniDb *db, MiniDbOp *op)
+{
+    bool exists = false;
+    MiniDbState state = MINIDB_OK;
+    if (op->type == MINIDB_OP_INSERT) {
+        // An insert over an expired row replaces it, as it did when the operation was first applied
+        state = minidb_key_exists(db, op->key, &exists);
+    } else if (op->type == MINIDB_OP_UPDATE) {
+        state = minidb_index_search(&db->index, op->key, NULL);
+        exists = state == MINIDB_OK;
+        state = state == MINIDB_ERROR_ROW_NOT_FOUND ? MINIDB_OK : state;
+    } else {
+        return MINIDB_OK;
+    }
+
+    op->type = exists ? MINIDB_OP_UPDATE : MINIDB_OP_INSERT;
+    return state;
+}
+
+/**
+ * Called when a batch of changes was applied only in part. The rows and the index in memory match
+ * neither the state before the batch nor the one after it, so they are never written: the journal
+ * replays the whole batch when the database is reopened, and until then writes are refused.
+ */
+static void minidb_fail(MiniDb *db)
+{
+    db->failed = true;
+    minidb_changelog_discard(&db->changelog);
+    db->flusher.dirty_index = false;
+    db->flusher.dirty_rows = false;
+    db->flusher.dirty_ops = 0;
+    db->flusher.dirty_bytes = 0;
+}
+
+/**
+ * Applies every operation of a transaction and persists the header, index and rows once.
+ * If upsert is true, inserts and updates are applied as upserts (see minidb_upsert_type).
+ * If an operation cannot be applied, the database fails (see minidb_fail).
+ */
+static MiniDbState minidb_apply_all(MiniDb *db, const MiniDbTransaction *tx, bool upsert)
+{
+    // Changes deferred by the flush policy are persisted first, so a failure below does not lose them
+    MiniDbState state = minidb_persist(db, false, false);
+    if (state != MINIDB_OK) {
+        return state;
+    }
+
+    bool index_changed = false;
+    for (int64_t i = 0; i < tx->count && state == MINIDB_OK; i++) {
+        MiniDbOp op = tx->ops[i];
+        if (upsert) {
+            state = minidb_upsert_type(db, &op);
+        }
+
+        if (state == MINIDB_OK) {
+            state = minidb_apply(db, &op, &index_changed);
+        }
+    }
+
+    if (state != MINIDB_OK) {
+        minidb_fail(db);
+        return state;
+    }
+
+    // If the changes cannot be persisted, they stay in memory and are logged with the next batch that is
+    return minidb_persist(db, index_changed, true);
+}
+
+MiniDbState minidb_commit(MiniDb *db)
+{
+    minidb_lock(db);
+    if (!db->in_transaction) {
+        minidb_unlock(db);
+        return MINIDB_ERROR_NO_TRANSACTION;
+    }
+
+    MiniDbState state = MINIDB_OK;
+    if (db->tx.count > 0) {
+        // The journal makes the commit atomic: if the process dies while the operations are being
+        // applied, minidb_open replays the whole transaction. It is also kept if they could not be
+        // applied or persisted, so the next minidb_open replays them.
+        state = minidb_transaction_journal_write(&db->tx, db->journal_path);
+        if (state == MINIDB_OK) {
+            state = minidb_apply_all(db, &db->tx, false);
+        }
+
+        if (state == MINIDB_OK) {
+            remove(db->journal_path);
+        }
+    }
+
+    minidb_transaction_clear(&db->tx);
+    db->in_transaction = false;
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_rollback(MiniDb *db)
+{
+    MiniDbState state = MINIDB_ERROR_NO_TRANSACTION;
+    minidb_lock(db);
+    if (db->in_transaction) {
+        minidb_transaction_clear(&db->tx);
+        db->in_transaction = false;
+        state = MINIDB_OK;
+    }
+
+    minidb_unlock(db);
+    return state;
+}
+
+/**
+ * Replays a complete journal left behind by a commit that was interrupted. Operations are
+ * applied as upserts, since part of the transaction may already be stored in the database.
+ *
+ * @return MINIDB_OK on success. The journal is kept if it could not be replayed whole.
+ */
+static MiniDbState minidb_journal_recover(MiniDb *db)
+{
+    MiniDbTransaction journal;
+    minidb_transaction_init(&journal);
+
+    MiniDbState state = MINIDB_OK;
+    if (minidb_transaction_journal_read(&journal, db->journal_path)) {
+        state = minidb_apply_all(db, &journal, true);
+    }
+
+    minidb_transaction_clear(&journal);
+    if (state == MINIDB_OK) {
+        remove(db->journal_path);
+    }
+
+    return state;
+}
+
+/**
+ * Returns true if the deferred changes must be written now.
+ */
+static bool minidb_flush_due(const MiniDb *db)
+{
+    const MiniDbFlusher *flusher = &db->flusher;
+    if (!flusher->dirty_index && !flusher->dirty_rows) {
+        return false;
+    }
+
+    return flusher->requested
+           || (flusher->options.sync_policy == MINIDB_SYNC_EVERY_N_OPS && flusher->dirty_ops >= flusher->options.sync_ops)
+           || (flusher->options.dirty_limit > 0 && flusher->dirty_bytes > flusher->options.dirty_limit);
+}
+
+/**
+ * Writes and logs the deferred changes, then syncs them. Must be called with the lock held; the lock is
+ * released while the files are being synced, so writers only wait for the data to reach the page cache.
+ */
+static MiniDbState minidb_flush(MiniDb *db, bool sync_index)
+{
+    bool index_changed = db->flusher.dirty_index;
+    db->flusher.requested = false;
+    MiniDbState state = minidb_persist(db, index_changed, false);
+
+    // A writer whose batch cannot be logged closes the change log, so it is synced through a copy of its descriptor
+    int log_fd = db->changelog.fd >= 0 ? dup(db->changelog.fd) : -1;
+    minidb_unlock(db);
+    if (!minidb_file_sync(db->fd) && state == MINIDB_OK) {
+        state = MINIDB_ERROR;
+    }
+
+    if (index_changed || sync_index) {
+        minidb_index_sync(&db->index);
+    }
+
+    if (log_fd >= 0) {
+        if (fsync(log_fd) != 0 && state == MINIDB_OK) {
+            state = MINIDB_ERROR;
+        }
+
+        close(log_fd);
+    }
+
+    minidb_lock(db);
+    db->flusher.generation++;
+    pthread_cond_broadcast(&db->flusher.flushed);
+    return state;
+}
+
+/**
+ * Records a change that was applied but not persisted yet, and applies back-pressure if the deferred
+ * state grew over the configured limit: the writer waits for the flusher, or flushes the changes itself
+ * if the lock is held further up its stack (e.g. by a scan whose callback writes), since waiting would
+ * not release the lock and the flusher could never take it.
+ */
+static void minidb_defer(MiniDb *db, bool index_changed, size_t length)
+{
+    MiniDbFlusher *flusher = &db->flusher;
+    flusher->dirty_index |= index_changed;
+    flusher->dirty_rows = true;
+    flusher->dirty_ops++;
+    flusher->dirty_bytes += length + (index_changed ? sizeof(BTreeNode) : 0);
+
+    if (minidb_flush_due(db)) {
+        pthread_cond_signal(&flusher->wake);
+    }
+
+    if (flusher->options.dirty_limit > 0 && flusher->dirty_bytes > flusher->options.dirty_limit) {
+        if (db->lock_depth > 1) {
+            minidb_flush(db, false);
+            return;
+        }
+
+        uint64_t generation = flusher->generation;
+        while (flusher->generation == generation && flusher->running) {
+            minidb_lock_wait(db, &flusher->flushed, NULL);
+        }
+    }
+}
+
+static int minidb_compare_address(const void *a, const void *b)
+{
+    int64_t left = ((const MiniDbIndexEntry *) a)->value;
+    int64_t right = ((const MiniDbIndexEntry *) b)->value;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Deletes an expired row. Returns false if the key does not exist.
+ */
+static bool minidb_row_reclaim(MiniDb *db, int64_t key)
+{
+    if (!minidb_row_delete(db, key)) {
+        return false;
+    }
+
+    minidb_changelog_append(&db->changelog, MINIDB_OP_DELETE, key, NULL, 0);
+    return true;
+}
+
+/**
+ * Deletes the rows of a range sorted by address, middle first. Rows expire in the order they were
+ * written, so deleting them in that order would add their slots to the freelist tree in ascending order.
+ *
+ * @return The number of rows deleted.
+ */
+static int64_t minidb_delete_balanced(MiniDb *db, const MiniDbIndexEntry *rows, int64_t first, int64_t last)
+{
+    if (first >= last) {
+        return 0;
+    }
+
+    int64_t middle = first + (last - first) / 2;
+    int64_t count = minidb_row_reclaim(db, rows[middle].key) ? 1 : 0;
+    count += minidb_delete_balanced(db, rows, first, middle);
+    count += minidb_delete_balanced(db, rows, middle + 1, last);
+    return count;
+}
+
+/**
+ * Deletes up to 'limit' expired rows and persists the header and the index once for all of them.
+ * Must be called with the lock held.
+ *
+ * @return The number of rows deleted.
+ */
+static int64_t minidb_reclaim(MiniDb *db, int64_t now, int64_t limit)
+{
+    MiniDbIndexEntry *rows = NULL;
+    int64_t row_count = 0;
+    int64_t capacity = 0;
+    int64_t count = 0;
+    int64_t key;
+
+    while (row_count < limit && minidb_expiry_pop_due(&db->index.expiry, now, &key)) {
+        int64_t address;
+        if (minidb_index_search(&db->index, key, &address) != MINIDB_OK) {
+            minidb_expiry_remove(&db->index.expiry, key);
+            continue;
+        }
+
+        if (row_count == capacity) {
+            int64_t new_capacity = capacity > 0 ? capacity * 2 : 256;
+            MiniDbIndexEntry *new_rows = realloc(rows, new_capacity * sizeof(MiniDbIndexEntry));
+            if (is_null(new_rows)) {
+                // The row is deleted right away, only the order of the freelist is lost
+                count += minidb_row_reclaim(db, key) ? 1 : 0;
+                continue;
+            }
+
+            rows = new_rows;
+            capacity = new_capacity;
+        }
+
+        rows[row_count].key = key;
+        rows[row_count].value = address;
+        row_count++;
+    }
+
+    if (row_count > 0) {
+        qsort(rows, row_count, sizeof(MiniDbIndexEntry), minidb_compare_address);
+        count += minidb_delete_balanced(db, rows, 0, row_count);
+    }
+
+    free(rows);
+    db->flusher.last_reclaim = now;
+    if (count > 0) {
+        db->write_epoch++;
+        if (minidb_persists_every_op(db)) {
+            minidb_persist(db, true, minidb_syncs_every_op(db));
+        } else {
+            // Marked directly rather than through minidb_defer, which may wait for the flusher thread
+            db->flusher.dirty_index = true;
+            db->flusher.dirty_rows = true;
+            db->flusher.dirty_ops += count;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Returns when the next batch of expired rows should be reclaimed, in milliseconds since the epoch,
+ * or INT64_MAX if no row has an expiry time. Batches are at least reclaim_interval_ms apart.
+ */
+static int64_t minidb_reclaim_due(MiniDb *db)
+{
+    int64_t next = minidb_expiry_next(&db->index.expiry);
+    if (next == INT64_MAX) {
+        return INT64_MAX;
+    }
+
+    int64_t earliest = db->flusher.last_reclaim + db->flusher.options.reclaim_interval_ms;
+    return next > earliest ? next : earliest;
+}
+
+static void *minidb_flusher_main(void *arg)
+{
+    MiniDb *db = arg;
+    MiniDbFlusher *flusher = &db->flusher;
+
+    minidb_lock(db);
+    while (!flusher->stop) {
+        if (minidb_flush_due(db)) {
+            minidb_flush(db, false);
+            continue;
+        }
+
+        int64_t now = minidb_expiry_now();
+        int64_t reclaim_at = minidb_reclaim_due(db);
+        if (reclaim_at <= now) {
+            // Rows are not deleted under an open transaction, which may have buffered changes to them
+            if (db->in_transaction || db->failed) {
+                flusher->last_reclaim = now;
+            } else {
+                minidb_reclaim(db, now, MINIDB_RECLAIM_BATCH);
+            }
+
+            continue;
+        }
+
+        int64_t flush_at = INT64_MAX;
+        if (flusher->options.sync_policy == MINIDB_SYNC_INTERVAL) {
+            // The deadline is absolute, so waking up early (e.g. for a new expiry time) does not postpone it
+            if (flusher->next_flush <= now) {
+                flusher->requested = flusher->next_flush != 0;
+                flusher->next_flush = now + flusher->options.sync_interval_ms;
+                continue;
+            }
+
+            flush_at = flusher->next_flush;
+        }
+
+        int64_t wake_at = flush_at < reclaim_at ? flush_at : reclaim_at;
+        if (wake_at == INT64_MAX) {
+            minidb_lock_wait(db, &flusher->wake, NULL);
+            continue;
+        }
+
+        // The expiry times use the same clock as the condition variable
+        struct timespec deadline;
+        deadline.tv_sec = wake_at / 1000;
+        deadline.tv_nsec = (wake_at % 1000) * 1000000;
+        minidb_lock_wait(db, &flusher->wake, &deadline);
+    }
+
+    minidb_unlock(db);
+    return NULL;
+}
+
+static MiniDbState minidb_flusher_spawn(MiniDb *db)
+{
+    if (pthread_create(&db->flusher.thread, NULL, minidb_flusher_main, db) != 0) {
+        return MINIDB_ERROR;
+    }
+
+    db->flusher.running = true;
+    return MINIDB_OK;
+}
+
+/**
+ * Lets the background thread know that a row got an expiry time, starting the thread if this is the
+ * first one. Must be called with the lock held.
+ */
+static void minidb_flusher_wake_for_expiry(MiniDb *db)
+{
+    MiniDbFlusher *flusher = &db->flusher;
+    if (flusher->running) {
+        pthread_cond_signal(&flusher->wake);
+    } else if (flusher->ready && !flusher->stop) {
+        // Without the thread, expired rows are still hidden and minidb_reclaim_expired deletes them
+        minidb_flusher_spawn(db);
+    }
+}
+
+static MiniDbState minidb_flusher_start(MiniDb *db, const MiniDbOptions *options)
+{
+    MiniDbFlusher *flusher = &db->flusher;
+    if (!is_null(options)) {
+        flusher->options = *options;
+    }
+
+    if (flusher->options.sync_interval_ms <= 0) {
+        flusher->options.sync_interval_ms = 1000;
+    }
+
+    if (flusher->options.sync_ops <= 0) {
+        flusher->options.sync_ops = 1;
+    }
+
+    if (flusher->options.reclaim_interval_ms <= 0) {
+        flusher->options.reclaim_interval_ms = MINIDB_RECLAIM_INTERVAL_MS;
+    }
+
+    flusher->ready = true;
+    if (minidb_persists_every_op(db) && db->index.expiry.by_key.size == 0) {
+        // The thread is started when a row gets an expiry time
+        return MINIDB_OK;
+    }
+
+    return minidb_flusher_spawn(db);
+}
+
+static void minidb_flusher_stop(MiniDb *db)
+{
+    MiniDbFlusher *flusher = &db->flusher;
+    minidb_lock(db);
+    bool running = flusher->running;
+    flusher->stop = true;
+    flusher->running = false;
+    pthread_cond_signal(&flusher->wake);
+    pthread_cond_broadcast(&flusher->flushed);
+    minidb_unlock(db);
+
+    if (running) {
+        pthread_join(flusher->thread, NULL);
+    }
+}
+
+MiniDbState minidb_checkpoint(MiniDb *db)
+{
+    minidb_lock(db);
+    MiniDbState state = minidb_flush(db, true);
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_reclaim_expired(MiniDb *db, int64_t *reclaimed)
+{
+    minidb_lock(db);
+    if (db->in_transaction || db->failed) {
+        minidb_unlock(db);
+        return db->failed ? MINIDB_ERROR_REOPEN_REQUIRED : MINIDB_ERROR_TRANSACTION_ACTIVE;
+    }
+
+    int64_t count = minidb_reclaim(db, minidb_expiry_now(), INT64_MAX);
+    minidb_unlock(db);
+
+    if (!is_null(reclaimed)) {
+        *reclaimed = count;
+    }
+
+    return MINIDB_OK;
+}
+
+/**
+ * Returns the size of the data file, after flushing the rows buffered by the C library.
+ */
+static int64_t minidb_data_file_size(MiniDb *db)
+{
+    struct stat st;
+    fflush(db->fd);
+    return fstat(fileno(db->fd), &st) == 0 ? (int64_t) st.st_size : INT64_C(0);
+}
+
+/**
+ * Copies the index image to the backup. Images are replaced, never modified in place, so the file
+ * opened while holding the lock can be copied after releasing it.
+ */
+static MiniDbState minidb_backup_index(int index_fd, const char *dest_index_path)
+{
+    if (index_fd < 0) {
+        // The database has not written its index yet
+        remove(dest_index_path);
+        return MINIDB_OK;
+    }
+
+    struct stat st;
+    int dest_fd = open(dest_index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_fd < 0 || fstat(index_fd, &st) != 0) {
+        if (dest_fd >= 0) {
+            close(dest_fd);
+        }
+
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    MiniDbState state = minidb_backup_copy_range(index_fd, dest_fd, 0, st.st_size);
+    if (state == MINIDB_OK && fsync(dest_fd) != 0) {
+        state = MINIDB_ERROR;
+    }
+
+    close(dest_fd);
+    return state;
+}
+
+/**
+ * The position of the change log a replica matches, stored in its -replica file.
+ */
+typedef struct MiniDbReplicaPosition
+{
+    uint64_t magic;
+    int64_t position;
+} MiniDbReplicaPosition;
+
+static MiniDbState minidb_replica_position_write(const char *path, int64_t position)
+{
+    FILE *fd = fopen(path, "wb");
+    if (is_null(fd)) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    MiniDbReplicaPosition record = {MINIDB_REPLICA_MAGIC, position};
+    size_t written = fwrite(&record, sizeof(record), 1, fd);
+    minidb_file_sync(fd);
+    fclose(fd);
+    return written == 1 ? MINIDB_OK : MINIDB_ERROR;
+}
+
+/**
+ * Returns the position stored in a -replica file, or the start of the change log if there is none.
+ */
+static int64_t minidb_replica_position_read(const char *path)
+{
+    MiniDbReplicaPosition record = {0, 0};
+    FILE *fd = fopen(path, "rb");
+    if (!is_null(fd)) {
+        if (fread(&record, sizeof(record), 1, fd) != 1) {
+            record.magic = 0;
+        }
+
+        fclose(fd);
+    }
+
+    return record.magic == MINIDB_REPLICA_MAGIC ? record.position : MINIDB_CHANGELOG_START;
+}
+
+/**
+ * Copies the data file in rounds. The first round copies the whole file (or, for incremental backups,
+ * the blocks written since the previous backup) without holding the lock; every following round copies
+ * the blocks written during the previous one. Once few enough blocks are left, the last round copies
+ * them with the lock held, along with the header, so the backup is consistent.
+ */
+static MiniDbState minidb_backup_run(MiniDb *db, const char *dest_path, bool incremental)
+{
+    char dest_index_path[MINIDB_PATH_MAX];
+    char dest_journal_path[MINIDB_PATH_MAX];
+    char dest_replica_path[MINIDB_PATH_MAX];
+    minidb_build_file_path(dest_path, MINIDB_INDEX_SUFFIX, dest_index_path, sizeof(dest_index_path));
+    minidb_build_file_path(dest_path, MINIDB_JOURNAL_SUFFIX, dest_journal_path, sizeof(dest_journal_path));
+    minidb_build_file_path(dest_path, MINIDB_REPLICA_SUFFIX, dest_replica_path, sizeof(dest_replica_path));
+
+    minidb_lock(db);
+    if (db->backup_running || db->failed) {
+        minidb_unlock(db);
+        return db->failed ? MINIDB_ERROR_REOPEN_REQUIRED : MINIDB_ERROR;
+    }
+
+    int dest_fd = -1;
+    if (incremental && strcmp(db->backup_path, dest_path) == 0) {
+        dest_fd = open(dest_path, O_WRONLY);
+    }
+
+    incremental = dest_fd >= 0;
+    if (!incremental) {
+        dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (dest_fd < 0) {
+        minidb_unlock(db);
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    // The change map is consumed by this backup, so if it fails the next one has to copy everything
+    db->backup_running = true;
+    db->backup_path[0] = '\0';
+
+    MiniDbChangeMap pass;
+    minidb_changes_init(&pass);
+    minidb_persist(db, false, false);
+    int64_t size = minidb_data_file_size(db);
+    minidb_changes_swap(&pass, &db->changes);
+    minidb_unlock(db);
+
+    int source_fd = fileno(db->fd);
+    MiniDbState state = incremental
+                        ? minidb_backup_copy_blocks(source_fd, dest_fd, &pass, size)
+                        : minidb_backup_copy_range(source_fd, dest_fd, 0, size);
+
+    int round = 0;
+    while (state == MINIDB_OK) {
+        minidb_lock(db);
+        // An overflowed map is copied whole, which is not done with the lock held unless the rounds run out
+        if (round++ >= MINIDB_BACKUP_MAX_ROUNDS
+            || (minidb_changes_count(&db->changes) <= MINIDB_BACKUP_FINAL_BLOCKS && !db->changes.overflow)) {
+            break;
+        }
+
+        size = minidb_data_file_size(db);
+        minidb_changes_clear(&pass);
+        minidb_changes_swap(&pass, &db->changes);
+        minidb_unlock(db);
+        state = minidb_backup_copy_blocks(source_fd, dest_fd, &pass, size);
+    }
+
+    int index_fd = -1;
+    int64_t log_position = -1;
+    if (state == MINIDB_OK) {
+        // Deferred changes are written first, so the header and the index image match the rows
+        minidb_header_write(db);
+        minidb_persist(db, false, false);
+        size = minidb_data_file_size(db);
+        minidb_changes_clear(&pass);
+        minidb_changes_swap(&pass, &db->changes);
+        state = minidb_backup_copy_blocks(source_fd, dest_fd, &pass, size);
+        if (state == MINIDB_OK && ftruncate(dest_fd, size) != 0) {
+            state = MINIDB_ERROR;
+        }
+
+        index_fd = open(db->index.path, O_RDONLY);
+
+        // Every change up to this position is in the backup, so a replica made from it starts there
+        if (db->changelog.fd >= 0) {
+            log_position = db->changelog.size;
+        }
+    } else {
+        minidb_lock(db);
+    }
+
+    minidb_unlock(db);
+
+    if (state == MINIDB_OK) {
+        state = minidb_backup_index(index_fd, dest_index_path);
+    }
+
+    if (state == MINIDB_OK && fsync(dest_fd) != 0) {
+        state = MINIDB_ERROR;
+    }
+
+    if (index_fd >= 0) {
+        close(index_fd);
+    }
+
+    close(dest_fd);
+    remove(dest_journal_path);
+    minidb_changes_destroy(&pass);
+    if (state == MINIDB_OK && log_position >= 0) {
+        state = minidb_replica_position_write(dest_replica_path, log_position);
+    } else {
+        remove(dest_replica_path);
+    }
+
+    minidb_lock(db);
+    if (state == MINIDB_OK) {
+        minidb_build_file_path(dest_path, "", db->backup_path, sizeof(db->backup_path));
+    }
+
+    db->backup_running = false;
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_backup(MiniDb *db, const char *dest_path)
+{
+    return minidb_backup_run(db, dest_path, false);
+}
+
+MiniDbState minidb_backup_incremental(MiniDb *db, const char *dest_path)
+{
+    return minidb_backup_run(db, dest_path, true);
+}
+
+/**
+ * State shared by the threads of minidb_verify. The rows (or pages) of the data file are split into
+ * chunks of about MINIDB_VERIFY_CHUNK bytes that the threads take as they finish the previous one.
+ */
+typedef struct MiniDbVerifyShared
+{
+    int fd;
+    size_t data_size;       // MINIDB_VARLEN if the units are pages
+    int64_t first_offset;   // Offset of the first unit
+    int64_t unit_size;
+    int64_t unit_count;
+    const uint8_t *live;    // Units to verify, or NULL to verify all of them
+    int64_t units_per_chunk;
+    int64_t chunk_count;
+    int64_t next_chunk;
+} MiniDbVerifyShared;
+
+typedef struct MiniDbVerifyWorker
+{
+    MiniDbVerifyShared *shared;
+    int64_t checked;
+    int64_t corrupted;
+    int64_t first_corrupted;
+    int64_t bytes_read;
+    bool failed;
+} MiniDbVerifyWorker;
+
+static bool minidb_verify_unit(const MiniDbVerifyShared *shared, const uint8_t *unit)
+{
+    if (shared->data_size == MINIDB_VARLEN) {
+        return minidb_pager_check_page(unit);
+    }
+
+    uint32_t checksum;
+    memcpy(&checksum, unit + shared->data_size, sizeof(checksum));
+    return checksum == minidb_crc32c(0, unit, shared->data_size);
+}
+
+static void *minidb_verify_worker(void *arg)
+{
+    MiniDbVerifyWorker *worker = arg;
+    MiniDbVerifyShared *shared = worker->shared;
+    uint8_t *buffer = malloc(shared->units_per_chunk * shared->unit_size);
+    if (is_null(buffer)) {
+        worker->failed = true;
+        return NULL;
+    }
+
+    int64_t chunk;
+    while ((chunk = __atomic_fetch_add(&shared->next_chunk, 1, __ATOMIC_RELAXED)) < shared->chunk_count) {
+        int64_t first = chunk * shared->units_per_chunk;
+        int64_t count = shared->unit_count - first < shared->units_per_chunk ? shared->unit_count - first : shared->units_per_chunk;
+        int64_t offset = shared->first_offset + first * shared->unit_size;
+        ssize_t read_bytes = pread(shared->fd, buffer, count * shared->unit_size, (off_t) offset);
+        if (read_bytes < 0) {
+            read_bytes = 0;
+        }
+
+        worker->bytes_read += read_bytes;
+        for (int64_t i = 0; i < count; i++) {
+            if (!is_null(shared->live) && !shared->live[first + i]) {
+                continue;
+            }
+
+            // Units cut short by the end of the file are damaged as well
+            worker->checked++;
+            if ((i + 1) * shared->unit_size > read_bytes || !minidb_verify_unit(shared, buffer + i * shared->unit_size)) {
+                if (worker->corrupted++ == 0) {
+                    worker->first_corrupted = offset + i * shared->unit_size;
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+typedef struct MiniDbVerifyLive
+{
+    uint8_t *live;
+    int64_t first_offset;
+    int64_t unit_size;
+    int64_t unit_count;
+    int64_t missing;        // Rows of the index past the end of the data file
+    int64_t first_missing;
+} MiniDbVerifyLive;
+
+static bool minidb_verify_collect(int64_t key, int64_t address, void *context)
+{
+    MiniDbVerifyLive *live = context;
+    int64_t slot = (address - live->first_offset) / live->unit_size;
+    if (slot >= 0 && slot < live->unit_count) {
+        live->live[slot] = 1;
+    } else if (live->missing++ == 0 || address < live->first_missing) {
+        live->first_missing = address;
+    }
+
+    return true;
+}
+
+/**
+ * Verifies the rows (or pages) of the data file with several threads.
+ */
+static MiniDbState minidb_verify_data(int fd, const MiniDbHeader *header, const MiniDbIndex *index, int thread_count, MiniDbVerifyReport *report)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return MINIDB_ERROR;
+    }
+
+    MiniDbVerifyShared shared = {fd, header->data_size};
+    MiniDbVerifyLive live = {NULL};
+    if (header->data_size == MINIDB_VARLEN) {
+        // Page 0 holds the header, which was verified already
+        shared.first_offset = MINIDB_PAGE_SIZE;
+        shared.unit_size = MINIDB_PAGE_SIZE;
+        shared.unit_count = header->page_count > 1 ? header->page_count - 1 : 0;
+    } else {
+        shared.first_offset = sizeof(MiniDbHeader);
+        shared.unit_size = (int64_t) header->data_size + (int64_t) sizeof(uint32_t);
+        shared.unit_count = ((int64_t) st.st_size - shared.first_offset + shared.unit_size - 1) / shared.unit_size;
+        if (shared.unit_count < 0) {
+            shared.unit_count = 0;
+        }
+
+        // Only the rows of the index are verified, since a crash may leave a torn row nothing points to
+        live.live = calloc(shared.unit_count + 1, sizeof(uint8_t));
+        if (is_null(live.live)) {
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        live.first_offset = shared.first_offset;
+        live.unit_size = shared.unit_size;
+        live.unit_count = shared.unit_count;
+        if (minidb_index_foreach(index, minidb_verify_collect, &live) != MINIDB_OK) {
+            report->index_ok = false;
+        }
+
+        shared.live = live.live;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    shared.units_per_chunk = MINIDB_VERIFY_CHUNK / shared.unit_size + 1;
+    shared.chunk_count = (shared.unit_count + shared.units_per_chunk - 1) / shared.units_per_chunk;
+    int worker_count = minidb_parallel_thread_count(thread_count);
+    if (worker_count > shared.chunk_count) {
+        worker_count = shared.chunk_count > 0 ? (int) shared.chunk_count : 1;
+    }
+
+    MiniDbVerifyWorker *workers = calloc(worker_count, sizeof(MiniDbVerifyWorker));
+    if (is_null(workers)) {
+        free(live.live);
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].shared = &shared;
+        workers[i].first_corrupted = -1;
+    }
+
+    minidb_parallel_run(minidb_verify_worker, workers, sizeof(MiniDbVerifyWorker), worker_count);
+
+    MiniDbState state = MINIDB_OK;
+    int64_t *checked = header->data_size == MINIDB_VARLEN ? &report->pages_checked : &report->rows_checked;
+    *checked += live.missing;
+    report->corrupted += live.missing;
+    if (live.missing > 0) {
+        report->first_corrupted = live.first_missing;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        state = workers[i].failed ? MINIDB_ERROR_MALLOC_FAIL : state;
+        *checked += workers[i].checked;
+        report->corrupted += workers[i].corrupted;
+        report->bytes_read += workers[i].bytes_read;
+        if (workers[i].corrupted > 0 && (report->first_corrupted < 0 || workers[i].first_corrupted < report->first_corrupted)) {
+            report->first_corrupted = workers[i].first_corrupted;
+        }
+    }
+
+    free(workers);
+    free(live.live);
+    return state;
+}
+
+MiniDbState minidb_verify(const char *path, int thread_count, MiniDbVerifyReport *report)
+{
+    memset(report, 0, sizeof(MiniDbVerifyReport));
+    report->first_corrupted = -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    MiniDbHeader header;
+    report->header_ok = pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) && minidb_header_check(&header);
+    report->bytes_read += sizeof(header);
+
+    // The index is opened without the database, and released without being written
+    char index_path[MINIDB_PATH_MAX];
+    MiniDbIndex index;
+    minidb_index_init(&index);
+    index.worker_threads = thread_count;
+    minidb_build_file_path(path, MINIDB_INDEX_SUFFIX, index_path, sizeof(index_path));
+    MiniDbState state = minidb_index_open(&index, index_path);
+    report->index_ok = state == MINIDB_OK && minidb_index_verify(&index);
+    report->bytes_read += (int64_t) index.map_size;
+    if (state == MINIDB_ERROR_CORRUPTED_FILE) {
+        state = MINIDB_OK;
+    }
+
+    // Without a header the rows cannot be found, and without an index the live ones cannot be told apart
+    if (state == MINIDB_OK && report->header_ok && (report->index_ok || header.data_size == MINIDB_VARLEN)) {
+        state = minidb_verify_data(fd, &header, &index, thread_count, report);
+    }
+
+    minidb_index_release(&index);
+    close(fd);
+    if (state == MINIDB_OK && (!report->header_ok || !report->index_ok || report->corrupted > 0)) {
+        state = MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    return state;
+}
+
+struct MiniDbReplica
+{
+    MiniDb *db;
+    MiniDbChangeLogReader reader;
+    char position_path[MINIDB_PATH_MAX];
+    MiniDbReplicaStatus status;
+    int64_t pending_at; // When the oldest change not applied yet was logged, or -1 if there is none
+};
+
+/**
+ * Measures how far the replica is behind, from the current size of the change log.
+ */
+static void minidb_replica_refresh(MiniDbReplica *replica)
+{
+    MiniDbReplicaStatus *status = &replica->status;
+    status->log_size = minidb_changelog_reader_size(&replica->reader);
+    status->lag_bytes = status->log_size > status->position ? status->log_size - status->position : 0;
+    replica->pending_at = status->lag_bytes > 0 ? minidb_changelog_timestamp(&replica->reader, status->position) : -1;
+}
+
+MiniDbState minidb_replica_open(MiniDbReplica **replica, const char *path, const char *primary_path, const MiniDbOptions *options)
+{
+    *replica = NULL;
+    MiniDbReplica *result = malloc(sizeof(MiniDbReplica));
+    if (is_null(result)) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    char changes_path[MINIDB_PATH_MAX];
+    minidb_build_file_path(primary_path, MINIDB_CHANGES_SUFFIX, changes_path, sizeof(changes_path));
+    MiniDbState state = minidb_changelog_reader_open(&result->reader, changes_path);
+    if (state != MINIDB_OK) {
+        free(result);
+        return state;
+    }
+
+    state = minidb_open_ex(&result->db, path, options);
+    if (state != MINIDB_OK) {
+        minidb_changelog_reader_close(&result->reader);
+        free(result);
+        return state;
+    }
+
+    minidb_build_file_path(path, MINIDB_REPLICA_SUFFIX, result->position_path, sizeof(result->position_path));
+    memset(&result->status, 0, sizeof(MiniDbReplicaStatus));
+    result->status.position = minidb_replica_position_read(result->position_path);
+    result->status.applied_at = -1;
+    minidb_replica_refresh(result);
+    *replica = result;
+    return MINIDB_OK;
+}
+
+void minidb_replica_close(MiniDbReplica **replica)
+{
+    if (!is_null(replica) && !is_null(*replica)) {
+        minidb_close(&(*replica)->db);
+        minidb_changelog_reader_close(&(*replica)->reader);
+        free(*replica);
+        *replica = NULL;
+    }
+}
+
+MiniDb *minidb_replica_db(MiniDbReplica *replica)
+{
+    return replica->db;
+}
+
+/**
+ * Applies a batch of changes like a transaction: journaled, applied as upserts and persisted once.
+ */
+static MiniDbState minidb_replica_apply(MiniDb *db, const MiniDbTransaction *changes)
+{
+    minidb_lock(db);
+    if (db->in_transaction) {
+        minidb_unlock(db);
+        return MINIDB_ERROR_TRANSACTION_ACTIVE;
+    }
+
+    MiniDbState state = minidb_transaction_journal_write(changes, db->journal_path);
+    if (state == MINIDB_OK) {
+        state = minidb_apply_all(db, changes, true);
+    }
+
+    if (state == MINIDB_OK) {
+        remove(db->journal_path);
+    }
+
+    minidb_unlock(db);
+    return state;
+}
+
+MiniDbState minidb_replica_poll(MiniDbReplica *replica, int64_t *applied)
+{
+    MiniDbReplicaStatus *status = &replica->status;
+    MiniDbState state = MINIDB_OK;
+    int64_t total = 0;
+    int64_t count;
+
+    // Stops after a short batch, so a busy primary does not keep the caller here forever
+    do {
+        MiniDbTransaction changes;
+        minidb_transaction_init(&changes);
+        int64_t end;
+        int64_t timestamp;
+        state = minidb_changelog_read(&replica->reader, status->position, MINIDB_REPLICA_BATCH, &changes, &end, &timestamp);
+        count = changes.count;
+        if (state == MINIDB_OK && count > 0) {
+            state = minidb_replica_apply(replica->db, &changes);
+        }
+
+        // The position is stored after the batch was persisted; replaying a batch after a crash is harmless
+        if (state == MINIDB_OK && count > 0) {
+            state = minidb_replica_position_write(replica->position_path, end);
+            status->position = end;
+            status->applied_at = timestamp;
+            status->applied_changes += count;
+            status->applied_batches++;
+            total += count;
+        }
+
+        minidb_transaction_clear(&changes);
+    } while (state == MINIDB_OK && count >= MINIDB_REPLICA_BATCH);
+
+    minidb_replica_refresh(replica);
+    if (!is_null(applied)) {
+        *applied = total;
+    }
+
+    return state;
+}
+
+MiniDbState minidb_replica_follow(MiniDbReplica *replica, int64_t interval_ms,
+                                  bool (*keep_going)(const MiniDbReplicaStatus *status, void *context), void *context)
+{
+    while (true) {
+        int64_t applied;
+        MiniDbState state = minidb_replica_poll(replica, &applied);
+        if (state != MINIDB_OK) {
+            return state;
+        }
+
+        MiniDbReplicaStatus status;
+        minidb_replica_get_status(replica, &status);
+        if (!keep_going(&status, context)) {
+            return MINIDB_OK;
+        }
+
+        if (applied == 0) {
+            struct timespec delay = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+            nanosleep(&delay, NULL);
+        }
+    }
+}
+
+void minidb_replica_get_status(const MiniDbReplica *replica, MiniDbReplicaStatus *status)
+{
+    *status = replica->status;
+    status->lag_ms = 0;
+    if (replica->pending_at >= 0) {
+        int64_t lag = minidb_expiry_now() - replica->pending_at;
+        status->lag_ms = lag > 0 ? lag : 0;
+    }
 }
@@ -1,12 +1,25 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #ifndef is_null
 #define is_null(ptr) ((ptr) == NULL)
 #endif
 
+/**
+ * The data_size of databases that store variable-length rows.
+ */
+#define MINIDB_VARLEN ((size_t) 0)
+
+#define MINIDB_PATH_MAX 1024
+
+/**
+ * The ttl_ms of rows that never expire.
+ */
+#define MINIDB_NO_TTL INT64_C(0)
+
 typedef struct MiniDb MiniDb;
 
 typedef struct MiniDbInfo
@@ -14,8 +27,63 @@ typedef struct MiniDbInfo
     size_t data_size;
     int64_t row_count;
     int64_t free_count;
+    int64_t page_count;
 } MiniDbInfo;
 
+/**
+ * When the changes made outside of a transaction are persisted.
+ */
+typedef enum MiniDbSyncPolicy
+{
+    MINIDB_SYNC_EVERY_OP,         // Every write persists the header and index before returning, without syncing (default)
+    MINIDB_SYNC_INTERVAL,         // A background thread persists and syncs the changes every sync_interval_ms
+    MINIDB_SYNC_EVERY_N_OPS,      // A background thread persists and syncs the changes every sync_ops writes
+    MINIDB_SYNC_CHECKPOINT,       // Changes are persisted on minidb_checkpoint, minidb_commit and minidb_close
+    MINIDB_SYNC_EVERY_OP_DURABLE, // Every write persists and syncs the changes before returning
+} MiniDbSyncPolicy;
+
+typedef struct MiniDbOptions
+{
+    MiniDbSyncPolicy sync_policy;
+    int64_t sync_interval_ms;
+    int64_t sync_ops;
+    size_t dirty_limit;          // Writers wait for a flush once this many bytes of changes are pending (0 = no limit)
+    int filter_bits_per_key;     // Size of the Bloom filter in front of the index (0 = default of 10, negative = no filter)
+    int worker_threads;          // Threads used to write large indexes (0 = one per processor)
+    int64_t reclaim_interval_ms; // Expired rows are reclaimed in batches at most this often (0 = default of 1000)
+    bool change_log;             // Appends every change to the -changes file, so replicas can follow the database
+} MiniDbOptions;
+
+typedef struct MiniDbReplica MiniDbReplica;
+
+/**
+ * How far a replica is behind its primary.
+ */
+typedef struct MiniDbReplicaStatus
+{
+    int64_t position;        // Position in the change log of the next change to apply
+    int64_t log_size;        // Size of the change log when it was last read
+    int64_t lag_bytes;       // Bytes of the change log not applied yet
+    int64_t lag_ms;          // Age of the oldest change not applied yet (0 when the replica is up to date)
+    int64_t applied_at;      // When the last applied change was made on the primary, in milliseconds since the epoch
+    int64_t applied_changes; // Changes applied since the replica was opened
+    int64_t applied_batches; // Batches applied since the replica was opened
+} MiniDbReplicaStatus;
+
+/**
+ * What minidb_verify found. Offsets are positions in the data file.
+ */
+typedef struct MiniDbVerifyReport
+{
+    bool header_ok;          // The header of the data file matches its checksum
+    bool index_ok;           // The index file matches its checksums
+    int64_t rows_checked;    // Rows of a fixed-size database that were verified
+    int64_t pages_checked;   // Pages of a variable-length database that were verified
+    int64_t corrupted;       // Rows or pages that do not match their checksum
+    int64_t first_corrupted; // Offset of the first of them, or -1 if there are none
+    int64_t bytes_read;      // Bytes read from the data file and the index file
+} MiniDbVerifyReport;
+
 typedef enum MiniDbState
 {
     MINIDB_OK,
@@ -25,6 +93,12 @@ typedef enum MiniDbState
     MINIDB_ERROR_NULL_POINTER,
     MINIDB_ERROR_ROW_NOT_FOUND,
     MINIDB_ERROR_DUPLICATED_KEY_VIOLATION,
+    MINIDB_ERROR_BUFFER_TOO_SMALL,
+    MINIDB_ERROR_UNSUPPORTED_OPERATION,
+    MINIDB_ERROR_TRANSACTION_ACTIVE,
+    MINIDB_ERROR_NO_TRANSACTION,
+    MINIDB_ERROR_CORRUPTED_FILE,
+    MINIDB_ERROR_REOPEN_REQUIRED,
 } MiniDbState;
 
 /**
@@ -45,16 +119,50 @@ const char *minidb_error_get_str(MiniDbState value);
  */
 MiniDbState minidb_create(MiniDb **db, const char *path, size_t data_size);
 
+/**
+ * Creates a new MiniDb database file with the given options.
+ *
+ * @param db The MiniDb object to initialize (stack-allocated).
+ * @param path The path to the database file.
+ * @param data_size The size of the data to store (sizeof(my_struct)), or MINIDB_VARLEN.
+ * @param options The options of the connection, or NULL to use the defaults.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_create_ex(MiniDb **db, const char *path, size_t data_size, const MiniDbOptions *options);
+
+/**
+ * Creates a new MiniDb database file that stores variable-length rows in slotted pages.
+ * Rows that do not fit in a page are stored in a chain of overflow pages.
+ *
+ * @param db The MiniDb object to initialize (stack-allocated).
+ * @param path The path to the database file.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_create_varlen(MiniDb **db, const char *path);
+
 /**
  * Opens an existing MiniDb database file.
  *
  * @param db The MiniDb object to initialize and load (stack-allocated).
  * @param path The path to the database file.
  *
- * @return MINISB_OK on success.
+ * @return MINISB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the header or the index do not match their checksums.
  */
 MiniDbState minidb_open(MiniDb **db, const char *path);
 
+/**
+ * Opens an existing MiniDb database file with the given options.
+ *
+ * @param db The MiniDb object to initialize and load (stack-allocated).
+ * @param path The path to the database file.
+ * @param options The options of the connection, or NULL to use the defaults.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_open_ex(MiniDb **db, const char *path, const MiniDbOptions *options);
+
 /**
  * Flushes the database file, releases memory and closes the MiniDb database.
  *
@@ -71,7 +179,7 @@ void minidb_get_info(const MiniDb *db, MiniDbInfo *result);
  * @param key The key to search.
  * @param result Where the row will be stored.
  *
- * @return MINIDB_OK on success.
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the row does not match its checksum.
  */
 MiniDbState minidb_select(const MiniDb *db, int64_t key, void *result);
 
@@ -85,6 +193,83 @@ MiniDbState minidb_select(const MiniDb *db, int64_t key, void *result);
  */
 MiniDbState minidb_select_all(const MiniDb *db, void (*callback)(int64_t, void *));
 
+/**
+ * Selects the rows whose key is in [first, last], in key order.
+ *
+ * @param db The MiniDb object.
+ * @param first The smallest key to select.
+ * @param last The largest key to select.
+ * @param callback The callback function that will be executed on for each row.
+ * @param context A pointer passed as is to the callback.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_select_range(const MiniDb *db, int64_t first, int64_t last, void (*callback)(int64_t, void *, void *), void *context);
+
+/**
+ * Selects at most 'limit' rows whose key is in [first, last], in key order. A range can be walked in
+ * bounded steps by starting every step right after the last key received by the previous one.
+ *
+ * @param db The MiniDb object.
+ * @param first The smallest key to select.
+ * @param last The largest key to select.
+ * @param limit The largest number of rows to select.
+ * @param callback The callback function that will be executed on for each row.
+ * @param context A pointer passed as is to the callback.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_select_range_limit(const MiniDb *db, int64_t first, int64_t last, int64_t limit, void (*callback)(int64_t, void *, void *), void *context);
+
+/**
+ * Callbacks of a parallel scan. Every worker thread keeps its own state, so the callback needs no locking;
+ * the states are combined by reduce once the scan is over.
+ */
+typedef struct MiniDbParallelScan
+{
+    int thread_count;                                   // 0 = one thread per processor
+    void *(*init)(void *context);                       // Creates the state of a worker thread (optional)
+    void (*callback)(int64_t key, void *row, void *state);
+    void (*reduce)(void *state, void *context);         // Combines and releases a state, on the calling thread (optional)
+    void *context;
+} MiniDbParallelScan;
+
+/**
+ * Selects all rows using several threads. The data file is split into ranges of contiguous rows that the
+ * threads take as they finish the previous one, so the rows are visited in no particular order. The callbacks
+ * run while the database is locked and must not call back into it.
+ *
+ * @param db The MiniDb object.
+ * @param scan The callbacks of the scan.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_select_all_parallel(const MiniDb *db, const MiniDbParallelScan *scan);
+
+/**
+ * Selects a variable-length row that matches the given key.
+ *
+ * @param db The MiniDb object.
+ * @param key The key to search.
+ * @param buffer Where the row will be stored.
+ * @param buffer_size The size of the buffer.
+ * @param length Where the actual length of the row will be stored. Set even if the buffer is too small.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_BUFFER_TOO_SMALL if the row does not fit in the buffer,
+ *         MINIDB_ERROR_CORRUPTED_FILE if a page of the row does not match its checksum.
+ */
+MiniDbState minidb_select_varlen(const MiniDb *db, int64_t key, void *buffer, size_t buffer_size, size_t *length);
+
+/**
+ * Selects all rows in a variable-length database.
+ *
+ * @param db The MiniDb object.
+ * @param callback The callback function that will be executed on for each row, along with its length.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_select_all_varlen(const MiniDb *db, void (*callback)(int64_t, void *, size_t));
+
 /**
  * Inserts a new row into the MiniDb database.
  *
@@ -96,6 +281,31 @@ MiniDbState minidb_select_all(const MiniDb *db, void (*callback)(int64_t, void *
  */
 MiniDbState minidb_insert(MiniDb *db, int64_t key, void *data);
 
+/**
+ * Inserts a new variable-length row into the MiniDb database.
+ *
+ * @param db The MiniDb object.
+ * @param key The key of the row to insert.
+ * @param data The data to insert.
+ * @param length The length of the data in bytes.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_insert_varlen(MiniDb *db, int64_t key, const void *data, size_t length);
+
+/**
+ * Inserts a new row that expires after the given time. Expired rows are no longer returned by selects
+ * and scans, and their space is reclaimed in the background.
+ *
+ * @param db The MiniDb object.
+ * @param key The key of the row to insert.
+ * @param data The data to insert.
+ * @param ttl_ms The time to live of the row in milliseconds, or MINIDB_NO_TTL.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_insert_ttl(MiniDb *db, int64_t key, void *data, int64_t ttl_ms);
+
 /**
  * Updates an existing row.
  *
@@ -107,6 +317,18 @@ MiniDbState minidb_insert(MiniDb *db, int64_t key, void *data);
  */
 MiniDbState minidb_update(MiniDb *db, int64_t key, void *data);
 
+/**
+ * Updates an existing variable-length row. The new data may be shorter or longer than the old one.
+ *
+ * @param db The MiniDb object.
+ * @param key The key of the row to update.
+ * @param data The new data.
+ * @param length The length of the new data in bytes.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_update_varlen(MiniDb *db, int64_t key, const void *data, size_t length);
+
 /**
  * Deletes an existing row from the database.
  *
@@ -116,3 +338,164 @@ MiniDbState minidb_update(MiniDb *db, int64_t key, void *data);
  * @return MINIDB_OK on success.
  */
 MiniDbState minidb_delete(MiniDb *db, int64_t key);
+
+/**
+ * Sets the time to live of an existing row, counted from now. Updates keep the time to live of the row.
+ *
+ * @param db The MiniDb object.
+ * @param key The key of the row.
+ * @param ttl_ms The time to live of the row in milliseconds, or MINIDB_NO_TTL so it never expires.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_ROW_NOT_FOUND if the row does not exist or already expired.
+ */
+MiniDbState minidb_set_ttl(MiniDb *db, int64_t key, int64_t ttl_ms);
+
+/**
+ * Deletes every expired row now, persisting the index once. Expired rows are also reclaimed in the
+ * background, every reclaim_interval_ms.
+ *
+ * @param db The MiniDb object.
+ * @param reclaimed Where the number of deleted rows will be stored (optional).
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_TRANSACTION_ACTIVE if a transaction is open.
+ */
+MiniDbState minidb_reclaim_expired(MiniDb *db, int64_t *reclaimed);
+
+/**
+ * Starts a transaction. Until it is committed, inserts, updates and deletes are only buffered in memory
+ * and are visible to minidb_select and minidb_select_varlen, but not to minidb_select_all.
+ *
+ * @param db The MiniDb object.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_TRANSACTION_ACTIVE if a transaction is already open.
+ */
+MiniDbState minidb_begin(MiniDb *db);
+
+/**
+ * Atomically applies every operation buffered by the open transaction. The header and the index
+ * are written once and the files are synced once for the whole transaction.
+ *
+ * @param db The MiniDb object.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_NO_TRANSACTION if there is no open transaction. If the
+ *         operations could not be applied or persisted, the journal is kept and minidb_open replays it.
+ *         If only part of them could be applied, the database refuses writes with
+ *         MINIDB_ERROR_REOPEN_REQUIRED until it is reopened.
+ */
+MiniDbState minidb_commit(MiniDb *db);
+
+/**
+ * Discards every operation buffered by the open transaction.
+ *
+ * @param db The MiniDb object.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_NO_TRANSACTION if there is no open transaction.
+ */
+MiniDbState minidb_rollback(MiniDb *db);
+
+/**
+ * Persists every pending change and syncs the database files to the storage device.
+ *
+ * @param db The MiniDb object.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_checkpoint(MiniDb *db);
+
+/**
+ * Copies the database (data file and index) to another path while readers and writers keep running.
+ * The data file is copied in passes without holding the lock; only the blocks written during the
+ * last pass are copied with the lock held, so the copy matches a single point in time.
+ *
+ * @param db The MiniDb object.
+ * @param dest_path The path of the backup. Its index file is stored next to it.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR if another backup is running or the copy failed.
+ */
+MiniDbState minidb_backup(MiniDb *db, const char *dest_path);
+
+/**
+ * Updates a backup made earlier by this MiniDb object, copying only the blocks written since then.
+ * Falls back to a full backup if dest_path was not the last backup, or the database was reopened since.
+ *
+ * @param db The MiniDb object.
+ * @param dest_path The path of the backup.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR if another backup is running or the copy failed.
+ */
+MiniDbState minidb_backup_incremental(MiniDb *db, const char *dest_path);
+
+/**
+ * Verifies every checksum of a database: its header, its index and each of its rows (or pages, for
+ * variable-length databases). The data file is read in large chunks by several threads, so the check
+ * runs at the bandwidth of the storage device. The files are only read; run it on a closed database
+ * or on a backup, since the files of an open database change while they are read.
+ *
+ * @param path The path to the database file.
+ * @param thread_count The number of threads that read the data file (0 = one per processor).
+ * @param report Where the results will be stored.
+ *
+ * @return MINIDB_OK if every checksum matches, MINIDB_ERROR_CORRUPTED_FILE otherwise.
+ */
+MiniDbState minidb_verify(const char *path, int thread_count, MiniDbVerifyReport *report);
+
+/**
+ * Opens a replica of a database that logs its changes (see change_log in MiniDbOptions). The replica
+ * is a database of its own, usually made with minidb_backup while the primary was logging, which
+ * records the position of the change log the backup matches. A replica without that position starts
+ * at the beginning of the change log.
+ *
+ * @param replica The MiniDbReplica object to initialize.
+ * @param path The path to the database file of the replica.
+ * @param primary_path The path to the database file of the primary. Only its change log is read.
+ * @param options The options of the replica database, or NULL to use the defaults.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_replica_open(MiniDbReplica **replica, const char *path, const char *primary_path, const MiniDbOptions *options);
+
+/**
+ * Closes the database of the replica and releases the MiniDbReplica object.
+ *
+ * @param replica The MiniDbReplica object to close.
+ */
+void minidb_replica_close(MiniDbReplica **replica);
+
+/**
+ * Returns the database of the replica, to be read with the select functions. Writing to it makes the
+ * replica diverge from the primary.
+ */
+MiniDb *minidb_replica_db(MiniDbReplica *replica);
+
+/**
+ * Applies the changes logged by the primary since the last call. Changes are applied in batches of
+ * whole transactions, each one written to the journal and persisted with a single header and index write.
+ *
+ * @param replica The MiniDbReplica object.
+ * @param applied Where the number of changes applied will be stored (optional).
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_TRANSACTION_ACTIVE if a transaction is open on the replica.
+ */
+MiniDbState minidb_replica_poll(MiniDbReplica *replica, int64_t *applied);
+
+/**
+ * Follows the primary, polling its change log every interval_ms while it has nothing new, until
+ * keep_going returns false or a poll fails.
+ *
+ * @param replica The MiniDbReplica object.
+ * @param interval_ms The time to wait when the replica is up to date.
+ * @param keep_going Called after every poll with the status of the replica.
+ * @param context A pointer passed as is to keep_going.
+ *
+ * @return MINIDB_OK when keep_going stops the loop, or the error of the poll that failed.
+ */
+MiniDbState minidb_replica_follow(MiniDbReplica *replica, int64_t interval_ms,
+                                  bool (*keep_going)(const MiniDbReplicaStatus *status, void *context), void *context);
+
+/**
+ * Returns how far the replica is behind its primary, as of the last poll.
+ *
+ * @param replica The MiniDbReplica object.
+ * @param status Where the status will be stored.
+ */
+void minidb_replica_get_status(const MiniDbReplica *replica, MiniDbReplicaStatus *status);
@@ -0,0 +1,488 @@
+#include "pager.h"
+#include "crc32c.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_HEADER_SIZE ((uint16_t) sizeof(MiniDbPageHeader))
+#define SLOT_SIZE ((uint16_t) sizeof(MiniDbSlot))
+#define SLOT_OVERFLOW UINT16_C(0x8000)
+#define SLOT_LENGTH_MASK UINT16_C(0x7FFF)
+#define OVERFLOW_CAPACITY (MINIDB_PAGE_SIZE - PAGE_HEADER_SIZE)
+
+/**
+ * Records larger than this are moved to an overflow chain and only a stub is kept in the slotted page.
+ */
+#define INLINE_MAX ((MINIDB_PAGE_SIZE - PAGE_HEADER_SIZE) / 4)
+
+#define rid_make(page, slot) (((int64_t) (page) << 16) | (int64_t) (slot))
+#define rid_page(rid) ((rid) >> 16)
+#define rid_slot(rid) ((uint16_t) ((rid) & 0xFFFF))
+
+#define page_header(page) ((MiniDbPageHeader *) (page))
+#define page_slots(page) ((MiniDbSlot *) ((page) + PAGE_HEADER_SIZE))
+#define page_avail(hdr) ((uint16_t) ((hdr)->free_end - (hdr)->free_start + (hdr)->fragmented))
+
+typedef struct MiniDbSlot
+{
+    uint16_t offset; // 0 if the slot is empty
+    uint16_t length; // high bit set if the record is an overflow stub
+} MiniDbSlot;
+
+typedef struct MiniDbOverflowStub
+{
+    int64_t first_page;
+    uint64_t length;
+} MiniDbOverflowStub;
+
+static uint32_t pager_checksum(const uint8_t *page)
+{
+    // The checksum field is read as 0
+    static const uint8_t zero[sizeof(uint32_t)] = {0};
+    size_t offset = offsetof(MiniDbPageHeader, checksum);
+    uint32_t crc = minidb_crc32c(0, page, offset);
+    crc = minidb_crc32c(crc, zero, sizeof(zero));
+    return minidb_crc32c(crc, page + offset + sizeof(uint32_t), MINIDB_PAGE_SIZE - offset - sizeof(uint32_t));
+}
+
+bool minidb_pager_check_page(const uint8_t *page)
+{
+    return page_header(page)->checksum == pager_checksum(page);
+}
+
+/**
+ * Reads a page. Only pages below page_count are read: new pages are formatted by the caller that
+ * allocates them, so a page cut off the end of the file is damaged like any other.
+ *
+ * @return False if the page could not be read whole or does not match its checksum.
+ */
+static bool pager_read_page(const MiniDbPager *pager, int64_t page_no, uint8_t *page)
+{
+    fseek(pager->fd, page_no * MINIDB_PAGE_SIZE, SEEK_SET);
+    if (fread(page, MINIDB_PAGE_SIZE, 1, pager->fd) != 1) {
+        return false;
+    }
+
+    return minidb_pager_check_page(page);
+}
+
+static void pager_write_page(const MiniDbPager *pager, int64_t page_no, uint8_t *page)
+{
+    page_header(page)->checksum = pager_checksum(page);
+    fseek(pager->fd, page_no * MINIDB_PAGE_SIZE, SEEK_SET);
+    fwrite(page, MINIDB_PAGE_SIZE, 1, pager->fd);
+    if (!is_null(pager->changes)) {
+        minidb_changes_mark(pager->changes, page_no * MINIDB_PAGE_SIZE, MINIDB_PAGE_SIZE);
+    }
+}
+
+static void pager_format_slotted(uint8_t *page)
+{
+    memset(page, 0, MINIDB_PAGE_SIZE);
+    MiniDbPageHeader *hdr = page_header(page);
+    hdr->type = MINIDB_PAGE_SLOTTED;
+    hdr->free_start = PAGE_HEADER_SIZE;
+    hdr->free_end = MINIDB_PAGE_SIZE;
+}
+
+/**
+ * Grows the free space table so it can hold page_no.
+ */
+static bool pager_avail_reserve(MiniDbPager *pager, int64_t page_no)
+{
+    if (page_no < pager->avail_capacity) {
+        return true;
+    }
+
+    int64_t capacity = pager->avail_capacity > 0 ? pager->avail_capacity : 64;
+    while (capacity <= page_no) {
+        capacity *= 2;
+    }
+
+    uint16_t *avail = realloc(pager->avail, capacity * sizeof(uint16_t));
+    if (is_null(avail)) {
+        return false;
+    }
+
+    memset(avail + pager->avail_capacity, 0, (capacity - pager->avail_capacity) * sizeof(uint16_t));
+    pager->avail = avail;
+    pager->avail_capacity = capacity;
+    return true;
+}
+
+/**
+ * Loads the free space table by reading every page header. Called on the first write,
+ * so opening a database never pays for it.
+ */
+static bool pager_avail_load(MiniDbPager *pager)
+{
+    if (!is_null(pager->avail)) {
+        return true;
+    }
+
+    if (!pager_avail_reserve(pager, pager->page_count)) {
+        return false;
+    }
+
+    MiniDbPageHeader hdr;
+    for (int64_t i = 1; i < pager->page_count; i++) {
+        fseek(pager->fd, i * MINIDB_PAGE_SIZE, SEEK_SET);
+        if (fread(&hdr, sizeof(hdr), 1, pager->fd) == 1 && hdr.type == MINIDB_PAGE_SLOTTED) {
+            pager->avail[i] = page_avail(&hdr);
+        }
+    }
+
+    pager->hint = 1;
+    return true;
+}
+
+/**
+ * Takes a page from the free page chain or appends a new one to the file. A damaged free page
+ * ends the chain, since the page it links to cannot be trusted.
+ */
+static int64_t pager_allocate_page(MiniDbPager *pager)
+{
+    int64_t page_no;
+    uint8_t page[MINIDB_PAGE_SIZE];
+    if (pager->free_page != 0 && !pager_read_page(pager, pager->free_page, page)) {
+        pager->free_page = 0;
+    }
+
+    // The page is taken only once the free space table can hold it, so a failure leaves the file as it was
+    page_no = pager->free_page != 0 ? pager->free_page : pager->page_count;
+    if (!pager_avail_reserve(pager, page_no)) {
+        return 0;
+    }
+
+    if (pager->free_page != 0) {
+        pager->free_page = page_header(page)->next;
+    } else {
+        pager->page_count++;
+    }
+
+    pager->avail[page_no] = 0;
+    return page_no;
+}
+
+/**
+ * Pushes a page into the free page chain. The whole page is cleared, so it still matches its checksum.
+ */
+static void pager_release_page(MiniDbPager *pager, int64_t page_no)
+{
+    uint8_t page[MINIDB_PAGE_SIZE] = {0};
+    page_header(page)->type = MINIDB_PAGE_FREE;
+    page_header(page)->next = pager->free_page;
+    pager_write_page(pager, page_no, page);
+    pager->free_page = page_no;
+    pager->avail[page_no] = 0;
+}
+
+/**
+ * Moves every live record to the end of the page so the free space becomes contiguous.
+ */
+static void pager_compact(uint8_t *page)
+{
+    uint8_t copy[MINIDB_PAGE_SIZE];
+    memcpy(copy, page, MINIDB_PAGE_SIZE);
+
+    MiniDbPageHeader *hdr = page_header(page);
+    MiniDbSlot *slots = page_slots(page);
+    uint16_t end = MINIDB_PAGE_SIZE;
+
+    for (uint16_t i = 0; i < hdr->slot_count; i++) {
+        if (slots[i].offset != 0) {
+            uint16_t size = slots[i].length & SLOT_LENGTH_MASK;
+            end -= size;
+            memcpy(page + end, copy + slots[i].offset, size);
+            slots[i].offset = end;
+        }
+    }
+
+    hdr->free_end = end;
+    hdr->fragmented = 0;
+}
+
+/**
+ * Releases a chain of overflow pages. Stops at a damaged page, leaving the rest of the chain unused.
+ */
+static void pager_free_overflow(MiniDbPager *pager, int64_t page_no)
+{
+    uint8_t page[MINIDB_PAGE_SIZE];
+    while (page_no > 0 && page_no < pager->page_count && pager_read_page(pager, page_no, page)) {
+        pager_release_page(pager, page_no);
+        page_no = page_header(page)->next;
+    }
+}
+
+/**
+ * Writes a payload into a freshly allocated chain of overflow pages. Returns the first page,
+ * or 0 if the pages could not be allocated, in which case the part of the chain already written is released.
+ */
+static int64_t pager_write_overflow(MiniDbPager *pager, const uint8_t *data, size_t length)
+{
+    uint8_t page[MINIDB_PAGE_SIZE];
+    int64_t first = pager_allocate_page(pager);
+    int64_t current = first;
+
+    while (current != 0) {
+        size_t chunk = length > OVERFLOW_CAPACITY ? OVERFLOW_CAPACITY : length;
+        memset(page, 0, MINIDB_PAGE_SIZE);
+        page_header(page)->type = MINIDB_PAGE_OVERFLOW;
+        memcpy(page + PAGE_HEADER_SIZE, data, chunk);
+        data += chunk;
+        length -= chunk;
+
+        int64_t next = length > 0 ? pager_allocate_page(pager) : 0;
+        page_header(page)->next = next;
+        pager_write_page(pager, current, page);
+        if (length > 0 && next == 0) {
+            // The current page ends the chain, so it is released whole
+            pager_free_overflow(pager, first);
+            return 0;
+        }
+
+        current = next;
+    }
+
+    return first;
+}
+
+/**
+ * Finds a slotted page with at least 'need' bytes of (possibly fragmented) free space.
+ */
+static int64_t pager_find_page(MiniDbPager *pager, uint16_t need)
+{
+    for (int64_t i = pager->hint; i < pager->page_count; i++) {
+        if (pager->avail[i] >= need) {
+            pager->hint = i;
+            return i;
+        }
+    }
+
+    for (int64_t i = 1; i < pager->hint && i < pager->page_count; i++) {
+        if (pager->avail[i] >= need) {
+            pager->hint = i;
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+void minidb_pager_init(MiniDbPager *pager, FILE *fd, int64_t page_count, int64_t free_page)
+{
+    pager->fd = fd;
+    pager->page_count = page_count;
+    pager->free_page = free_page;
+    pager->avail = NULL;
+    pager->avail_capacity = 0;
+    pager->hint = 1;
+    pager->changes = NULL;
+}
+
+void minidb_pager_destroy(MiniDbPager *pager)
+{
+    free(pager->avail);
+    pager->avail = NULL;
+    pager->avail_capacity = 0;
+}
+
+MiniDbState minidb_pager_insert(MiniDbPager *pager, const void *data, size_t length, int64_t *rid)
+{
+    if (!pager_avail_load(pager)) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    MiniDbOverflowStub stub;
+    const uint8_t *record = data;
+    uint16_t size = (uint16_t) length;
+    uint16_t flags = 0;
+
+    if (length > INLINE_MAX) {
+        stub.first_page = pager_write_overflow(pager, data, length);
+        stub.length = length;
+        if (stub.first_page == 0) {
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        record = (const uint8_t *) &stub;
+        size = sizeof(stub);
+        flags = SLOT_OVERFLOW;
+    }
+
+    uint8_t page[MINIDB_PAGE_SIZE];
+    int64_t page_no = pager_find_page(pager, size + SLOT_SIZE);
+    if (page_no == 0) {
+        page_no = pager_allocate_page(pager);
+        if (page_no == 0) {
+            if (flags == SLOT_OVERFLOW) {
+                pager_free_overflow(pager, stub.first_page);
+            }
+
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        pager_format_slotted(page);
+    } else if (!pager_read_page(pager, page_no, page)) {
+        if (flags == SLOT_OVERFLOW) {
+            pager_free_overflow(pager, stub.first_page);
+        }
+
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    MiniDbPageHeader *hdr = page_header(page);
+    MiniDbSlot *slots = page_slots(page);
+    uint16_t slot = 0;
+    while (slot < hdr->slot_count && slots[slot].offset != 0) {
+        slot++;
+    }
+
+    uint16_t slot_cost = slot == hdr->slot_count ? SLOT_SIZE : 0;
+    if (hdr->free_end - hdr->free_start < size + slot_cost) {
+        pager_compact(page);
+    }
+
+    if (slot == hdr->slot_count) {
+        hdr->slot_count++;
+        hdr->free_start += SLOT_SIZE;
+    }
+
+    hdr->free_end -= size;
+    memcpy(page + hdr->free_end, record, size);
+    slots[slot].offset = hdr->free_end;
+    slots[slot].length = size | flags;
+
+    pager_write_page(pager, page_no, page);
+    pager->avail[page_no] = page_avail(hdr);
+    *rid = rid_make(page_no, slot);
+    return MINIDB_OK;
+}
+
+MiniDbState minidb_pager_read(const MiniDbPager *pager, int64_t rid, void *buffer, size_t buffer_size, size_t *length)
+{
+    int64_t page_no = rid_page(rid);
+    uint16_t slot = rid_slot(rid);
+    if (page_no <= 0 || page_no >= pager->page_count) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    uint8_t page[MINIDB_PAGE_SIZE];
+    if (!pager_read_page(pager, page_no, page)) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    MiniDbPageHeader *hdr = page_header(page);
+    MiniDbSlot *slots = page_slots(page);
+    if (hdr->type != MINIDB_PAGE_SLOTTED || slot >= hdr->slot_count || slots[slot].offset == 0) {
+        return MINIDB_ERROR_ROW_NOT_FOUND;
+    }
+
+    if ((slots[slot].length & SLOT_OVERFLOW) == 0) {
+        *length = slots[slot].length;
+        if (*length > buffer_size) {
+            return MINIDB_ERROR_BUFFER_TOO_SMALL;
+        }
+
+        memcpy(buffer, page + slots[slot].offset, *length);
+        return MINIDB_OK;
+    }
+
+    MiniDbOverflowStub stub;
+    memcpy(&stub, page + slots[slot].offset, sizeof(stub));
+    *length = stub.length;
+    if (*length > buffer_size) {
+        return MINIDB_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    uint8_t *output = buffer;
+    size_t remaining = stub.length;
+    int64_t current = stub.first_page;
+    while (current != 0 && remaining > 0) {
+        size_t chunk = remaining > OVERFLOW_CAPACITY ? OVERFLOW_CAPACITY : remaining;
+        if (!pager_read_page(pager, current, page)) {
+            return MINIDB_ERROR_CORRUPTED_FILE;
+        }
+
+        memcpy(output, page + PAGE_HEADER_SIZE, chunk);
+        output += chunk;
+        remaining -= chunk;
+        current = hdr->next;
+    }
+
+    return remaining == 0 ? MINIDB_OK : MINIDB_ERROR;
+}
+
+MiniDbState minidb_pager_update(MiniDbPager *pager, int64_t *rid, const void *data, size_t length)
+{
+    int64_t page_no = rid_page(*rid);
+    uint16_t slot = rid_slot(*rid);
+    uint8_t page[MINIDB_PAGE_SIZE];
+    if (!pager_read_page(pager, page_no, page)) {
+        return MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    MiniDbPageHeader *hdr = page_header(page);
+    MiniDbSlot *slots = page_slots(page);
+    uint16_t old_length = slots[slot].length;
+
+    // Shrinking (or same size) inline records are rewritten in place, so the record id is kept.
+    if ((old_length & SLOT_OVERFLOW) == 0 && length <= old_length) {
+        if (!pager_avail_load(pager)) {
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        memcpy(page + slots[slot].offset, data, length);
+        hdr->fragmented += old_length - (uint16_t) length;
+        slots[slot].length = (uint16_t) length;
+        pager_write_page(pager, page_no, page);
+        pager->avail[page_no] = page_avail(hdr);
+        return MINIDB_OK;
+    }
+
+    // The old record is left for the caller to remove, so a failed insert leaves the row as it was
+    return minidb_pager_insert(pager, data, length, rid);
+}
+
+void minidb_pager_remove(MiniDbPager *pager, int64_t rid)
+{
+    if (!pager_avail_load(pager)) {
+        return;
+    }
+
+    int64_t page_no = rid_page(rid);
+    uint16_t slot = rid_slot(rid);
+    uint8_t page[MINIDB_PAGE_SIZE];
+    if (!pager_read_page(pager, page_no, page)) {
+        // The space of the record is lost, the rest of the page is left as it is
+        return;
+    }
+
+    MiniDbPageHeader *hdr = page_header(page);
+    MiniDbSlot *slots = page_slots(page);
+    if (slot >= hdr->slot_count || slots[slot].offset == 0) {
+        return;
+    }
+
+    if ((slots[slot].length & SLOT_OVERFLOW) != 0) {
+        MiniDbOverflowStub stub;
+        memcpy(&stub, page + slots[slot].offset, sizeof(stub));
+        pager_free_overflow(pager, stub.first_page);
+    }
+
+    hdr->fragmented += slots[slot].length & SLOT_LENGTH_MASK;
+    slots[slot].offset = 0;
+    slots[slot].length = 0;
+
+    // Trailing empty slots are given back to the free space.
+    while (hdr->slot_count > 0 && slots[hdr->slot_count - 1].offset == 0) {
+        hdr->slot_count--;
+        hdr->free_start -= SLOT_SIZE;
+    }
+
+    pager_write_page(pager, page_no, page);
+    pager->avail[page_no] = page_avail(hdr);
+    if (page_no < pager->hint) {
+        pager->hint = page_no;
+    }
+}
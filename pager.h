@@ -0,0 +1,121 @@
+#pragma once
+
+#include "minidb.h"
+#include "backup.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MINIDB_PAGE_SIZE 4096
+
+typedef enum MiniDbPageType
+{
+    MINIDB_PAGE_FREE,
+    MINIDB_PAGE_SLOTTED,
+    MINIDB_PAGE_OVERFLOW,
+} MiniDbPageType;
+
+/**
+ * Header stored at the beginning of every page.
+ *
+ * Slotted pages keep their slot directory right after the header (growing forward) and the
+ * record data at the end of the page (growing backwards). Overflow pages store raw payload
+ * after the header and link to the next page of the chain through 'next'. Free pages are
+ * linked together through 'next' as well.
+ *
+ * The checksum is the CRC32C of the whole page, computed with the checksum itself set to 0.
+ */
+typedef struct MiniDbPageHeader
+{
+    uint16_t type;
+    uint16_t slot_count;
+    uint16_t free_start;
+    uint16_t free_end;
+    uint16_t fragmented;
+    uint16_t reserved0;
+    uint32_t checksum;
+    int64_t next;
+} MiniDbPageHeader;
+
+typedef struct MiniDbPager
+{
+    FILE *fd;
+    int64_t page_count;
+    int64_t free_page;
+    uint16_t *avail;
+    int64_t avail_capacity;
+    int64_t hint;
+    MiniDbChangeMap *changes; // Optional, marks the pages written
+} MiniDbPager;
+
+/**
+ * Initializes the pager of a variable-length database.
+ *
+ * @param pager The pager to initialize (stack-allocated).
+ * @param fd The database file.
+ * @param page_count The number of pages in the file, including the header page.
+ * @param free_page The first page of the free page chain, or 0 if there are no free pages.
+ */
+void minidb_pager_init(MiniDbPager *pager, FILE *fd, int64_t page_count, int64_t free_page);
+
+/**
+ * Releases the memory used by the pager. Does not close the database file.
+ *
+ * @param pager The pager to destroy.
+ */
+void minidb_pager_destroy(MiniDbPager *pager);
+
+/**
+ * Stores a record and returns its record id.
+ *
+ * @param pager The pager object.
+ * @param data The record to store.
+ * @param length The length of the record in bytes.
+ * @param rid Where the id of the new record will be stored.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the page that receives it does not match its checksum.
+ */
+MiniDbState minidb_pager_insert(MiniDbPager *pager, const void *data, size_t length, int64_t *rid);
+
+/**
+ * Reads a record. If the buffer is too small, only the length is returned.
+ *
+ * @param pager The pager object.
+ * @param rid The id of the record to read.
+ * @param buffer Where the record will be stored.
+ * @param buffer_size The size of the buffer.
+ * @param length Where the actual length of the record will be stored.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_BUFFER_TOO_SMALL if the record does not fit in the buffer,
+ *         MINIDB_ERROR_CORRUPTED_FILE if one of its pages does not match its checksum.
+ */
+MiniDbState minidb_pager_read(const MiniDbPager *pager, int64_t rid, void *buffer, size_t buffer_size, size_t *length);
+
+/**
+ * Replaces the contents of a record. The record may be moved, in which case rid is updated and the old
+ * record is left as it is, to be removed with minidb_pager_remove once nothing points to it anymore.
+ *
+ * @param pager The pager object.
+ * @param rid The id of the record to replace.
+ * @param data The new contents of the record.
+ * @param length The length of the new contents.
+ *
+ * @return MINIDB_OK on success, MINIDB_ERROR_CORRUPTED_FILE if the page of the record does not match its checksum.
+ */
+MiniDbState minidb_pager_update(MiniDbPager *pager, int64_t *rid, const void *data, size_t length);
+
+/**
+ * Removes a record and releases its space.
+ *
+ * @param pager The pager object.
+ * @param rid The id of the record to remove.
+ */
+void minidb_pager_remove(MiniDbPager *pager, int64_t rid);
+
+/**
+ * Returns true if the checksum stored in a page matches its contents.
+ *
+ * @param page The MINIDB_PAGE_SIZE bytes of the page.
+ */
+bool minidb_pager_check_page(const uint8_t *page);
@@ -0,0 +1,55 @@
+#include "parallel.h"
+#include "minidb.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int minidb_parallel_thread_count(int requested)
+{
+    if (requested > 0) {
+        return requested;
+    }
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int) processors : 1;
+}
+
+void minidb_parallel_run(void *(*worker)(void *), void *tasks, size_t task_size, int task_count)
+{
+    if (task_count == 1) {
+        worker(tasks);
+        return;
+    }
+
+    pthread_t *threads = malloc(task_count * sizeof(pthread_t));
+    bool *started = calloc(task_count, sizeof(bool));
+    if (is_null(threads) || is_null(started)) {
+        for (int i = 0; i < task_count; i++) {
+            worker((uint8_t *) tasks + i * task_size);
+        }
+
+        free(started);
+        free(threads);
+        return;
+    }
+
+    for (int i = 0; i < task_count; i++) {
+        void *task = (uint8_t *) tasks + i * task_size;
+        started[i] = pthread_create(&threads[i], NULL, worker, task) == 0;
+        if (!started[i]) {
+            // Run it on the calling thread if a new thread cannot be created
+            worker(task);
+        }
+    }
+
+    for (int i = 0; i < task_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    free(started);
+    free(threads);
+}
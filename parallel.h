@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Returns the number of worker threads to use: 'requested' if it is positive, otherwise one per online processor.
+ */
+int minidb_parallel_thread_count(int requested);
+
+/**
+ * Runs worker once per task, each one in its own thread, and waits for all of them. Tasks whose thread
+ * cannot be created run on the calling thread.
+ *
+ * @param worker The function to run.
+ * @param tasks An array of task_count tasks; each worker receives a pointer to its task.
+ * @param task_size The size of each task.
+ * @param task_count The number of tasks.
+ */
+void minidb_parallel_run(void *(*worker)(void *), void *tasks, size_t task_size, int task_count);
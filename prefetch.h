@@ -0,0 +1,11 @@
+#pragma once
+
+/**
+ * Asks the processor to start loading the cache line at ptr, so a later access does not wait for memory.
+ * Prefetching an invalid address (e.g. NULL) is harmless.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define minidb_prefetch(ptr) __builtin_prefetch((ptr))
+#else
+#define minidb_prefetch(ptr) ((void) (ptr))
+#endif
@@ -0,0 +1,450 @@
+#include "sharded.h"
+#include "parallel.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Rows buffered per shard by a range scan. A shard is read again, along with every other shard whose
+ * buffer is at least half empty, once its buffer runs out, so the scan holds at most this many rows per shard.
+ */
+#define SHARDED_SCAN_BATCH 1024
+
+struct MiniDbSharded
+{
+    int shard_count;
+    MiniDb **shards;
+    pthread_mutex_t *write_locks; // One per shard: a bulk load keeps the other writes out of its transaction
+    MiniDbPartition partition;
+    int64_t *range_bounds;
+    size_t data_size;
+};
+
+typedef struct MiniDbShardScan
+{
+    const MiniDb *shard;
+    int64_t next;      // The key the next read of the shard starts from
+    int64_t last;
+    bool exhausted;    // Every row of the shard in the range was read
+    size_t data_size;
+    int64_t *keys;     // SHARDED_SCAN_BATCH keys and rows, of which [position, count) are not visited yet
+    uint8_t *rows;
+    int64_t count;
+    int64_t position;
+    MiniDbState state;
+} MiniDbShardScan;
+
+typedef struct MiniDbShardLoad
+{
+    MiniDb *shard;
+    pthread_mutex_t *write_lock;
+    const int64_t *keys;
+    const uint8_t *rows;
+    size_t data_size;
+    int64_t *positions;
+    int64_t count;
+    MiniDbState state;
+} MiniDbShardLoad;
+
+/**
+ * Scrambles the key so consecutive keys are spread evenly across the shards (splitmix64 finalizer).
+ */
+static uint64_t sharded_hash(int64_t key)
+{
+    uint64_t x = (uint64_t) key;
+    x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return x ^ (x >> 31);
+}
+
+static MiniDbState sharded_init(MiniDbSharded **db, const MiniDbShardLayout *layout)
+{
+    *db = NULL;
+    if (layout->shard_count <= 0 || (layout->partition == MINIDB_PARTITION_RANGE && layout->shard_count > 1 && is_null(layout->range_bounds))) {
+        return MINIDB_ERROR_NULL_POINTER;
+    }
+
+    MiniDbSharded *sharded = malloc(sizeof(MiniDbSharded));
+    if (is_null(sharded)) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    sharded->shard_count = layout->shard_count;
+    sharded->partition = layout->partition;
+    sharded->shards = calloc(layout->shard_count, sizeof(MiniDb *));
+    sharded->write_locks = malloc(layout->shard_count * sizeof(pthread_mutex_t));
+    sharded->range_bounds = NULL;
+    sharded->data_size = 0;
+    if (!is_null(sharded->write_locks)) {
+        for (int i = 0; i < layout->shard_count; i++) {
+            pthread_mutex_init(&sharded->write_locks[i], NULL);
+        }
+    }
+
+    if (layout->partition == MINIDB_PARTITION_RANGE && layout->shard_count > 1) {
+        sharded->range_bounds = malloc((layout->shard_count - 1) * sizeof(int64_t));
+        if (!is_null(sharded->range_bounds)) {
+            memcpy(sharded->range_bounds, layout->range_bounds, (layout->shard_count - 1) * sizeof(int64_t));
+        }
+    }
+
+    if (is_null(sharded->shards) || is_null(sharded->write_locks) || (layout->partition == MINIDB_PARTITION_RANGE && layout->shard_count > 1 && is_null(sharded->range_bounds))) {
+        minidb_sharded_close(&sharded);
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    *db = sharded;
+    return MINIDB_OK;
+}
+
+MiniDbState minidb_sharded_create(MiniDbSharded **db, const MiniDbShardLayout *layout, size_t data_size)
+{
+    MiniDbState state = sharded_init(db, layout);
+    if (state != MINIDB_OK) {
+        return state;
+    }
+
+    for (int i = 0; i < layout->shard_count; i++) {
+        state = minidb_create(&(*db)->shards[i], layout->paths[i], data_size);
+        if (state != MINIDB_OK) {
+            minidb_sharded_close(db);
+            return state;
+        }
+    }
+
+    (*db)->data_size = data_size;
+    return MINIDB_OK;
+}
+
+MiniDbState minidb_sharded_open(MiniDbSharded **db, const MiniDbShardLayout *layout)
+{
+    MiniDbState state = sharded_init(db, layout);
+    if (state != MINIDB_OK) {
+        return state;
+    }
+
+    for (int i = 0; i < layout->shard_count; i++) {
+        state = minidb_open(&(*db)->shards[i], layout->paths[i]);
+        if (state != MINIDB_OK) {
+            minidb_sharded_close(db);
+            return state;
+        }
+    }
+
+    MiniDbInfo info;
+    minidb_get_info((*db)->shards[0], &info);
+    (*db)->data_size = info.data_size;
+    return MINIDB_OK;
+}
+
+void minidb_sharded_close(MiniDbSharded **db)
+{
+    if (!is_null(db) && !is_null(*db)) {
+        MiniDbSharded *sharded = *db;
+        if (!is_null(sharded->shards)) {
+            for (int i = 0; i < sharded->shard_count; i++) {
+                if (!is_null(sharded->shards[i])) {
+                    minidb_close(&sharded->shards[i]);
+                }
+            }
+        }
+
+        if (!is_null(sharded->write_locks)) {
+            for (int i = 0; i < sharded->shard_count; i++) {
+                pthread_mutex_destroy(&sharded->write_locks[i]);
+            }
+        }
+
+        free(sharded->shards);
+        free(sharded->write_locks);
+        free(sharded->range_bounds);
+        free(sharded);
+        *db = NULL;
+    }
+}
+
+int minidb_sharded_shard_of(const MiniDbSharded *db, int64_t key)
+{
+    if (db->partition == MINIDB_PARTITION_HASH) {
+        return (int) (sharded_hash(key) % (uint64_t) db->shard_count);
+    }
+
+    // Shard i holds the keys in [range_bounds[i - 1], range_bounds[i])
+    int first = 0;
+    int count = db->shard_count - 1;
+    while (count > 0) {
+        int step = count / 2;
+        if (db->range_bounds[first + step] <= key) {
+            first += step + 1;
+            count -= step + 1;
+        } else {
+            count = step;
+        }
+    }
+
+    return first;
+}
+
+MiniDbState minidb_sharded_select(const MiniDbSharded *db, int64_t key, void *result)
+{
+    return minidb_select(db->shards[minidb_sharded_shard_of(db, key)], key, result);
+}
+
+MiniDbState minidb_sharded_insert(MiniDbSharded *db, int64_t key, void *data)
+{
+    int shard = minidb_sharded_shard_of(db, key);
+    pthread_mutex_lock(&db->write_locks[shard]);
+    MiniDbState state = minidb_insert(db->shards[shard], key, data);
+    pthread_mutex_unlock(&db->write_locks[shard]);
+    return state;
+}
+
+MiniDbState minidb_sharded_update(MiniDbSharded *db, int64_t key, void *data)
+{
+    int shard = minidb_sharded_shard_of(db, key);
+    pthread_mutex_lock(&db->write_locks[shard]);
+    MiniDbState state = minidb_update(db->shards[shard], key, data);
+    pthread_mutex_unlock(&db->write_locks[shard]);
+    return state;
+}
+
+MiniDbState minidb_sharded_delete(MiniDbSharded *db, int64_t key)
+{
+    int shard = minidb_sharded_shard_of(db, key);
+    pthread_mutex_lock(&db->write_locks[shard]);
+    MiniDbState state = minidb_delete(db->shards[shard], key);
+    pthread_mutex_unlock(&db->write_locks[shard]);
+    return state;
+}
+
+static void sharded_scan_collect(int64_t key, void *row, void *context)
+{
+    MiniDbShardScan *scan = context;
+    scan->keys[scan->count] = key;
+    memcpy(scan->rows + scan->count * scan->data_size, row, scan->data_size);
+    scan->count++;
+}
+
+/**
+ * Moves the rows that were not visited yet to the front of the buffer and reads the next rows of the
+ * shard behind them, until the buffer is full or the range is exhausted.
+ */
+static void *sharded_scan_worker(void *arg)
+{
+    MiniDbShardScan *scan = *(MiniDbShardScan **) arg;
+    int64_t kept = scan->count - scan->position;
+    memmove(scan->keys, scan->keys + scan->position, kept * sizeof(int64_t));
+    memmove(scan->rows, scan->rows + scan->position * scan->data_size, kept * scan->data_size);
+    scan->count = kept;
+    scan->position = 0;
+
+    int64_t limit = SHARDED_SCAN_BATCH - kept;
+    scan->state = minidb_select_range_limit(scan->shard, scan->next, scan->last, limit, sharded_scan_collect, scan);
+
+    // A short read means that the range has no more rows in this shard
+    int64_t read = scan->count - kept;
+    scan->exhausted = read < limit || scan->keys[scan->count - 1] >= scan->last;
+    if (!scan->exhausted) {
+        scan->next = scan->keys[scan->count - 1] + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns true if the shard may hold keys in [first, last].
+ */
+static bool sharded_overlaps(const MiniDbSharded *db, int shard, int64_t first, int64_t last)
+{
+    if (db->partition == MINIDB_PARTITION_HASH || db->shard_count == 1) {
+        return true;
+    }
+
+    bool after_lower = shard == 0 || last >= db->range_bounds[shard - 1];
+    bool before_upper = shard == db->shard_count - 1 || first < db->range_bounds[shard];
+    return after_lower && before_upper;
+}
+
+/**
+ * Reads the next rows of every shard whose buffer is at least half empty, each shard in its own thread.
+ *
+ * @return The first error reported by a shard.
+ */
+static MiniDbState sharded_scan_refill(MiniDbShardScan *scans, int scan_count, MiniDbShardScan **refills)
+{
+    int refill_count = 0;
+    for (int i = 0; i < scan_count; i++) {
+        if (!scans[i].exhausted && scans[i].count - scans[i].position <= SHARDED_SCAN_BATCH / 2) {
+            refills[refill_count++] = &scans[i];
+        }
+    }
+
+    minidb_parallel_run(sharded_scan_worker, refills, sizeof(MiniDbShardScan *), refill_count);
+
+    MiniDbState state = MINIDB_OK;
+    for (int i = 0; i < refill_count && state == MINIDB_OK; i++) {
+        state = refills[i]->state;
+    }
+
+    return state;
+}
+
+MiniDbState minidb_sharded_select_range(const MiniDbSharded *db, int64_t first, int64_t last, void (*callback)(int64_t, void *, void *), void *context)
+{
+    MiniDbShardScan *scans = calloc(db->shard_count, sizeof(MiniDbShardScan));
+    MiniDbShardScan **refills = malloc(db->shard_count * sizeof(MiniDbShardScan *));
+    MiniDbState state = is_null(scans) || is_null(refills) ? MINIDB_ERROR_MALLOC_FAIL : MINIDB_OK;
+
+    int scan_count = 0;
+    for (int i = 0; i < db->shard_count && state == MINIDB_OK; i++) {
+        if (sharded_overlaps(db, i, first, last)) {
+            MiniDbShardScan *scan = &scans[scan_count++];
+            scan->shard = db->shards[i];
+            scan->next = first;
+            scan->last = last;
+            scan->exhausted = first > last;
+            scan->data_size = db->data_size;
+            scan->keys = malloc(SHARDED_SCAN_BATCH * sizeof(int64_t));
+            scan->rows = malloc(SHARDED_SCAN_BATCH * db->data_size);
+            if (is_null(scan->keys) || is_null(scan->rows)) {
+                state = MINIDB_ERROR_MALLOC_FAIL;
+            }
+        }
+    }
+
+    // Every shard returns its rows in key order, so a k-way merge keeps the whole result ordered.
+    // With range partitioning the shards do not overlap and the merge degenerates into a concatenation.
+    while (state == MINIDB_OK) {
+        MiniDbShardScan *next = NULL;
+        bool starved = false;
+        for (int i = 0; i < scan_count; i++) {
+            MiniDbShardScan *scan = &scans[i];
+            if (scan->position == scan->count) {
+                // A shard that ran out of buffered rows may still have smaller keys than the others
+                starved |= !scan->exhausted;
+            } else if (is_null(next) || scan->keys[scan->position] < next->keys[next->position]) {
+                next = scan;
+            }
+        }
+
+        if (starved) {
+            state = sharded_scan_refill(scans, scan_count, refills);
+            continue;
+        }
+
+        if (is_null(next)) {
+            break;
+        }
+
+        // The row is visited from the buffer: the shard is not locked while the callback runs
+        int64_t position = next->position++;
+        callback(next->keys[position], next->rows + position * next->data_size, context);
+    }
+
+    for (int i = 0; i < scan_count; i++) {
+        free(scans[i].keys);
+        free(scans[i].rows);
+    }
+
+    free(scans);
+    free(refills);
+    return state;
+}
+
+/**
+ * Adapts the callback of minidb_sharded_select_all to the one of minidb_sharded_select_range.
+ */
+typedef struct MiniDbShardSelectAll
+{
+    void (*callback)(int64_t, void *);
+} MiniDbShardSelectAll;
+
+static void sharded_select_all_visit(int64_t key, void *row, void *context)
+{
+    ((const MiniDbShardSelectAll *) context)->callback(key, row);
+}
+
+MiniDbState minidb_sharded_select_all(const MiniDbSharded *db, void (*callback)(int64_t, void *))
+{
+    MiniDbShardSelectAll select_all = {callback};
+    return minidb_sharded_select_range(db, INT64_MIN, INT64_MAX, sharded_select_all_visit, &select_all);
+}
+
+static void *sharded_load_worker(void *arg)
+{
+    MiniDbShardLoad *load = arg;
+    if (load->count == 0) {
+        load->state = MINIDB_OK;
+        return NULL;
+    }
+
+    pthread_mutex_lock(load->write_lock);
+    load->state = minidb_begin(load->shard);
+    if (load->state != MINIDB_OK) {
+        pthread_mutex_unlock(load->write_lock);
+        return NULL;
+    }
+
+    for (int64_t i = 0; i < load->count && load->state == MINIDB_OK; i++) {
+        int64_t position = load->positions[i];
+        load->state = minidb_insert(load->shard, load->keys[position], (void *) (load->rows + position * load->data_size));
+    }
+
+    if (load->state == MINIDB_OK) {
+        load->state = minidb_commit(load->shard);
+    } else {
+        minidb_rollback(load->shard);
+    }
+
+    pthread_mutex_unlock(load->write_lock);
+    return NULL;
+}
+
+MiniDbState minidb_sharded_insert_bulk(MiniDbSharded *db, const int64_t *keys, const void *rows, int64_t count)
+{
+    MiniDbShardLoad *loads = calloc(db->shard_count, sizeof(MiniDbShardLoad));
+    int64_t *positions = malloc(count * sizeof(int64_t));
+    int *owners = malloc(count * sizeof(int));
+    if (is_null(loads) || is_null(positions) || is_null(owners)) {
+        free(loads);
+        free(positions);
+        free(owners);
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    // Group the rows by shard: count them first, then give every shard a slice of 'positions'
+    for (int64_t i = 0; i < count; i++) {
+        owners[i] = minidb_sharded_shard_of(db, keys[i]);
+        loads[owners[i]].count++;
+    }
+
+    int64_t offset = 0;
+    for (int i = 0; i < db->shard_count; i++) {
+        loads[i].shard = db->shards[i];
+        loads[i].write_lock = &db->write_locks[i];
+        loads[i].keys = keys;
+        loads[i].rows = rows;
+        loads[i].data_size = db->data_size;
+        loads[i].positions = positions + offset;
+        offset += loads[i].count;
+        loads[i].count = 0;
+    }
+
+    for (int64_t i = 0; i < count; i++) {
+        MiniDbShardLoad *load = &loads[owners[i]];
+        load->positions[load->count++] = i;
+    }
+
+    minidb_parallel_run(sharded_load_worker, loads, sizeof(MiniDbShardLoad), db->shard_count);
+
+    MiniDbState state = MINIDB_OK;
+    for (int i = 0; i < db->shard_count && state == MINIDB_OK; i++) {
+        state = loads[i].state;
+    }
+
+    free(loads);
+    free(positions);
+    free(owners);
+    return state;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "minidb.h"
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct MiniDbSharded MiniDbSharded;
+
+typedef enum MiniDbPartition
+{
+    MINIDB_PARTITION_HASH,
+    MINIDB_PARTITION_RANGE,
+} MiniDbPartition;
+
+/**
+ * Describes how the key space is split across the shards. The same layout must be used every time
+ * the shards are opened.
+ */
+typedef struct MiniDbShardLayout
+{
+    int shard_count;
+    const char *const *paths;   // One database file per shard, possibly on different devices
+    MiniDbPartition partition;
+    const int64_t *range_bounds; // Range partitioning only: shard i holds keys < range_bounds[i] (shard_count - 1 bounds)
+} MiniDbShardLayout;
+
+/**
+ * Creates one MiniDb database per shard.
+ *
+ * @param db The MiniDbSharded object to initialize.
+ * @param layout The shard layout.
+ * @param data_size The size of the data to store (sizeof(my_struct)).
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_sharded_create(MiniDbSharded **db, const MiniDbShardLayout *layout, size_t data_size);
+
+/**
+ * Opens the MiniDb database of every shard.
+ *
+ * @param db The MiniDbSharded object to initialize.
+ * @param layout The shard layout used when the shards were created.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_sharded_open(MiniDbSharded **db, const MiniDbShardLayout *layout);
+
+/**
+ * Closes every shard and releases the MiniDbSharded object.
+ *
+ * @param db The MiniDbSharded object to close.
+ */
+void minidb_sharded_close(MiniDbSharded **db);
+
+/**
+ * Returns the shard that owns the given key.
+ */
+int minidb_sharded_shard_of(const MiniDbSharded *db, int64_t key);
+
+MiniDbState minidb_sharded_select(const MiniDbSharded *db, int64_t key, void *result);
+
+MiniDbState minidb_sharded_insert(MiniDbSharded *db, int64_t key, void *data);
+
+MiniDbState minidb_sharded_update(MiniDbSharded *db, int64_t key, void *data);
+
+MiniDbState minidb_sharded_delete(MiniDbSharded *db, int64_t key);
+
+/**
+ * Selects all rows, in key order. See minidb_sharded_select_range.
+ *
+ * @param db The MiniDbSharded object.
+ * @param callback The callback function that will be executed on for each row.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_sharded_select_all(const MiniDbSharded *db, void (*callback)(int64_t, void *));
+
+/**
+ * Selects the rows whose key is in [first, last], in key order. Only the shards that may hold keys
+ * in the range are scanned. The rows of every shard are read in batches, the shards in parallel, and
+ * merged as the callback consumes them, so the scan only buffers a bounded number of rows per shard.
+ * The callback runs on the calling thread, without any shard locked, so it may write to the database;
+ * rows that were already buffered are still visited as they were read.
+ *
+ * @param db The MiniDbSharded object.
+ * @param first The smallest key to select.
+ * @param last The largest key to select.
+ * @param callback The callback function that will be executed on for each row.
+ * @param context A pointer passed as is to the callback.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_sharded_select_range(const MiniDbSharded *db, int64_t first, int64_t last, void (*callback)(int64_t, void *, void *), void *context);
+
+/**
+ * Inserts many rows at once. The rows are split by shard and every shard loads its rows in its own
+ * thread, inside a single transaction. Bulk loads and writes to the same shard are serialized.
+ *
+ * The load is atomic within each shard but not across shards: if a shard fails, its rows are rolled
+ * back while the shards that committed keep theirs.
+ *
+ * @param db The MiniDbSharded object.
+ * @param keys The keys of the rows.
+ * @param rows The rows, stored one after the other.
+ * @param count The number of rows.
+ *
+ * @return MINIDB_OK on success, or the first error reported by a shard.
+ */
+MiniDbState minidb_sharded_insert_bulk(MiniDbSharded *db, const int64_t *keys, const void *rows, int64_t count);
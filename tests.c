@@ -0,0 +1,1079 @@
+#include "minidb.h"
+#include "btree.h"
+#include "changelog.h"
+#include "pager.h"
+#include "transaction.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_PATH "minidb-test.db"
+#define TEST_BACKUP_PATH "minidb-test-backup.db"
+
+#define TEST_CHECK(condition)                                                    \
+    do {                                                                         \
+        if (!(condition)) {                                                      \
+            printf("%s:%d: Check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return false;                                                        \
+        }                                                                        \
+    } while (0)
+
+typedef struct TestRow
+{
+    int64_t id;
+    char payload[56];
+} TestRow;
+
+typedef struct Test
+{
+    const char *name;
+    bool (*run)(void);
+} Test;
+
+/**
+ * Removes a database and every file that goes with it.
+ */
+static void test_remove(const char *path)
+{
+    const char *suffixes[] = {"", "-index", "-index.tmp", "-journal", "-changes", "-replica"};
+    char file[MINIDB_PATH_MAX];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(file, sizeof(file), "%s%s", path, suffixes[i]);
+        remove(file);
+    }
+}
+
+static bool test_exists(const char *path)
+{
+    return access(path, F_OK) == 0;
+}
+
+static void test_sleep_ms(int64_t ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Flips one bit of a file, as a damaged disk would.
+ */
+static bool test_flip_bit(const char *path, off_t offset)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned char byte;
+    bool flipped = pread(fd, &byte, 1, offset) == 1;
+    byte ^= 0x40;
+    flipped = flipped && pwrite(fd, &byte, 1, offset) == 1;
+    close(fd);
+    return flipped;
+}
+
+/**
+ * Returns the size of the complete batches of a change log, or -1 if it cannot be read.
+ */
+static int64_t test_log_size(const char *path)
+{
+    MiniDbChangeLogReader reader;
+    if (minidb_changelog_reader_open(&reader, path) != MINIDB_OK) {
+        return -1;
+    }
+
+    int64_t size = minidb_changelog_reader_size(&reader);
+    minidb_changelog_reader_close(&reader);
+    return size;
+}
+
+static int64_t test_rows_seen;
+static MiniDb *test_scan_db;
+
+static void test_count_row(int64_t key, void *row)
+{
+    (void) key;
+    (void) row;
+    test_rows_seen++;
+}
+
+static void test_update_row(int64_t key, void *row)
+{
+    TestRow next = *(TestRow *) row;
+    next.id++;
+    if (minidb_update(test_scan_db, key, &next) == MINIDB_OK) {
+        test_rows_seen++;
+    }
+}
+
+#ifdef MINIDB_TEST_FAULTS
+/*
+ * Failures injected into the functions wrapped at link time (see CMakeLists.txt).
+ */
+static size_t test_fail_realloc_size;     // Reallocations of exactly this many bytes fail (0 = none)
+static size_t test_fail_realloc_from;     // Reallocations of at least this many bytes fail (0 = none)
+static int64_t test_fail_pager_insert_at; // The pager insert with this number fails (0 = none)
+static bool test_fail_pager_inserts;      // Every pager insert fails
+static int64_t test_pager_inserts;
+static bool test_fail_btree_build;        // The next sorted tree build fails
+static int64_t test_fsyncs;
+
+void *__real_realloc(void *ptr, size_t size);
+int __real_fsync(int fd);
+MiniDbState __real_minidb_pager_insert(MiniDbPager *pager, const void *data, size_t length, int64_t *rid);
+bool __real_btree_build_sorted(BTree *tree, const int64_t *pairs, int64_t count);
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (size == test_fail_realloc_size || (test_fail_realloc_from > 0 && size >= test_fail_realloc_from)) {
+        return NULL;
+    }
+
+    return __real_realloc(ptr, size);
+}
+
+int __wrap_fsync(int fd)
+{
+    test_fsyncs++;
+    return __real_fsync(fd);
+}
+
+MiniDbState __wrap_minidb_pager_insert(MiniDbPager *pager, const void *data, size_t length, int64_t *rid)
+{
+    if (++test_pager_inserts == test_fail_pager_insert_at || test_fail_pager_inserts) {
+        return MINIDB_ERROR_MALLOC_FAIL;
+    }
+
+    return __real_minidb_pager_insert(pager, data, length, rid);
+}
+
+bool __wrap_btree_build_sorted(BTree *tree, const int64_t *pairs, int64_t count)
+{
+    if (test_fail_btree_build) {
+        test_fail_btree_build = false;
+        return false;
+    }
+
+    return __real_btree_build_sorted(tree, pairs, count);
+}
+#endif
+
+static bool test_commit_rollback(void)
+{
+    test_remove(TEST_PATH);
+    MiniDb *db;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(TestRow)) == MINIDB_OK);
+    for (int64_t i = 0; i < 10; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    TEST_CHECK(minidb_begin(db) == MINIDB_ERROR_TRANSACTION_ACTIVE);
+    row.id = 100;
+    TEST_CHECK(minidb_insert(db, 100, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_insert(db, 100, &row) == MINIDB_ERROR_DUPLICATED_KEY_VIOLATION);
+    TEST_CHECK(minidb_delete(db, 3) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 3, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    row.id = 44;
+    TEST_CHECK(minidb_update(db, 4, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_update(db, 555, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_select(db, 4, &row) == MINIDB_OK && row.id == 44);
+    TEST_CHECK(minidb_rollback(db) == MINIDB_OK);
+    TEST_CHECK(minidb_rollback(db) == MINIDB_ERROR_NO_TRANSACTION);
+    TEST_CHECK(minidb_select(db, 3, &row) == MINIDB_OK && row.id == 3);
+    TEST_CHECK(minidb_select(db, 4, &row) == MINIDB_OK && row.id == 4);
+    TEST_CHECK(minidb_select(db, 100, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+
+    // A key deleted and inserted again in the same transaction
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    row.id = 100;
+    TEST_CHECK(minidb_insert(db, 100, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_delete(db, 3) == MINIDB_OK);
+    row.id = 33;
+    TEST_CHECK(minidb_insert(db, 3, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_delete(db, 5) == MINIDB_OK);
+    row.id = 44;
+    TEST_CHECK(minidb_update(db, 4, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_commit(db) == MINIDB_OK);
+    TEST_CHECK(minidb_commit(db) == MINIDB_ERROR_NO_TRANSACTION);
+    TEST_CHECK(!test_exists(TEST_PATH "-journal"));
+    minidb_close(&db);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 3, &row) == MINIDB_OK && row.id == 33);
+    TEST_CHECK(minidb_select(db, 4, &row) == MINIDB_OK && row.id == 44);
+    TEST_CHECK(minidb_select(db, 100, &row) == MINIDB_OK && row.id == 100);
+    TEST_CHECK(minidb_select(db, 5, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    MiniDbInfo info;
+    minidb_get_info(db, &info);
+    TEST_CHECK(info.row_count == 10);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+
+    // Rows longer than a page in a transaction of a variable-length database
+    char data[5000];
+    char buffer[6000];
+    size_t length;
+    memset(data, 'z', sizeof(data));
+    TEST_CHECK(minidb_create_varlen(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    TEST_CHECK(minidb_insert_varlen(db, 1, "hello", 6) == MINIDB_OK);
+    TEST_CHECK(minidb_insert_varlen(db, 2, data, sizeof(data)) == MINIDB_OK);
+    TEST_CHECK(minidb_select_varlen(db, 2, buffer, sizeof(buffer), &length) == MINIDB_OK && length == sizeof(data));
+    TEST_CHECK(minidb_commit(db) == MINIDB_OK);
+    minidb_close(&db);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select_varlen(db, 1, buffer, sizeof(buffer), &length) == MINIDB_OK && strcmp(buffer, "hello") == 0);
+    TEST_CHECK(minidb_select_varlen(db, 2, buffer, sizeof(buffer), &length) == MINIDB_OK && length == sizeof(data));
+    TEST_CHECK(memcmp(buffer, data, sizeof(data)) == 0);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+static bool test_journal_replay(void)
+{
+    test_remove(TEST_PATH);
+    MiniDb *db;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(TestRow)) == MINIDB_OK);
+    for (int64_t i = 0; i < 10; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    minidb_close(&db);
+
+    // The journal left behind by a commit interrupted while it was being applied
+    MiniDbTransaction tx;
+    minidb_transaction_init(&tx);
+    row.id = 7000;
+    TEST_CHECK(minidb_transaction_append(&tx, MINIDB_OP_INSERT, 7000, &row, sizeof(row)) == MINIDB_OK);
+    row.id = 77;
+    TEST_CHECK(minidb_transaction_append(&tx, MINIDB_OP_UPDATE, 7, &row, sizeof(row)) == MINIDB_OK);
+    TEST_CHECK(minidb_transaction_append(&tx, MINIDB_OP_DELETE, 8, NULL, 0) == MINIDB_OK);
+    TEST_CHECK(minidb_transaction_journal_write(&tx, TEST_PATH "-journal") == MINIDB_OK);
+    minidb_transaction_clear(&tx);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(!test_exists(TEST_PATH "-journal"));
+    TEST_CHECK(minidb_select(db, 7000, &row) == MINIDB_OK && row.id == 7000);
+    TEST_CHECK(minidb_select(db, 7, &row) == MINIDB_OK && row.id == 77);
+    TEST_CHECK(minidb_select(db, 8, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    minidb_close(&db);
+
+    // The replayed changes were persisted
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 7000, &row) == MINIDB_OK && row.id == 7000);
+    TEST_CHECK(minidb_select(db, 8, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    minidb_close(&db);
+
+    // A journal that was not written whole is ignored
+    minidb_transaction_init(&tx);
+    row.id = 9000;
+    TEST_CHECK(minidb_transaction_append(&tx, MINIDB_OP_INSERT, 9000, &row, sizeof(row)) == MINIDB_OK);
+    TEST_CHECK(minidb_transaction_journal_write(&tx, TEST_PATH "-journal") == MINIDB_OK);
+    minidb_transaction_clear(&tx);
+    struct stat st;
+    TEST_CHECK(stat(TEST_PATH "-journal", &st) == 0 && truncate(TEST_PATH "-journal", st.st_size - 1) == 0);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 9000, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_select(db, 7000, &row) == MINIDB_OK);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+static bool test_ttl(void)
+{
+    test_remove(TEST_PATH);
+    MiniDbOptions options = {0};
+    options.reclaim_interval_ms = 60 * 1000;
+    MiniDb *db;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(TestRow), &options) == MINIDB_OK);
+    for (int64_t i = 0; i < 100; i++) {
+        row.id = i;
+        TEST_CHECK((i % 2 == 0 ? minidb_insert_ttl(db, i, &row, 100) : minidb_insert(db, i, &row)) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_set_ttl(db, 1000, 100) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_select(db, 10, &row) == MINIDB_OK && row.id == 10);
+    test_sleep_ms(200);
+
+    // Expired rows are hidden right away, before they are reclaimed
+    TEST_CHECK(minidb_select(db, 10, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_select(db, 11, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_update(db, 10, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_set_ttl(db, 12, 100) == MINIDB_ERROR_ROW_NOT_FOUND);
+    test_rows_seen = 0;
+    TEST_CHECK(minidb_select_all(db, test_count_row) == MINIDB_OK);
+    TEST_CHECK(test_rows_seen == 50);
+
+    row.id = 777;
+    TEST_CHECK(minidb_insert(db, 10, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 10, &row) == MINIDB_OK && row.id == 777);
+
+    int64_t reclaimed;
+    MiniDbInfo info;
+    TEST_CHECK(minidb_reclaim_expired(db, &reclaimed) == MINIDB_OK);
+    minidb_get_info(db, &info);
+    TEST_CHECK(reclaimed > 0 && info.row_count == 51);
+
+    // Expiry times survive a reopen, and clearing one keeps the row
+    TEST_CHECK(minidb_set_ttl(db, 11, 100) == MINIDB_OK);
+    TEST_CHECK(minidb_set_ttl(db, 13, 100) == MINIDB_OK);
+    TEST_CHECK(minidb_set_ttl(db, 13, MINIDB_NO_TTL) == MINIDB_OK);
+    TEST_CHECK(minidb_set_ttl(db, 15, 60 * 1000) == MINIDB_OK);
+    minidb_close(&db);
+
+    TEST_CHECK(minidb_open_ex(&db, TEST_PATH, &options) == MINIDB_OK);
+    test_sleep_ms(200);
+    TEST_CHECK(minidb_select(db, 11, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_select(db, 13, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 15, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    TEST_CHECK(minidb_reclaim_expired(db, &reclaimed) == MINIDB_ERROR_TRANSACTION_ACTIVE);
+    TEST_CHECK(minidb_rollback(db) == MINIDB_OK);
+    TEST_CHECK(minidb_reclaim_expired(db, &reclaimed) == MINIDB_OK);
+    minidb_close(&db);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    minidb_get_info(db, &info);
+    TEST_CHECK(info.row_count == 50);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+static bool test_backup(void)
+{
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    MiniDb *db;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(TestRow)) == MINIDB_OK);
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    for (int64_t i = 0; i < 5000; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_commit(db) == MINIDB_OK);
+    TEST_CHECK(minidb_backup(db, TEST_BACKUP_PATH) == MINIDB_OK);
+
+    for (int64_t i = 0; i < 5000; i += 10) {
+        row.id = -i;
+        TEST_CHECK(minidb_update(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_delete(db, 1) == MINIDB_OK);
+    row.id = 9000;
+    TEST_CHECK(minidb_insert(db, 9000, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_backup_incremental(db, TEST_BACKUP_PATH) == MINIDB_OK);
+    minidb_close(&db);
+
+    MiniDbVerifyReport report;
+    TEST_CHECK(minidb_verify(TEST_BACKUP_PATH, 1, &report) == MINIDB_OK);
+    TEST_CHECK(report.header_ok && report.index_ok && report.corrupted == 0 && report.rows_checked > 0);
+
+    TEST_CHECK(minidb_open(&db, TEST_BACKUP_PATH) == MINIDB_OK);
+    for (int64_t i = 0; i < 5000; i++) {
+        if (i == 1) {
+            TEST_CHECK(minidb_select(db, i, &row) == MINIDB_ERROR_ROW_NOT_FOUND);
+        } else {
+            TEST_CHECK(minidb_select(db, i, &row) == MINIDB_OK && row.id == (i % 10 == 0 ? -i : i));
+        }
+    }
+
+    TEST_CHECK(minidb_select(db, 9000, &row) == MINIDB_OK && row.id == 9000);
+    minidb_close(&db);
+
+    // A damaged row is found by minidb_verify
+    struct stat st;
+    TEST_CHECK(stat(TEST_BACKUP_PATH, &st) == 0 && test_flip_bit(TEST_BACKUP_PATH, st.st_size / 2));
+    TEST_CHECK(minidb_verify(TEST_BACKUP_PATH, 1, &report) == MINIDB_ERROR_CORRUPTED_FILE);
+    TEST_CHECK(report.corrupted == 1 && report.first_corrupted >= 0);
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    return true;
+}
+
+static bool test_replica(void)
+{
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    MiniDbOptions options = {0};
+    options.change_log = true;
+    MiniDb *db;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(TestRow), &options) == MINIDB_OK);
+    for (int64_t i = 0; i < 1000; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_backup(db, TEST_BACKUP_PATH) == MINIDB_OK);
+
+    // Changes made after the backup: updates, then deletes and a reinsert in a transaction
+    for (int64_t i = 0; i < 1000; i += 3) {
+        row.id = i + 100000;
+        TEST_CHECK(minidb_update(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    for (int64_t i = 1; i < 1000; i += 7) {
+        TEST_CHECK(minidb_delete(db, i) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_delete(db, 2) == MINIDB_OK);
+    row.id = 2;
+    TEST_CHECK(minidb_insert(db, 2, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_commit(db) == MINIDB_OK);
+
+    MiniDbReplica *replica;
+    MiniDbReplicaStatus status;
+    int64_t applied;
+    TEST_CHECK(minidb_replica_open(&replica, TEST_BACKUP_PATH, TEST_PATH, NULL) == MINIDB_OK);
+    minidb_replica_get_status(replica, &status);
+    TEST_CHECK(status.position > MINIDB_CHANGELOG_START && status.lag_bytes > 0);
+
+    TEST_CHECK(minidb_replica_poll(replica, &applied) == MINIDB_OK && applied > 0);
+    minidb_replica_get_status(replica, &status);
+    TEST_CHECK(status.lag_bytes == 0 && status.lag_ms == 0 && status.applied_changes == applied);
+
+    MiniDb *copy = minidb_replica_db(replica);
+    TestRow expected;
+    for (int64_t key = 0; key < 1000; key++) {
+        MiniDbState state = minidb_select(db, key, &expected);
+        TEST_CHECK(minidb_select(copy, key, &row) == state);
+        TEST_CHECK(state != MINIDB_OK || row.id == expected.id);
+    }
+
+    // Caught up: new changes are picked up by the next poll
+    TEST_CHECK(minidb_replica_poll(replica, &applied) == MINIDB_OK && applied == 0);
+    row.id = 6000;
+    TEST_CHECK(minidb_insert(db, 6000, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_replica_poll(replica, &applied) == MINIDB_OK && applied == 1);
+    TEST_CHECK(minidb_select(copy, 6000, &row) == MINIDB_OK && row.id == 6000);
+    minidb_replica_close(&replica);
+
+    // A replica that was closed resumes where it stopped
+    row.id = 7000;
+    TEST_CHECK(minidb_insert(db, 7000, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_replica_open(&replica, TEST_BACKUP_PATH, TEST_PATH, NULL) == MINIDB_OK);
+    minidb_replica_get_status(replica, &status);
+    TEST_CHECK(status.lag_bytes > 0);
+    TEST_CHECK(minidb_replica_poll(replica, &applied) == MINIDB_OK && applied == 1);
+    TEST_CHECK(minidb_select(minidb_replica_db(replica), 7000, &row) == MINIDB_OK && row.id == 7000);
+    minidb_replica_close(&replica);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    return true;
+}
+
+/**
+ * A damaged block of the index fails the lookups and scans that need it, instead of hiding its keys.
+ */
+static bool test_damaged_index(void)
+{
+    test_remove(TEST_PATH);
+    MiniDbOptions options = {0};
+    options.filter_bits_per_key = -1;
+    MiniDb *db;
+    int64_t value;
+    TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(value), &options) == MINIDB_OK);
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    for (value = 0; value < 20000; value++) {
+        TEST_CHECK(minidb_insert(db, value, &value) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_commit(db) == MINIDB_OK);
+    minidb_close(&db);
+
+    // Without a filter, the blocks of entries take most of the file
+    struct stat st;
+    TEST_CHECK(stat(TEST_PATH "-index", &st) == 0 && test_flip_bit(TEST_PATH "-index", st.st_size * 2 / 3));
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    test_rows_seen = 0;
+    TEST_CHECK(minidb_select_all(db, test_count_row) == MINIDB_ERROR_CORRUPTED_FILE);
+
+    int64_t found = 0;
+    int64_t damaged = 0;
+    for (int64_t key = 0; key < 20000; key++) {
+        MiniDbState state = minidb_select(db, key, &value);
+        found += state == MINIDB_OK && value == key;
+        damaged += state == MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    TEST_CHECK(damaged > 0 && found + damaged == 20000);
+    minidb_close(&db);
+
+    MiniDbVerifyReport report;
+    TEST_CHECK(minidb_verify(TEST_PATH, 1, &report) == MINIDB_ERROR_CORRUPTED_FILE && !report.index_ok);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * Pages cut off the end of the data file are reported as damaged, and new rows can still be stored.
+ */
+static bool test_truncated_data(void)
+{
+    test_remove(TEST_PATH);
+    MiniDb *db;
+    char buffer[3000];
+    size_t length;
+    TEST_CHECK(minidb_create_varlen(&db, TEST_PATH) == MINIDB_OK);
+    for (int64_t i = 0; i < 100; i++) {
+        memset(buffer, 'a' + (int) (i % 26), sizeof(buffer));
+        TEST_CHECK(minidb_insert_varlen(db, i, buffer, sizeof(buffer)) == MINIDB_OK);
+    }
+
+    minidb_close(&db);
+    TEST_CHECK(truncate(TEST_PATH, 10 * MINIDB_PAGE_SIZE) == 0);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    int64_t damaged = 0;
+    for (int64_t i = 0; i < 100; i++) {
+        MiniDbState state = minidb_select_varlen(db, i, buffer, sizeof(buffer), &length);
+        TEST_CHECK(state == MINIDB_ERROR_CORRUPTED_FILE || (state == MINIDB_OK && buffer[0] == 'a' + i % 26));
+        damaged += state == MINIDB_ERROR_CORRUPTED_FILE;
+    }
+
+    TEST_CHECK(damaged > 0);
+    memset(buffer, 'z', sizeof(buffer));
+    TEST_CHECK(minidb_insert_varlen(db, 500, buffer, sizeof(buffer)) == MINIDB_OK);
+    TEST_CHECK(minidb_select_varlen(db, 500, buffer, sizeof(buffer), &length) == MINIDB_OK && buffer[10] == 'z');
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * Writes made by a scan callback, which holds the lock, must not wait for the flusher thread.
+ */
+static bool test_scan_writes(void)
+{
+    test_remove(TEST_PATH);
+    MiniDbOptions options = {0};
+    options.sync_policy = MINIDB_SYNC_INTERVAL;
+    options.sync_interval_ms = 50;
+    options.dirty_limit = 4096;
+    TestRow row = {0};
+    TEST_CHECK(minidb_create_ex(&test_scan_db, TEST_PATH, sizeof(TestRow), &options) == MINIDB_OK);
+    for (int64_t i = 0; i < 3000; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(test_scan_db, i, &row) == MINIDB_OK);
+    }
+
+    test_rows_seen = 0;
+    TEST_CHECK(minidb_select_all(test_scan_db, test_update_row) == MINIDB_OK);
+    TEST_CHECK(test_rows_seen == 3000);
+    minidb_close(&test_scan_db);
+
+    TEST_CHECK(minidb_open(&test_scan_db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select(test_scan_db, 2999, &row) == MINIDB_OK && row.id == 3000);
+    minidb_close(&test_scan_db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * Deletes a row after a checkpoint, writes new rows that could take its space, and returns without
+ * persisting any of it.
+ */
+static int test_crash_after_delete(bool varlen)
+{
+    MiniDbOptions options = {0};
+    options.sync_policy = MINIDB_SYNC_CHECKPOINT;
+    MiniDb *db;
+    int64_t value;
+    char data[300];
+    if (minidb_create_ex(&db, TEST_PATH, varlen ? MINIDB_VARLEN : sizeof(value), &options) != MINIDB_OK) {
+        return 1;
+    }
+
+    for (int64_t key = 1; key <= 2; key++) {
+        value = key * 100;
+        memset(data, (int) key, sizeof(data));
+        if ((varlen ? minidb_insert_varlen(db, key, data, sizeof(data)) : minidb_insert(db, key, &value)) != MINIDB_OK) {
+            return 2;
+        }
+    }
+
+    if (minidb_checkpoint(db) != MINIDB_OK || minidb_delete(db, 1) != MINIDB_OK) {
+        return 3;
+    }
+
+    value = 300;
+    memset(data, 3, sizeof(data));
+    if ((varlen ? minidb_insert_varlen(db, 3, data, sizeof(data)) : minidb_insert(db, 3, &value)) != MINIDB_OK) {
+        return 4;
+    }
+
+    if (varlen) {
+        memset(data, 9, sizeof(data));
+        if (minidb_update_varlen(db, 2, data, sizeof(data) - 100) != MINIDB_OK) {
+            return 5;
+        }
+
+        memset(data, 7, sizeof(data));
+        if (minidb_insert_varlen(db, 4, data, sizeof(data)) != MINIDB_OK) {
+            return 6;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The space of a deleted row must not be reused before the index file stops pointing to it: after
+ * a crash, the deleted row would read back as the one written over it.
+ */
+static bool test_deleted_slot_reuse(void)
+{
+    for (int varlen = 0; varlen <= 1; varlen++) {
+        test_remove(TEST_PATH);
+        pid_t pid = fork();
+        TEST_CHECK(pid >= 0);
+        if (pid == 0) {
+            _exit(test_crash_after_delete(varlen));
+        }
+
+        int status;
+        TEST_CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+        MiniDb *db;
+        int64_t value;
+        char data[300];
+        size_t length;
+        TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+        if (varlen) {
+            TEST_CHECK(minidb_select_varlen(db, 1, data, sizeof(data), &length) == MINIDB_OK);
+            TEST_CHECK(length == sizeof(data) && data[0] == 1 && data[length - 1] == 1);
+
+            // Shrunk in place or not at all: either way a whole row
+            TEST_CHECK(minidb_select_varlen(db, 2, data, sizeof(data), &length) == MINIDB_OK);
+            TEST_CHECK((length == sizeof(data) && data[0] == 2 && data[length - 1] == 2) || (length == sizeof(data) - 100 && data[0] == 9 && data[length - 1] == 9));
+            TEST_CHECK(minidb_select_varlen(db, 3, data, sizeof(data), &length) != MINIDB_OK);
+
+            memset(data, 5, sizeof(data));
+            for (int64_t key = 10; key < 20; key++) {
+                TEST_CHECK(minidb_insert_varlen(db, key, data, sizeof(data)) == MINIDB_OK);
+            }
+
+            TEST_CHECK(minidb_select_varlen(db, 1, data, sizeof(data), &length) == MINIDB_OK && data[0] == 1 && data[length - 1] == 1);
+        } else {
+            TEST_CHECK(minidb_select(db, 1, &value) == MINIDB_OK && value == 100);
+            TEST_CHECK(minidb_select(db, 2, &value) == MINIDB_OK && value == 200);
+            TEST_CHECK(minidb_select(db, 3, &value) != MINIDB_OK);
+
+            value = 5;
+            for (int64_t key = 10; key < 20; key++) {
+                TEST_CHECK(minidb_insert(db, key, &value) == MINIDB_OK);
+            }
+
+            TEST_CHECK(minidb_select(db, 1, &value) == MINIDB_OK && value == 100);
+        }
+
+        minidb_close(&db);
+        MiniDbVerifyReport report;
+        TEST_CHECK(minidb_verify(TEST_PATH, 1, &report) == MINIDB_OK);
+    }
+
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * Changes reach the change log only once they are persisted, and the log is synced along with the data.
+ */
+static bool test_change_log_order(void)
+{
+    MiniDbSyncPolicy policies[] = {MINIDB_SYNC_INTERVAL, MINIDB_SYNC_EVERY_N_OPS, MINIDB_SYNC_CHECKPOINT};
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        test_remove(TEST_PATH);
+        MiniDbOptions options = {0};
+        options.change_log = true;
+        options.sync_policy = policies[i];
+        options.sync_interval_ms = 60 * 1000;
+        options.sync_ops = 1000000;
+        MiniDb *db;
+        int64_t value;
+        TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(value), &options) == MINIDB_OK);
+        for (value = 0; value < 100; value++) {
+            TEST_CHECK(minidb_insert(db, value, &value) == MINIDB_OK);
+        }
+
+        TEST_CHECK(test_log_size(TEST_PATH "-changes") == MINIDB_CHANGELOG_START);
+        TEST_CHECK(minidb_checkpoint(db) == MINIDB_OK);
+        int64_t size = test_log_size(TEST_PATH "-changes");
+        TEST_CHECK(size > MINIDB_CHANGELOG_START);
+
+        // A process that dies before persisting its changes leaves none of them in the log
+        pid_t pid = fork();
+        TEST_CHECK(pid >= 0);
+        if (pid == 0) {
+            for (value = 100; value < 200; value++) {
+                minidb_insert(db, value, &value);
+            }
+
+            _exit(0);
+        }
+
+        int status;
+        TEST_CHECK(waitpid(pid, &status, 0) == pid);
+        TEST_CHECK(test_log_size(TEST_PATH "-changes") == size);
+
+        for (value = 100; value < 150; value++) {
+            TEST_CHECK(minidb_insert(db, value, &value) == MINIDB_OK);
+        }
+
+        minidb_close(&db);
+        TEST_CHECK(test_log_size(TEST_PATH "-changes") > size);
+        TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+        TEST_CHECK(minidb_select(db, 149, &value) == MINIDB_OK && value == 149);
+        minidb_close(&db);
+    }
+
+#ifdef MINIDB_TEST_FAULTS
+    // A durable write syncs the log too: one more sync than without a log
+    int64_t syncs[2];
+    for (int logged = 0; logged <= 1; logged++) {
+        test_remove(TEST_PATH);
+        MiniDbOptions options = {0};
+        options.change_log = logged;
+        options.sync_policy = MINIDB_SYNC_EVERY_OP_DURABLE;
+        MiniDb *db;
+        int64_t value = 1;
+        TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(value), &options) == MINIDB_OK);
+        int64_t before = test_fsyncs;
+        TEST_CHECK(minidb_insert(db, 1, &value) == MINIDB_OK);
+        syncs[logged] = test_fsyncs - before;
+        minidb_close(&db);
+    }
+
+    TEST_CHECK(syncs[1] == syncs[0] + 1);
+#endif
+
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * A database that cannot be opened is released without writing its index.
+ */
+static bool test_open_failure(void)
+{
+    test_remove(TEST_PATH);
+    MiniDbOptions options = {0};
+    options.change_log = true;
+    MiniDb *db;
+    int64_t value;
+
+    // The change log cannot be opened, after the index was
+    TEST_CHECK(mkdir(TEST_PATH "-changes", 0755) == 0);
+    FILE *blocker = fopen(TEST_PATH "-changes/blocker", "w");
+    TEST_CHECK(!is_null(blocker));
+    fclose(blocker);
+    TEST_CHECK(minidb_create_ex(&db, TEST_PATH, sizeof(value), &options) != MINIDB_OK && is_null(db));
+
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(value)) == MINIDB_OK);
+    for (value = 0; value < 100; value++) {
+        TEST_CHECK(minidb_insert(db, value, &value) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_set_ttl(db, 5, 60 * 1000) == MINIDB_OK);
+    minidb_close(&db);
+
+    struct stat before;
+    struct stat after;
+    TEST_CHECK(stat(TEST_PATH "-index", &before) == 0);
+    TEST_CHECK(minidb_open_ex(&db, TEST_PATH, &options) != MINIDB_OK && is_null(db));
+    TEST_CHECK(stat(TEST_PATH "-index", &after) == 0 && after.st_ino == before.st_ino);
+    remove(TEST_PATH "-changes/blocker");
+    rmdir(TEST_PATH "-changes");
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    TEST_CHECK(minidb_select(db, 99, &value) == MINIDB_OK && value == 99);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+#ifdef MINIDB_TEST_FAULTS
+/**
+ * A commit that fails halfway refuses further writes and logs nothing; reopening replays its journal.
+ */
+static bool test_partial_commit(void)
+{
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    MiniDbOptions options = {0};
+    options.change_log = true;
+    options.sync_policy = MINIDB_SYNC_CHECKPOINT;
+    MiniDb *db;
+    char buffer[32];
+    size_t length;
+    TEST_CHECK(minidb_create_ex(&db, TEST_PATH, MINIDB_VARLEN, &options) == MINIDB_OK);
+    for (int64_t key = 1; key <= 3; key++) {
+        TEST_CHECK(minidb_insert_varlen(db, key, "base", 5) == MINIDB_OK);
+    }
+
+    // Deferred by the policy, it must survive the failed commit
+    TEST_CHECK(minidb_delete(db, 3) == MINIDB_OK);
+
+    TEST_CHECK(minidb_begin(db) == MINIDB_OK);
+    TEST_CHECK(minidb_insert_varlen(db, 10, "ten", 4) == MINIDB_OK);
+    TEST_CHECK(minidb_update_varlen(db, 1, "one, but longer", 16) == MINIDB_OK);
+    TEST_CHECK(minidb_insert_varlen(db, 11, "eleven", 7) == MINIDB_OK);
+
+    // Key 10 is inserted, key 1 moves without calling the wrapped insert, and key 11 fails
+    test_fail_pager_insert_at = test_pager_inserts + 2;
+    TEST_CHECK(minidb_commit(db) == MINIDB_ERROR_MALLOC_FAIL);
+    test_fail_pager_insert_at = 0;
+
+    TEST_CHECK(minidb_insert_varlen(db, 20, "x", 2) == MINIDB_ERROR_REOPEN_REQUIRED);
+    TEST_CHECK(minidb_delete(db, 2) == MINIDB_ERROR_REOPEN_REQUIRED);
+    TEST_CHECK(minidb_begin(db) == MINIDB_ERROR_REOPEN_REQUIRED);
+    TEST_CHECK(minidb_checkpoint(db) == MINIDB_ERROR_REOPEN_REQUIRED);
+    TEST_CHECK(minidb_backup(db, TEST_BACKUP_PATH) == MINIDB_ERROR_REOPEN_REQUIRED);
+    TEST_CHECK(test_exists(TEST_PATH "-journal"));
+    int64_t log_size = test_log_size(TEST_PATH "-changes");
+    minidb_close(&db);
+    TEST_CHECK(test_log_size(TEST_PATH "-changes") == log_size);
+
+    // A journal that cannot be replayed fails the open, and is kept for the next one
+    struct stat before;
+    struct stat after;
+    TEST_CHECK(stat(TEST_PATH "-index", &before) == 0);
+    test_fail_pager_inserts = true;
+    TEST_CHECK(minidb_open_ex(&db, TEST_PATH, &options) == MINIDB_ERROR_MALLOC_FAIL && is_null(db));
+    test_fail_pager_inserts = false;
+    TEST_CHECK(test_exists(TEST_PATH "-journal"));
+    TEST_CHECK(stat(TEST_PATH "-index", &after) == 0 && after.st_ino == before.st_ino);
+
+    TEST_CHECK(minidb_open_ex(&db, TEST_PATH, &options) == MINIDB_OK);
+    TEST_CHECK(!test_exists(TEST_PATH "-journal"));
+    TEST_CHECK(minidb_select_varlen(db, 10, buffer, sizeof(buffer), &length) == MINIDB_OK && strcmp(buffer, "ten") == 0);
+    TEST_CHECK(minidb_select_varlen(db, 11, buffer, sizeof(buffer), &length) == MINIDB_OK && strcmp(buffer, "eleven") == 0);
+    TEST_CHECK(minidb_select_varlen(db, 1, buffer, sizeof(buffer), &length) == MINIDB_OK && strcmp(buffer, "one, but longer") == 0);
+    TEST_CHECK(minidb_select_varlen(db, 2, buffer, sizeof(buffer), &length) == MINIDB_OK && strcmp(buffer, "base") == 0);
+    TEST_CHECK(minidb_select_varlen(db, 3, buffer, sizeof(buffer), &length) == MINIDB_ERROR_ROW_NOT_FOUND);
+    TEST_CHECK(minidb_insert_varlen(db, 20, "x", 2) == MINIDB_OK);
+    minidb_close(&db);
+
+    MiniDbVerifyReport report;
+    TEST_CHECK(minidb_verify(TEST_PATH, 1, &report) == MINIDB_OK);
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    return true;
+}
+
+/**
+ * A write whose new index image cannot be loaded keeps the old image, and later writes still succeed.
+ */
+static bool test_index_load_failure(void)
+{
+    test_remove(TEST_PATH);
+    MiniDb *db;
+    int64_t value;
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(value)) == MINIDB_OK);
+    for (value = 0; value < 1000; value++) {
+        TEST_CHECK(minidb_insert(db, value, &value) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_delete(db, 5) == MINIDB_OK);
+
+    test_fail_btree_build = true;
+    value = 2000;
+    TEST_CHECK(minidb_insert(db, 2000, &value) == MINIDB_ERROR_MALLOC_FAIL);
+    for (int64_t key = 0; key < 1000; key++) {
+        if (key == 5) {
+            TEST_CHECK(minidb_select(db, key, &value) == MINIDB_ERROR_ROW_NOT_FOUND);
+        } else {
+            TEST_CHECK(minidb_select(db, key, &value) == MINIDB_OK && value == key);
+        }
+    }
+
+    TEST_CHECK(minidb_select(db, 2000, &value) == MINIDB_OK && value == 2000);
+    value = 3000;
+    TEST_CHECK(minidb_insert(db, 3000, &value) == MINIDB_OK);
+    minidb_close(&db);
+
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    MiniDbInfo info;
+    minidb_get_info(db, &info);
+    TEST_CHECK(info.row_count == 1001);
+    TEST_CHECK(minidb_select(db, 999, &value) == MINIDB_OK && value == 999);
+    TEST_CHECK(minidb_select(db, 2000, &value) == MINIDB_OK && value == 2000);
+    TEST_CHECK(minidb_select(db, 3000, &value) == MINIDB_OK && value == 3000);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+/**
+ * Fills the slotted pages up to 64 pages less the given count, then inserts a row whose last page
+ * cannot be allocated. No page may be left behind.
+ */
+static bool test_overflow_alloc_failure_at(int64_t overflow_pages)
+{
+    static char data[3 * 4000];
+    static char buffer[3 * 4000];
+    size_t row_length = (MINIDB_PAGE_SIZE - sizeof(MiniDbPageHeader) - 16) / 4;
+    size_t length;
+    MiniDbInfo info;
+    MiniDb *db;
+    int64_t rows = 0;
+    test_remove(TEST_PATH);
+    TEST_CHECK(minidb_create_varlen(&db, TEST_PATH) == MINIDB_OK);
+    do {
+        memset(buffer, (int) rows, row_length);
+        TEST_CHECK(minidb_insert_varlen(db, rows, buffer, row_length) == MINIDB_OK);
+        rows++;
+        minidb_get_info(db, &info);
+    } while (info.page_count < 64 - overflow_pages || rows % 4 != 0);
+    TEST_CHECK(info.page_count == 64 - overflow_pages);
+
+    // Page 64 grows the page table: with 3 pages the chain needs it, with 2 the slotted page does
+    size_t data_length = (size_t) overflow_pages * 4000;
+    memset(data, 'b', sizeof(data));
+    test_fail_realloc_size = 128 * sizeof(uint16_t);
+    MiniDbState state = minidb_insert_varlen(db, 9999, data, data_length);
+    test_fail_realloc_size = 0;
+    TEST_CHECK(state == MINIDB_ERROR_MALLOC_FAIL);
+    minidb_get_info(db, &info);
+    TEST_CHECK(info.page_count == 64);
+    TEST_CHECK(minidb_select_varlen(db, 9999, buffer, sizeof(buffer), &length) == MINIDB_ERROR_ROW_NOT_FOUND);
+
+    TEST_CHECK(minidb_insert_varlen(db, 9999, data, data_length) == MINIDB_OK);
+    minidb_get_info(db, &info);
+    TEST_CHECK(info.page_count == 65);
+    minidb_close(&db);
+
+    MiniDbVerifyReport report;
+    TEST_CHECK(minidb_verify(TEST_PATH, 1, &report) == MINIDB_OK);
+    TEST_CHECK(minidb_open(&db, TEST_PATH) == MINIDB_OK);
+    for (int64_t key = 0; key < rows; key++) {
+        TEST_CHECK(minidb_select_varlen(db, key, buffer, sizeof(buffer), &length) == MINIDB_OK);
+        TEST_CHECK(length == row_length && buffer[row_length - 1] == (char) key);
+    }
+
+    TEST_CHECK(minidb_select_varlen(db, 9999, buffer, sizeof(buffer), &length) == MINIDB_OK && length == data_length);
+    TEST_CHECK(memcmp(buffer, data, data_length) == 0);
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    return true;
+}
+
+static bool test_overflow_alloc_failure(void)
+{
+    return test_overflow_alloc_failure_at(3) && test_overflow_alloc_failure_at(2);
+}
+
+/**
+ * An incremental backup copies every block when the change map could not record some of them.
+ */
+static bool test_change_map_overflow(void)
+{
+    typedef struct LargeRow
+    {
+        char payload[4000];
+        int64_t id;
+    } LargeRow;
+
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    MiniDb *db;
+    LargeRow row;
+    memset(&row, 0, sizeof(row));
+    TEST_CHECK(minidb_create(&db, TEST_PATH, sizeof(row)) == MINIDB_OK);
+    for (int64_t i = 0; i < 500; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    TEST_CHECK(minidb_backup(db, TEST_BACKUP_PATH) == MINIDB_OK);
+
+    // The file grows past the blocks the map holds while the map cannot grow
+    test_fail_realloc_from = 32 * sizeof(uint64_t);
+    for (int64_t i = 500; i < 1500; i++) {
+        row.id = i;
+        TEST_CHECK(minidb_insert(db, i, &row) == MINIDB_OK);
+    }
+
+    test_fail_realloc_from = 0;
+    row.id = -3;
+    TEST_CHECK(minidb_update(db, 3, &row) == MINIDB_OK);
+    TEST_CHECK(minidb_backup_incremental(db, TEST_BACKUP_PATH) == MINIDB_OK);
+    minidb_close(&db);
+
+    MiniDbVerifyReport report;
+    TEST_CHECK(minidb_verify(TEST_BACKUP_PATH, 1, &report) == MINIDB_OK);
+    TEST_CHECK(minidb_open(&db, TEST_BACKUP_PATH) == MINIDB_OK);
+    for (int64_t i = 0; i < 1500; i++) {
+        TEST_CHECK(minidb_select(db, i, &row) == MINIDB_OK && row.id == (i == 3 ? -3 : i));
+    }
+
+    minidb_close(&db);
+    test_remove(TEST_PATH);
+    test_remove(TEST_BACKUP_PATH);
+    return true;
+}
+#endif
+
+static const Test tests[] = {
+    {"commit_rollback", test_commit_rollback},
+    {"journal_replay", test_journal_replay},
+    {"ttl", test_ttl},
+    {"backup", test_backup},
+    {"replica", test_replica},
+    {"damaged_index", test_damaged_index},
+    {"truncated_data", test_truncated_data},
+    {"scan_writes", test_scan_writes},
+    {"deleted_slot_reuse", test_deleted_slot_reuse},
+    {"change_log_order", test_change_log_order},
+    {"open_failure", test_open_failure},
+#ifdef MINIDB_TEST_FAULTS
+    {"partial_commit", test_partial_commit},
+    {"index_load_failure", test_index_load_failure},
+    {"overflow_alloc_failure", test_overflow_alloc_failure},
+    {"change_map_overflow", test_change_map_overflow},
+#endif
+};
+
+int main(int argc, char **argv)
+{
+    const char *name = argc > 1 ? argv[1] : "all";
+    bool found = false;
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (strcmp(name, "all") == 0 || strcmp(name, tests[i].name) == 0) {
+            found = true;
+            bool passed = tests[i].run();
+            printf("%s: %s\n", tests[i].name, passed ? "Ok!" : "Failed");
+            failed += !passed;
+        }
+    }
+
+    if (!found) {
+        printf("Unknown test: %s\n", name);
+        return 1;
+    }
+
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+#include "transaction.h"
+#include "crc32c.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC UINT64_C(0x324C4E524A42444D) // "MDBJRNL2"
+
+/**
+ * The checksum is the CRC32C of the entries and their data followed by the count, so a journal that was
+ * damaged after it was written is not replayed either.
+ */
+typedef struct MiniDbJournalHeader
+{
+    uint64_t magic;
+    int64_t count;
+    uint32_t checksum;
+    uint32_t reserved;
+} MiniDbJournalHeader;
+
+typedef struct MiniDbJournalEntry
+{
+    int32_t type;
+    int32_t reserved;
+    int64_t key;
+    uint64_t length;
+} MiniDbJournalEntry;
+
+bool minidb_file_sync(FILE *fd)
+{
+    if (fflush(fd) != 0) {
+        return false;
+    }
+
+#ifdef _WIN32
+    return _commit(_fileno(fd)) == 0;
+#else
+    return fsync(fileno(fd)) == 0;
+#endif
+}
+
+void minidb_transaction_init(MiniDbTransaction *tx)
+{
+    tx->ops = NULL;
+    tx->count = 0;
+    tx->capacity = 0;
+    btree_init(&tx->pending);
+}
+
+void minidb_transaction_clear(MiniDbTransaction *tx)
+{
+    for (int64_t i = 0; i < tx->count; i++) {
+        free(tx->ops[i].data);
+    }
+
+    free(tx->ops);
+    btree_destroy(&tx->pending);
+    minidb_transaction_init(tx);
+}
+
+MiniDbState minidb_transaction_append(MiniDbTransaction *tx, MiniDbOpType type, int64_t key, const void *data, size_t length)
+{
+    if (tx->count == tx->capacity) {
+        int64_t capacity = tx->capacity > 0 ? tx->capacity * 2 : 16;
+        MiniDbOp *ops = realloc(tx->ops, capacity * sizeof(MiniDbOp));
+        if (is_null(ops)) {
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        tx->ops = ops;
+        tx->capacity = capacity;
+    }
+
+    MiniDbOp *op = &tx->ops[tx->count];
+    op->type = type;
+    op->key = key;
+    op->length = type == MINIDB_OP_DELETE ? 0 : length;
+    op->data = NULL;
+
+    if (op->length > 0) {
+        op->data = malloc(op->length);
+        if (is_null(op->data)) {
+            return MINIDB_ERROR_MALLOC_FAIL;
+        }
+
+        memcpy(op->data, data, op->length);
+    }
+
+    // The pending index maps each key to its most recent operation on the row
+    if (type != MINIDB_OP_EXPIRE) {
+        BTreeNode *node = btree_search(&tx->pending, key);
+        if (is_null(node)) {
+            if (is_null(btree_insert(&tx->pending, key, tx->count))) {
+                free(op->data);
+                return MINIDB_ERROR_MALLOC_FAIL;
+            }
+        } else {
+            node->value = tx->count;
+        }
+    }
+
+    tx->count++;
+    return MINIDB_OK;
+}
+
+const MiniDbOp *minidb_transaction_find(const MiniDbTransaction *tx, int64_t key)
+{
+    BTreeNode *node = btree_search(&tx->pending, key);
+    return is_null(node) ? NULL : &tx->ops[node->value];
+}
+
+MiniDbState minidb_transaction_journal_write(const MiniDbTransaction *tx, const char *path)
+{
+    FILE *fd = fopen(path, "wb");
+    if (is_null(fd)) {
+        return MINIDB_ERROR_CANNOT_OPEN_FILE;
+    }
+
+    // The header is written last, so a journal torn in the middle is never replayed
+    MiniDbJournalHeader header = {0, 0, 0, 0};
+    fwrite(&header, sizeof(header), 1, fd);
+
+    for (int64_t i = 0; i < tx->count; i++) {
+        const MiniDbOp *op = &tx->ops[i];
+        MiniDbJournalEntry entry = {(int32_t) op->type, 0, op->key, op->length};
+        fwrite(&entry, sizeof(entry), 1, fd);
+        header.checksum = minidb_crc32c(header.checksum, &entry, sizeof(entry));
+        if (op->length > 0) {
+            fwrite(op->data, op->length, 1, fd);
+            header.checksum = minidb_crc32c(header.checksum, op->data, op->length);
+        }
+    }
+
+    bool written = minidb_file_sync(fd);
+    header.magic = JOURNAL_MAGIC;
+    header.count = tx->count;
+    header.checksum = minidb_crc32c(header.checksum, &header.count, sizeof(header.count));
+    fseek(fd, 0, SEEK_SET);
+    written &= fwrite(&header, sizeof(header), 1, fd) == 1 && minidb_file_sync(fd);
+    written &= fclose(fd) == 0;
+    if (!written) {
+        remove(path);
+        return MINIDB_ERROR;
+    }
+
+    return MINIDB_OK;
+}
+
+bool minidb_transaction_journal_read(MiniDbTransaction *tx, const char *path)
+{
+    FILE *fd = fopen(path, "rb");
+    if (is_null(fd)) {
+        return false;
+    }
+
+    MiniDbJournalHeader header;
+    bool complete = fread(&header, sizeof(header), 1, fd) == 1 && header.magic == JOURNAL_MAGIC;
+    uint32_t checksum = 0;
+    void *data = NULL;
+
+    for (int64_t i = 0; complete && i < header.count; i++) {
+        MiniDbJournalEntry entry;
+        if (fread(&entry, sizeof(entry), 1, fd) != 1) {
+            complete = false;
+            break;
+        }
+
+        void *buffer = realloc(data, entry.length > 0 ? entry.length : 1);
+        if (is_null(buffer)) {
+            complete = false;
+            break;
+        }
+
+        data = buffer;
+        if (entry.length > 0 && fread(data, entry.length, 1, fd) != 1) {
+            complete = false;
+            break;
+        }
+
+        checksum = minidb_crc32c(checksum, &entry, sizeof(entry));
+        checksum = minidb_crc32c(checksum, data, entry.length);
+        complete = minidb_transaction_append(tx, entry.type, entry.key, data, entry.length) == MINIDB_OK;
+    }
+
+    complete = complete && minidb_crc32c(checksum, &header.count, sizeof(header.count)) == header.checksum;
+    free(data);
+    fclose(fd);
+    if (!complete) {
+        minidb_transaction_clear(tx);
+    }
+
+    return complete;
+}
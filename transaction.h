@@ -0,0 +1,97 @@
+#pragma once
+
+#include "minidb.h"
+#include "btree.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum MiniDbOpType
+{
+    MINIDB_OP_INSERT,
+    MINIDB_OP_UPDATE,
+    MINIDB_OP_DELETE,
+    MINIDB_OP_EXPIRE, // Sets the expiry time of an existing row, stored in data as an int64_t (0 = never)
+} MiniDbOpType;
+
+typedef struct MiniDbOp
+{
+    MiniDbOpType type;
+    int64_t key;
+    size_t length;
+    void *data;
+} MiniDbOp;
+
+typedef struct MiniDbTransaction
+{
+    MiniDbOp *ops;
+    int64_t count;
+    int64_t capacity;
+    BTree pending;
+} MiniDbTransaction;
+
+/**
+ * Initializes an empty transaction.
+ *
+ * @param tx The transaction to initialize (stack-allocated).
+ */
+void minidb_transaction_init(MiniDbTransaction *tx);
+
+/**
+ * Releases every buffered operation. The transaction can be reused afterwards.
+ *
+ * @param tx The transaction to clear.
+ */
+void minidb_transaction_clear(MiniDbTransaction *tx);
+
+/**
+ * Buffers a copy of an operation.
+ *
+ * @param tx The transaction.
+ * @param type The type of operation.
+ * @param key The key of the row.
+ * @param data The row data, or NULL for deletes.
+ * @param length The length of the row data.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_transaction_append(MiniDbTransaction *tx, MiniDbOpType type, int64_t key, const void *data, size_t length);
+
+/**
+ * Returns the last buffered operation on the given key, or NULL if the key was not touched.
+ * Expiry changes are not returned, since they do not change the row.
+ *
+ * @param tx The transaction.
+ * @param key The key to search.
+ */
+const MiniDbOp *minidb_transaction_find(const MiniDbTransaction *tx, int64_t key);
+
+/**
+ * Writes every buffered operation to a journal file and syncs it.
+ *
+ * @param tx The transaction.
+ * @param path The path of the journal file.
+ *
+ * @return MINIDB_OK on success.
+ */
+MiniDbState minidb_transaction_journal_write(const MiniDbTransaction *tx, const char *path);
+
+/**
+ * Loads the operations of a complete journal file. Incomplete journals, and those that do not match their
+ * checksum, are ignored.
+ *
+ * @param tx The transaction where the operations will be stored (must be empty).
+ * @param path The path of the journal file.
+ *
+ * @return True if a complete journal was loaded.
+ */
+bool minidb_transaction_journal_read(MiniDbTransaction *tx, const char *path);
+
+/**
+ * Flushes a file and asks the operating system to write it to the storage device.
+ *
+ * @param fd The file to sync.
+ *
+ * @return False if the file could not be written or synced.
+ */
+bool minidb_file_sync(FILE *fd);